@@ -18,11 +18,17 @@ from openpyxl.cell import get_column_letter
 #    pandas
 #    openpyxl
 
-# Returns a list of strings representing the log file paths
+# Returns a list of strings representing the log file paths. The .summary file written beside each
+# log is used rather than the log itself, which also holds the R and K lines. Logs of older runs
+# without a .summary file are read as such.
 def get_log_files_list(log_dir):
     log_files = []
-    for f in os.listdir(log_dir):
-        if f.endswith(".log"):
+    names = os.listdir(log_dir)
+    summaries = set(f for f in names if f.endswith(".summary"))
+    for f in names:
+        if f.endswith(".summary"):
+            log_files.append(log_dir + os.sep + f)
+        elif f.endswith(".log") and f[:-len(".log")] + ".summary" not in summaries:
             log_files.append(log_dir + os.sep + f)
     return log_files
 
@@ -35,6 +41,12 @@ def parse_log_files(log_files):
             for line in fh:
                 if line.startswith('K\t') or line.startswith('R\t'):
                     continue
+                # Repeated over the run, not part of the summary.
+                if line.startswith('concurrency_sample\t'):
+                    continue
+                # Repeated per owner with --uid-stats and --gid-stats.
+                if line.startswith('uid_stats\t') or line.startswith('gid_stats\t'):
+                    continue
                 lines.append(line.strip())
             if len(lines) == 0:
                 continue
@@ -78,6 +90,16 @@ def convert_columns(df):
 
     bool_columns = ['dry_run', 'purge_success']
 
+    # Left out of the logs of orangefs-purge --kept-bytes omit, so NaN in their rows, which a uint64
+    # column cannot hold.
+    for column in ['kept_bytes', 'percent_bytes_removed', 'pre_purge_avg_file_size',
+                   'post_purge_avg_file_size']:
+        if column not in df:
+            df[column] = float('nan')
+    if df['kept_bytes'].isnull().any():
+        uint64_columns.remove('kept_bytes')
+        float_columns.append('kept_bytes')
+
     dtype_dict_list = [
             {'dtype': 'uint64', 'column_list': uint64_columns},
             {'dtype': 'float', 'column_list': float_columns},
@@ -12,14 +12,18 @@
 # --------------------------------------------------------------------------------------------------
 usage()
 {
-    echo "Usage: ${0} [-a ] [-e <exclusions_file>] [-l <log_dir>] [-t <purge_time_threshold] users_dir" 1>&2;
+    echo "Usage: ${0} [-a ] [-e <exclusions_file>] [-l <log_dir>] [-m <max_duration>] [-t <purge_time_threshold] users_dir" 1>&2;
     exit $1;
 }
 #
 # NOTE Where users_dir is a required argument that is the parent directory where all of your "user
 #      directories" reside.
 # NOTE Where exclusions_file is a file that contains the absolute path of all the user directories
-#      that you would like excluded from being purged.
+#      that you would like excluded from being purged, or of any directory below them. A component
+#      of a path may be a glob, ** matching any number of components (see orangefs-purge
+#      --exclude-file).
+# NOTE Where max_duration is the number of seconds after which the user directories not yet purged
+#      are deferred to the next run, each user directory being purged in turn until then.
 # NOTE The defaults for the options can be found below under 'Configurables'.
 #
 # Example:
@@ -30,6 +34,9 @@ usage()
 # /mnt/orangefs/ike
 # /mnt/orangefs/david
 #
+# Adding the following line would also skip the .cache directory of every other user:
+# /mnt/orangefs/*/.cache
+#
 # Sample execution and output (output will be tab delimited key value pairs):
 # --------------------------------------------------------------------------------------------------
 #  # orangefs-purge-user-dirs.sh /mnt/orangefs
@@ -62,17 +69,19 @@ fi
 # The absolute path of the directory that contains all of  your "user directories".
 USERS_DIR=
 
-# Should the orangefs-purge-logs2df.py script be run on the generated log files
+# Should the summaries of the generated log files be merged into report-<START_TIME>.tsv by
+# orangefs-purge-report, and then into a spreadsheet by orangefs-purge-logs2df.py when installed
 ANALYTICS_ENABLED=false
 
 # Configurables:
 # ==================================================================================================
     # File containing a list of absolute paths of user directories that you don't want to scan with
     # orangefs-purge. This will only work for directories one level deeper than the USERS_DIR
-    # defined above.
+    # defined above. Paths may contain whitespace.
 EXCLUSIONS_LIST_FILE="/usr/local/etc/orangefs-purge-exclude"
 LOG_DIR="/var/log/orangefs-purge"
 declare -i PURGE_TIME_THRESHOLD=$[60 * 60 * 24 * 31] # 31 days
+declare -i MAX_DURATION=0 # No limit
 # ==================================================================================================
 
 if [ -z "${ORANGEFS_PURGE_INSTALL_DIR}" ]; then
@@ -84,7 +93,7 @@ if [ ! -x "${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge" ]; then
     exit 1
 fi
 
-while getopts ":hae:l:t:" o; do
+while getopts ":hae:l:m:t:" o; do
     case "${o}" in
         a)
             ANALYTICS_ENABLED=true
@@ -101,6 +110,9 @@ while getopts ":hae:l:t:" o; do
         l)
             LOG_DIR=${OPTARG}
             ;;
+        m)
+            MAX_DURATION=${OPTARG}
+            ;;
         t)
             PURGE_TIME_THRESHOLD=${OPTARG}
             ;;
@@ -131,6 +143,7 @@ echo -e "USERS_DIR\t${USERS_DIR}"
 echo -e "EXCLUSIONS_LIST_FILE\t${EXCLUSIONS_LIST_FILE}"
 echo -e "LOG_DIR\t${LOG_DIR}"
 echo -e "PURGE_TIME_THRESHOLD\t${PURGE_TIME_THRESHOLD}"
+echo -e "MAX_DURATION\t${MAX_DURATION}"
 
 # To compute the REMOVAL_BASIS_TIME, substract the PURGE_TIME_THRESHOLD from the current time.
 # Any files with both atime and mtime less than the REMOVAL_BASIS_TIME will be removed!
@@ -140,74 +153,82 @@ readonly REMOVAL_BASIS_TIME=$(echo $[${START_TIME} - ${PURGE_TIME_THRESHOLD}])
 echo -e "START_TIME\t${START_TIME}"
 echo -e "REMOVAL_BASIS_TIME\t${REMOVAL_BASIS_TIME}"
 
+# The logs of the previous run, if any, let orangefs-purge start the user directories that took
+# longest first.
+PREVIOUS_START_TIME=$(ls -1 "${LOG_DIR}" | grep -E '^[0-9]+$' | sort -n | tail -n 1)
+COST_LOGS_OPT=""
+if [ -n "${PREVIOUS_START_TIME}" ]; then
+    COST_LOGS_OPT="--cost-logs=${LOG_DIR}/${PREVIOUS_START_TIME}"
+fi
+
+# The user directories deferred by a run that reached MAX_DURATION are continued by the next one.
+MAX_DURATION_OPT=""
+DEFERRED_OPT=""
+if [ ${MAX_DURATION} -gt 0 ]; then
+    MAX_DURATION_OPT="--max-duration=${MAX_DURATION}"
+    DEFERRED_OPT="--deferred=${LOG_DIR}/deferred"
+fi
+
 # Create subdirectory pertaining to this run so the many generated log files can be easily grouped
 LOG_DIR="${LOG_DIR}/${START_TIME}"
 mkdir "${LOG_DIR}" && chmod u+rwx "${LOG_DIR}"
 
+EXCLUSIONS_OPT=""
 if [ -r "${EXCLUSIONS_LIST_FILE}" ]; then
-    # Build up a string of exclusions to pass to find
-    EXCLUSIONS=""
-    while read dir; do
-        if [ -d "${dir}" ]; then
-            # WARNING Exlusion of directory paths containing whitespace will not be handled
-            # correctly! As is, if your exclusions list file contains paths with whitespace,
-            # the find command will probably fail and therefor no "users log" will be generated
-            # which means the later cat command on it will fail and NO purging will take place.
-            echo -e "excluding\t${dir}"
-            EXCLUSIONS="${EXCLUSIONS} -not -path ${dir}"
-        fi
-    done <<< "$(cat ${EXCLUSIONS_LIST_FILE})" # Only this part runs in a subshell!
-
-    # Use find to determine all of the user directories and execute the orangefs-purge program
-    # on each one using the predetermined removal-basis-time above.
-    find ${USERS_DIR} -mindepth 1 -maxdepth 1 -type d ${EXCLUSIONS} -exec bash -c \
-        "echo '{}' >> \"${LOG_DIR}/users-dirs\"" \;
+    EXCLUSIONS_OPT="--exclude-file=${EXCLUSIONS_LIST_FILE}"
+fi
 
+# A single orangefs-purge process purges every user directory, in parallel with --threads N in
+# ORANGEFS_PURGE_EXTRA_OPTS, using the predetermined removal-basis-time above. It writes one log per
+# user directory and prints the excluding and purging lines itself, along with a FAILED line to
+# stderr for each user directory that could not be purged.
+${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge \
+    --users-dir \
+    ${EXCLUSIONS_OPT:+"${EXCLUSIONS_OPT}"} \
+    ${COST_LOGS_OPT:+"${COST_LOGS_OPT}"} \
+    ${MAX_DURATION_OPT:+"${MAX_DURATION_OPT}"} \
+    ${DEFERRED_OPT:+"${DEFERRED_OPT}"} \
+    --log-dir "${LOG_DIR}" \
+    --removal-basis-time=${REMOVAL_BASIS_TIME} \
+    ${ORANGEFS_PURGE_EXTRA_OPTS} -- \
+    "${USERS_DIR}" \
+    2>>"${LOG_DIR}/orangefs-purge.err"
+
+if [[ $? -ne 0 ]]; then
+    purge_error_encountered=true
 else
-    # No exclusions file found.
-    find ${USERS_DIR} -mindepth 1 -maxdepth 1 -type d -exec bash -c \
-        "echo '{}' >> \"${LOG_DIR}/users-dirs\"" \;
+    purge_error_encountered=false
 fi
-
-# Loop over the generated file and execute orangefs-purge once per line/directory.
-# I'm not too concerned with wacky file names such as those with whitespace since user level
-# directories are associated with a user's username which should not contain those characters.
-purge_error_encountered=false
-# Using a 'here string' to re-write the while loop to be in the main shell
-# process so that value of purge_error_encountered is not destroyed as was
-# happening in the previous version of this section of code.
-while read dir; do
-    echo -e "purging\t${dir}"
-    ${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge \
-        --log-dir "${LOG_DIR}" \
-        --removal-basis-time=${REMOVAL_BASIS_TIME} \
-        ${ORANGEFS_PURGE_EXTRA_OPTS} -- \
-        "${dir}" \
-        2>>"${LOG_DIR}/orangefs-purge.err"
-
-    if [[ $? -ne 0 ]]; then
-        >&2 printf "FAILED\t${dir}\n"
-        purge_error_encountered=true
-    fi
-done <<< "$(cat ${LOG_DIR}/users-dirs | sort)" # Only this part runs in a subshell!
+>&2 grep -P "^FAILED\t" "${LOG_DIR}/orangefs-purge.err"
 
 analytics_error_encountered=false
 if [ ${ANALYTICS_ENABLED} = true ]; then
     echo -e "ANALYTICS_ENABLED\ttrue"
 
-    if [ ! -x "${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge-logs2df.py" ]; then
-        echo "orangefs-purge-logs2df.py script not found or you don't have permission to execute it!" 1>&2
+    if [ ! -x "${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge-report" ]; then
+        echo "orangefs-purge-report binary not found or you don't have permission to execute it!" 1>&2
         exit 1
     fi
 
-    ${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge-logs2df.py \
-        ${USERS_DIR} \
-        ${LOG_DIR} \
-        ${LOG_DIR} \
-        "report-${START_TIME}" \
-        2>>"${LOG_DIR}/orangefs-purge-logs2df.err" 1>> "${LOG_DIR}/orangefs-purge-logs2df.out"
+    # Only reads the small .summary file written beside each log.
+    ${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge-report \
+        -o "${LOG_DIR}/report-${START_TIME}.tsv" \
+        "${LOG_DIR}" \
+        2>>"${LOG_DIR}/orangefs-purge-report.err"
+    analytics_status=$?
+
+    # The spreadsheet needs pandas and openpyxl, see requirements.txt.
+    if [[ ${analytics_status} -eq 0 && -x "${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge-logs2df.py" ]]; then
+        ${ORANGEFS_PURGE_INSTALL_DIR}/orangefs-purge-logs2df.py \
+            ${USERS_DIR} \
+            ${LOG_DIR} \
+            ${LOG_DIR} \
+            "report-${START_TIME}" \
+            2>>"${LOG_DIR}/orangefs-purge-logs2df.err" 1>> "${LOG_DIR}/orangefs-purge-logs2df.out"
+        analytics_status=$?
+    fi
 
-    if [[ $? -eq 0 ]]; then
+    if [[ ${analytics_status} -eq 0 ]]; then
         echo -e "ANALYTICS_SUCCESS\ttrue"
     else
         echo -e "ANALYTICS_SUCCESS\tfalse"
@@ -0,0 +1,205 @@
+/*
+ * (C) 2016 Clemson University
+ *
+ * See LICENSE in top-level directory.
+ *
+ * File: purge/src/orangefs-purge-lines.c
+ *
+ * Usage:
+ * -------------------------------------------------------------------------------------------------
+ * Expands the files written by orangefs-purge --log-compressed back to the R and K lines of
+ * --log-removed-files and --log-kept-files:
+ *
+ *     # orangefs-purge-lines [-r] [-k] /var/log/orangefs-purge/1451576306-myusername.lines.gz...
+ *
+ * -r prints the R lines of the removed files, -k the K lines of the kept files, and both are
+ * printed when neither is passed. Lines are printed in the order they were logged, so that
+ *
+ *     # orangefs-purge-lines 1451576306-myusername.lines.gz
+ *
+ * prints what --log-removed-files --log-kept-files would have written to the log. A file left by a
+ * purge that did not finish is expanded up to where it was cut, with a warning.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "orangefs-purge-log.h"
+
+#define LLU(x) ((unsigned long long) (x))
+
+int print_removed = 0;
+int print_kept = 0;
+
+void usage(int status)
+{
+    fprintf(stderr, "Usage: orangefs-purge-lines [-r] [-k] FILE.lines.gz...\n\n\
+        -r      print the R lines of the removed files.\n\
+        -k      print the K lines of the kept files. Both are printed by default.\n");
+    exit(status);
+}
+
+/* Reads an unsigned LEB128 varint. Returns -1 at the end of the file or on a corrupt varint. */
+int read_varint(gzFile gz, uint64_t *valuep)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    int c;
+
+    do
+    {
+        c = gzgetc(gz);
+        if(c < 0 || shift > 63)
+        {
+            return -1;
+        }
+        value |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+
+    *valuep = value;
+    return 0;
+}
+
+/* Prints the lines of path. */
+int lines_print(const char *path)
+{
+    char magic[sizeof(PURGE_LINES_MAGIC) - 1];
+    gzFile gz;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t line_len = 0;
+    uint64_t count = 0;
+    uint64_t expected;
+    uint64_t shared;
+    uint64_t suffix_len;
+    int ret = -1;
+    int tag;
+
+    gz = gzopen(path, "rb");
+    if(!gz)
+    {
+        fprintf(stderr, "%s: ERROR: could not open %s\n", __func__, path);
+        return -1;
+    }
+    if(gzread(gz, magic, sizeof(magic)) != (int) sizeof(magic) ||
+       memcmp(magic, PURGE_LINES_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: not a lines file: %s\n", __func__, path);
+        goto cleanup;
+    }
+
+    while((tag = gzgetc(gz)) >= 0 && tag != PURGE_LINES_END)
+    {
+        if(read_varint(gz, &shared) != 0 || read_varint(gz, &suffix_len) != 0 ||
+           shared > line_len || suffix_len > SIZE_MAX / 2 - shared)
+        {
+            break;
+        }
+
+        /* The line keeps the bytes it shares with the previous one. */
+        if(shared + suffix_len + 1 > line_size)
+        {
+            char *grown;
+
+            line_size = 2 * (shared + suffix_len + 1);
+            grown = (char *) realloc(line, line_size);
+            if(!grown)
+            {
+                fprintf(stderr, "%s: ERROR: could not allocate a line of %s\n", __func__, path);
+                goto cleanup;
+            }
+            line = grown;
+        }
+        if(suffix_len > 0 &&
+           gzread(gz, &line[shared], suffix_len) != (int) suffix_len)
+        {
+            break;
+        }
+        line_len = shared + suffix_len;
+        count++;
+
+        if((tag == PURGE_RECORD_REMOVED && print_removed) ||
+           (tag == PURGE_RECORD_KEPT && print_kept))
+        {
+            putchar(tag);
+            putchar('\t');
+            fwrite(line, 1, line_len, stdout);
+            putchar('\n');
+        }
+    }
+
+    if(tag != PURGE_LINES_END || read_varint(gz, &expected) != 0)
+    {
+        int errnum;
+        const char *msg = gzerror(gz, &errnum);
+
+        /* zlib's message names the file. */
+        fprintf(stderr,
+                "%s: WARNING: incomplete lines after %llu, the purge did not finish: %s\n",
+                __func__, LLU(count), errnum != Z_OK ? msg : path);
+    }
+    else if(expected != count)
+    {
+        fprintf(stderr, "%s: WARNING: expected %llu lines but found %llu: %s\n",
+                __func__, LLU(expected), LLU(count), path);
+    }
+    ret = 0;
+
+cleanup:
+    free(line);
+    gzclose(gz);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0;
+    int opt;
+    int i;
+
+    while((opt = getopt(argc, argv, "rkh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'r':
+                print_removed = 1;
+                break;
+            case 'k':
+                print_kept = 1;
+                break;
+            case 'h':
+                usage(EXIT_SUCCESS);
+            default:
+                usage(EXIT_FAILURE);
+        }
+    }
+    if(optind == argc)
+    {
+        usage(EXIT_FAILURE);
+    }
+    if(!print_removed && !print_kept)
+    {
+        print_removed = 1;
+        print_kept = 1;
+    }
+
+    for(i = optind; i < argc; i++)
+    {
+        if(lines_print(argv[i]) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if(fflush(stdout) != 0)
+    {
+        ret = -1;
+    }
+
+    return ret == 0 ? 0 : 1;
+}
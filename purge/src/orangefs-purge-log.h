@@ -0,0 +1,69 @@
+/*
+ * (C) 2016 Clemson University
+ *
+ * See LICENSE in top-level directory.
+ *
+ * File: purge/src/orangefs-purge-log.h
+ *
+ * Layout of the files written by orangefs-purge beside its text logs and read back by its tools.
+ * All integers are in the byte order of the host that wrote them.
+ */
+#ifndef ORANGEFS_PURGE_LOG_H
+#define ORANGEFS_PURGE_LOG_H
+
+#include <stdint.h>
+
+/* --log-records writes two files beside each log, named as the log but for their suffix: the .rec
+ * file, a struct purge_records_header_s followed by one struct purge_record_s per directory entry,
+ * and the .names file, the null terminated names the records point into. Records are fixed size so
+ * that the .rec file may be mmapped and indexed. */
+#define PURGE_RECORDS_MAGIC "OFSPREC1"
+#define PURGE_RECORDS_SUFFIX ".rec"
+#define PURGE_NAMES_SUFFIX ".names"
+
+/* What orangefs-purge decided for an entry, the decision member of struct purge_record_s. */
+#define PURGE_RECORD_REMOVED 'R'
+#define PURGE_RECORD_KEPT 'K'
+#define PURGE_RECORD_DIR 'D'
+#define PURGE_RECORD_LINK 'L'
+#define PURGE_RECORD_UNKNOWN 'U'
+
+struct purge_records_header_s
+{
+    char magic[8];
+    uint64_t fs_id;
+    uint64_t current_time;
+    uint64_t removal_basis_time;
+    uint64_t count;             /* Records written, UINT64_MAX until the log is complete. */
+};
+
+/* The name of an entry is relative to the directory whose handle is parent, which has a record of
+ * its own. Directories whose parent was not listed by the same run (the purged directory itself and
+ * those resumed from a --checkpoint or --deferred file) have a parent of 0 and their absolute path
+ * as their name. */
+struct purge_record_s
+{
+    uint64_t handle;
+    uint64_t parent;
+    uint64_t size;              /* As for kept_bytes, 0 when not fetched, see --kept-bytes. */
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t name_offset;       /* Into the .names file. */
+    uint32_t uid;
+    uint32_t gid;
+    uint8_t decision;
+    uint8_t pad[3];
+    uint32_t rule;              /* The line of the --policy rule that decided, 0 without one. */
+};
+
+/* --log-compressed writes the R and K lines of a log, front coded and compressed, to a gzip file
+ * beside it, named as the log but for its suffix. Once decompressed it holds PURGE_LINES_MAGIC and
+ * then, for each line, its tag ('R' or 'K'), the number of leading bytes its path shares with the
+ * path of the previous line, the number of bytes that follow and those bytes. Both numbers are
+ * unsigned LEB128 varints. The lines end with a tag of 0 followed by their number as a varint,
+ * which a file left by a purge that did not finish lacks. */
+#define PURGE_LINES_MAGIC "OFSPFC01"
+#define PURGE_LINES_SUFFIX ".lines.gz"
+#define PURGE_LINES_END 0
+
+#endif
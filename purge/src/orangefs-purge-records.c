@@ -0,0 +1,397 @@
+/*
+ * (C) 2016 Clemson University
+ *
+ * See LICENSE in top-level directory.
+ *
+ * File: purge/src/orangefs-purge-records.c
+ *
+ * Usage:
+ * -------------------------------------------------------------------------------------------------
+ * Converts the records written by orangefs-purge --log-records back to the R and K lines of
+ * --log-removed-files and --log-kept-files:
+ *
+ *     # orangefs-purge-records [-r] [-k] /var/log/orangefs-purge/1451576306-myusername.rec...
+ *
+ * The .names file of each .rec file is expected beside it. -r prints the R lines of the removed
+ * files, -k the K lines of the kept files, and both are printed when neither is passed. Lines are
+ * printed in the order of the records, which with several walker threads is not the order of the
+ * directory tree. As in the log, the lines of files decided by a --policy rule end with its line.
+ *
+ * The records only hold the name of each entry along with the handle of its directory, so the paths
+ * are rebuilt by following the records of the directories up to one whose absolute path was
+ * recorded, see struct purge_record_s.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "orangefs-purge-log.h"
+
+#define LLU(x) ((unsigned long long) (x))
+/* Directories nested deeper than this are assumed to be a loop of corrupt records. */
+#define MAX_DEPTH 4096
+
+/* A mapped .rec file and its .names file. dir_slots is an open addressing table of the indexes plus
+ * one (0 for an empty slot) of the directory records, keyed by handle. */
+struct records_s
+{
+    const char *path;
+    char *map;
+    size_t map_size;
+    const struct purge_record_s *recs;
+    uint64_t count;
+    char *names;
+    size_t names_size;
+    uint64_t *dir_slots;
+    uint64_t dir_slots_mask;
+};
+
+int print_removed = 0;
+int print_kept = 0;
+
+void usage(int status)
+{
+    fprintf(stderr, "Usage: orangefs-purge-records [-r] [-k] FILE.rec...\n\n\
+        -r      print the R lines of the removed files.\n\
+        -k      print the K lines of the kept files. Both are printed by default.\n");
+    exit(status);
+}
+
+uint64_t handle_hash(uint64_t handle)
+{
+    handle ^= handle >> 33;
+    handle *= 0xff51afd7ed558ccdULL;
+    handle ^= handle >> 33;
+    return handle;
+}
+
+/* Maps path, of size bytes, read only. Returns NULL for an empty file. */
+char *map_file(const char *path, size_t *sizep)
+{
+    struct stat st;
+    char *map = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        fprintf(stderr, "%s: ERROR: could not open %s\n", __func__, path);
+        return NULL;
+    }
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED)
+        {
+            fprintf(stderr, "%s: ERROR: could not map %s\n", __func__, path);
+            map = NULL;
+        }
+        *sizep = st.st_size;
+    }
+    close(fd);
+
+    return map;
+}
+
+/* Returns the index of the record of directory handle, or -1 if it was not recorded. */
+int64_t dir_find(struct records_s *r, uint64_t handle)
+{
+    uint64_t i;
+
+    for(i = handle_hash(handle) & r->dir_slots_mask;
+        r->dir_slots[i];
+        i = (i + 1) & r->dir_slots_mask)
+    {
+        if(r->recs[r->dir_slots[i] - 1].handle == handle)
+        {
+            return (int64_t) r->dir_slots[i] - 1;
+        }
+    }
+    return -1;
+}
+
+const char *record_name(struct records_s *r, const struct purge_record_s *recp)
+{
+    if(recp->name_offset >= r->names_size ||
+       !memchr(&r->names[recp->name_offset], 0, r->names_size - recp->name_offset))
+    {
+        return NULL;
+    }
+    return &r->names[recp->name_offset];
+}
+
+/* Writes the absolute path of directory handle to path, PATH_MAX bytes. Returns its length, or -1
+ * if a directory on the way was not recorded. */
+int dir_path(struct records_s *r, uint64_t handle, char *path)
+{
+    const char *names[MAX_DEPTH];
+    size_t len = 0;
+    int depth = 0;
+    int64_t idx;
+
+    while(depth < MAX_DEPTH && (idx = dir_find(r, handle)) >= 0)
+    {
+        if(!(names[depth++] = record_name(r, &r->recs[idx])))
+        {
+            return -1;
+        }
+        if(r->recs[idx].parent == 0)
+        {
+            break;
+        }
+        handle = r->recs[idx].parent;
+    }
+    if(depth == 0 || depth == MAX_DEPTH || idx < 0)
+    {
+        return -1;
+    }
+
+    /* From the directory with an absolute path down. */
+    while(depth-- > 0)
+    {
+        size_t name_len = strlen(names[depth]);
+
+        if(len + name_len + 2 > PATH_MAX)
+        {
+            return -1;
+        }
+        if(len > 0)
+        {
+            path[len++] = '/';
+        }
+        memcpy(&path[len], names[depth], name_len);
+        len += name_len;
+    }
+    path[len] = 0;
+
+    return len;
+}
+
+/* Maps the records of path and indexes their directories. */
+int records_open(struct records_s *r, const char *path)
+{
+    const struct purge_records_header_s *header;
+    char names_path[PATH_MAX];
+    size_t path_len = strlen(path);
+    size_t suffix_len = strlen(PURGE_RECORDS_SUFFIX);
+    uint64_t slots = 16;
+    uint64_t dirs = 0;
+    uint64_t i;
+
+    memset(r, 0, sizeof(*r));
+    r->path = path;
+
+    if(path_len < suffix_len || strcmp(&path[path_len - suffix_len], PURGE_RECORDS_SUFFIX) != 0 ||
+       path_len - suffix_len + strlen(PURGE_NAMES_SUFFIX) >= PATH_MAX)
+    {
+        fprintf(stderr, "%s: ERROR: not a %s file: %s\n", __func__, PURGE_RECORDS_SUFFIX, path);
+        return -1;
+    }
+    snprintf(names_path, PATH_MAX, "%.*s%s", (int) (path_len - suffix_len), path,
+             PURGE_NAMES_SUFFIX);
+
+    r->map = map_file(path, &r->map_size);
+    if(!r->map || r->map_size < sizeof(*header))
+    {
+        fprintf(stderr, "%s: ERROR: no records in %s\n", __func__, path);
+        return -1;
+    }
+    header = (const struct purge_records_header_s *) r->map;
+    if(memcmp(header->magic, PURGE_RECORDS_MAGIC, sizeof(header->magic)) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: not a records file: %s\n", __func__, path);
+        return -1;
+    }
+
+    r->recs = (const struct purge_record_s *) (r->map + sizeof(*header));
+    r->count = (r->map_size - sizeof(*header)) / sizeof(struct purge_record_s);
+    if(header->count == UINT64_MAX)
+    {
+        fprintf(stderr, "%s: WARNING: incomplete records, the purge did not finish: %s\n",
+                __func__, path);
+    }
+    else if(header->count != r->count)
+    {
+        fprintf(stderr, "%s: WARNING: expected %llu records but found %llu: %s\n",
+                __func__, LLU(header->count), LLU(r->count), path);
+    }
+
+    r->names = map_file(names_path, &r->names_size);
+    if(!r->names && r->count > 0)
+    {
+        fprintf(stderr, "%s: ERROR: no names in %s\n", __func__, names_path);
+        return -1;
+    }
+
+    for(i = 0; i < r->count; i++)
+    {
+        dirs += r->recs[i].decision == PURGE_RECORD_DIR;
+    }
+    while(slots < 2 * dirs)
+    {
+        slots *= 2;
+    }
+    r->dir_slots = (uint64_t *) calloc(slots, sizeof(uint64_t));
+    if(!r->dir_slots)
+    {
+        fprintf(stderr, "%s: ERROR: could not index %llu directories\n", __func__, LLU(dirs));
+        return -1;
+    }
+    r->dir_slots_mask = slots - 1;
+
+    for(i = 0; i < r->count; i++)
+    {
+        uint64_t s;
+
+        if(r->recs[i].decision != PURGE_RECORD_DIR)
+        {
+            continue;
+        }
+        for(s = handle_hash(r->recs[i].handle) & r->dir_slots_mask;
+            r->dir_slots[s];
+            s = (s + 1) & r->dir_slots_mask)
+        {
+            if(r->recs[r->dir_slots[s] - 1].handle == r->recs[i].handle)
+            {
+                break;
+            }
+        }
+        /* A directory recorded twice keeps its first record. */
+        if(!r->dir_slots[s])
+        {
+            r->dir_slots[s] = i + 1;
+        }
+    }
+
+    return 0;
+}
+
+void records_close(struct records_s *r)
+{
+    if(r->map)
+    {
+        munmap(r->map, r->map_size);
+    }
+    if(r->names)
+    {
+        munmap(r->names, r->names_size);
+    }
+    free(r->dir_slots);
+}
+
+/* Prints the R and K lines of the records of path. Consecutive entries of the same directory reuse
+ * its path. */
+int records_print(const char *path)
+{
+    struct records_s r;
+    char dir[PATH_MAX];
+    uint64_t dir_handle = 0;
+    uint64_t unresolved = 0;
+    uint64_t i;
+    int dir_len = -1;
+    int ret = 0;
+
+    if(records_open(&r, path) != 0)
+    {
+        records_close(&r);
+        return -1;
+    }
+
+    for(i = 0; i < r.count; i++)
+    {
+        const struct purge_record_s *recp = &r.recs[i];
+        const char *name;
+
+        if(!(recp->decision == PURGE_RECORD_REMOVED && print_removed) &&
+           !(recp->decision == PURGE_RECORD_KEPT && print_kept))
+        {
+            continue;
+        }
+
+        if(dir_len < 0 || recp->parent != dir_handle)
+        {
+            dir_handle = recp->parent;
+            dir_len = dir_path(&r, dir_handle, dir);
+        }
+        name = record_name(&r, recp);
+        if(dir_len < 0 || !name)
+        {
+            unresolved++;
+            continue;
+        }
+
+        if(recp->rule)
+        {
+            printf("%c\t%s/%s\t%u\n", recp->decision, dir, name, recp->rule);
+        }
+        else
+        {
+            printf("%c\t%s/%s\n", recp->decision, dir, name);
+        }
+    }
+
+    if(unresolved > 0)
+    {
+        fprintf(stderr, "%s: ERROR: could not rebuild the path of %llu entries of %s\n",
+                __func__, LLU(unresolved), path);
+        ret = -1;
+    }
+    records_close(&r);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0;
+    int opt;
+    int i;
+
+    while((opt = getopt(argc, argv, "rkh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'r':
+                print_removed = 1;
+                break;
+            case 'k':
+                print_kept = 1;
+                break;
+            case 'h':
+                usage(EXIT_SUCCESS);
+            default:
+                usage(EXIT_FAILURE);
+        }
+    }
+    if(optind == argc)
+    {
+        usage(EXIT_FAILURE);
+    }
+    if(!print_removed && !print_kept)
+    {
+        print_removed = 1;
+        print_kept = 1;
+    }
+
+    for(i = optind; i < argc; i++)
+    {
+        if(records_print(argv[i]) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if(fflush(stdout) != 0)
+    {
+        ret = -1;
+    }
+
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,590 @@
+/*
+ * (C) 2016 Clemson University
+ *
+ * See LICENSE in top-level directory.
+ *
+ * File: purge/src/orangefs-purge-report.c
+ *
+ * Usage:
+ * -------------------------------------------------------------------------------------------------
+ * Merges the .summary files written beside the logs of orangefs-purge into a single report with a
+ * row per log and a column per summary value:
+ *
+ *     # orangefs-purge-report [-c] [-u | -g] [-o REPORT] /var/log/orangefs-purge/1451576306...
+ *
+ * Every .summary file of a directory argument is read, along with every file argument. The report
+ * is tab separated, or comma separated with -c, starts with a row naming the columns and is written
+ * to REPORT, or to stdout by default. The first column is the directory purged, by which the rows
+ * are sorted; the others follow in the order they first appear in the summaries, so that a value
+ * missing from some summaries (such as scan_status) is left empty in their rows.
+ *
+ * With -u (or -g), the report rather has a row per uid (or gid) holding the sums of the uid_stats
+ * (or gid_stats) lines of every summary, as logged by orangefs-purge --uid-stats (or --gid-stats),
+ * sorted by id. A sum is left empty when some of its lines left it empty, as the kept_bytes of
+ * orangefs-purge --kept-bytes omit is. Without them, those lines are left out of the report.
+ *
+ * Only the small .summary files are read, never the logs and their R and K lines. In tab separated
+ * reports, tabs, newlines and backslashes in values are written as \t, \n and \\. In comma
+ * separated reports, values holding commas, quotes or newlines are quoted.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <limits.h>
+
+#define SUMMARY_SUFFIX ".summary"
+#define OWNER_COUNTERS 9
+
+/* The columns of an owner report, following the id, in the order of the uid_stats lines. */
+const char *owner_columns[OWNER_COUNTERS] = {
+    "removed_bytes",
+    "removed_files",
+    "failed_removed_bytes",
+    "failed_removed_files",
+    "kept_bytes",
+    "kept_files",
+    "directories",
+    "symlinks",
+    "unknown"
+};
+
+/* A uid_stats or gid_stats line. */
+struct owner_row_s
+{
+    unsigned long id;
+    unsigned long long counters[OWNER_COUNTERS];
+    unsigned int unknown;   /* Bit i set when counters[i] was left empty, as kept_bytes is with
+                             * orangefs-purge --kept-bytes omit. */
+};
+
+/* A summary read in full: data holds its lines, split in place into count key and value pairs,
+ * the key of pair i being columns[cols[i]]. */
+struct summary_s
+{
+    char *data;
+    int *cols;
+    char **values;
+    int count;
+    const char *directory;
+};
+
+/* The columns of the report in order, the first being "directory". */
+char **columns = NULL;
+int columns_count = 0;
+int columns_size = 0;
+
+struct summary_s *summaries = NULL;
+size_t summaries_count = 0;
+size_t summaries_size = 0;
+
+/* The owner lines read with -u or -g, owner_key being "uid_stats" or "gid_stats". */
+struct owner_row_s *owner_rows = NULL;
+size_t owner_rows_count = 0;
+size_t owner_rows_size = 0;
+const char *owner_key = NULL;
+
+int csv = 0;
+
+void usage(int status)
+{
+    fprintf(stderr, "Usage: orangefs-purge-report [-c] [-u | -g] [-o REPORT] DIR_OR_SUMMARY...\n\n\
+        -c      write comma rather than tab separated values.\n\
+        -g      write a row per gid of the gid_stats lines rather than a row per summary.\n\
+        -o      write the report to REPORT rather than to stdout.\n\
+        -u      write a row per uid of the uid_stats lines rather than a row per summary.\n");
+    exit(status);
+}
+
+/* Adds the owner line whose value, following its key, is value. */
+int owner_row_add(const char *value)
+{
+    struct owner_row_s *row;
+    char *end;
+    int i;
+
+    if(owner_rows_count == owner_rows_size)
+    {
+        struct owner_row_s *grown;
+
+        owner_rows_size = owner_rows_size ? 2 * owner_rows_size : 1024;
+        grown = (struct owner_row_s *) realloc(owner_rows, owner_rows_size * sizeof(*owner_rows));
+        if(!grown)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate the owner rows\n", __func__);
+            return -1;
+        }
+        owner_rows = grown;
+    }
+    row = &owner_rows[owner_rows_count];
+
+    row->id = strtoul(value, &end, 10);
+    row->unknown = 0;
+    for(i = 0; i < OWNER_COUNTERS; i++)
+    {
+        if(*end != '\t')
+        {
+            fprintf(stderr, "%s: WARNING: ignoring a malformed %s line\n", __func__, owner_key);
+            return 0;
+        }
+        if(end[1] == '\t' || end[1] == '\0')
+        {
+            /* Empty, strtoull would skip the tab and read the next counter. */
+            row->counters[i] = 0;
+            row->unknown |= 1u << i;
+            end++;
+            continue;
+        }
+        row->counters[i] = strtoull(end + 1, &end, 10);
+    }
+    owner_rows_count++;
+
+    return 0;
+}
+
+/* Returns the column of key, adding it if new. Summaries list their keys in the same order, so the
+ * column after that of the previous key is tried first. */
+int column_find(const char *key, int hint)
+{
+    int i;
+
+    if(hint < columns_count && strcmp(columns[hint], key) == 0)
+    {
+        return hint;
+    }
+    for(i = 0; i < columns_count; i++)
+    {
+        if(strcmp(columns[i], key) == 0)
+        {
+            return i;
+        }
+    }
+
+    if(columns_count == columns_size)
+    {
+        char **grown;
+
+        columns_size = columns_size ? 2 * columns_size : 64;
+        grown = (char **) realloc(columns, columns_size * sizeof(char *));
+        if(!grown)
+        {
+            return -1;
+        }
+        columns = grown;
+    }
+    columns[columns_count] = strdup(key);
+    if(!columns[columns_count])
+    {
+        return -1;
+    }
+
+    return columns_count++;
+}
+
+/* Reads the summary at path and splits it into its values. */
+int summary_read(const char *path)
+{
+    struct summary_s *sp;
+    struct stat st;
+    char *p;
+    char *end;
+    int lines = 0;
+    int col = 0;
+    int fd;
+
+    if(summaries_count == summaries_size)
+    {
+        struct summary_s *grown;
+
+        summaries_size = summaries_size ? 2 * summaries_size : 1024;
+        grown = (struct summary_s *) realloc(summaries, summaries_size * sizeof(*summaries));
+        if(!grown)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate the summaries\n", __func__);
+            return -1;
+        }
+        summaries = grown;
+    }
+    sp = &summaries[summaries_count];
+    memset(sp, 0, sizeof(*sp));
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: could not open %s\n", __func__, path);
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    sp->data = (char *) malloc(st.st_size + 1);
+    if(!sp->data || read(fd, sp->data, st.st_size) != st.st_size)
+    {
+        fprintf(stderr, "%s: ERROR: could not read %s\n", __func__, path);
+        close(fd);
+        free(sp->data);
+        return -1;
+    }
+    close(fd);
+    sp->data[st.st_size] = 0;
+    end = sp->data + st.st_size;
+
+    for(p = sp->data; p < end; p++)
+    {
+        lines += *p == '\n';
+    }
+    sp->cols = (int *) malloc((lines + 1) * sizeof(int));
+    sp->values = (char **) malloc((lines + 1) * sizeof(char *));
+    if(!sp->cols || !sp->values)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate the values of %s\n", __func__, path);
+        goto error;
+    }
+
+    for(p = sp->data; p < end; )
+    {
+        char *nl = memchr(p, '\n', end - p);
+        char *value;
+
+        if(!nl)
+        {
+            /* A summary cut short by a purge that did not finish. */
+            nl = end;
+        }
+        *nl = 0;
+        value = strchr(p, '\t');
+        if(value && (strncmp(p, "uid_stats\t", 10) == 0 || strncmp(p, "gid_stats\t", 10) == 0))
+        {
+            /* Repeated once per owner, not a column. */
+            if(owner_key && strncmp(p, owner_key, 9) == 0 && owner_row_add(value + 1) != 0)
+            {
+                goto error;
+            }
+        }
+        else if(value)
+        {
+            *value++ = 0;
+            col = column_find(p, col + 1);
+            if(col < 0)
+            {
+                fprintf(stderr, "%s: ERROR: could not allocate the columns\n", __func__);
+                goto error;
+            }
+            sp->cols[sp->count] = col;
+            sp->values[sp->count] = value;
+            sp->count++;
+            if(col == 0)
+            {
+                sp->directory = value;
+            }
+        }
+        p = nl + 1;
+    }
+
+    summaries_count++;
+    return 0;
+
+error:
+    free(sp->data);
+    free(sp->cols);
+    free(sp->values);
+    return -1;
+}
+
+/* Reads every summary in dir. */
+int summaries_read_dir(const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    size_t suffix_len = strlen(SUMMARY_SUFFIX);
+    int ret = 0;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if(!dp)
+    {
+        fprintf(stderr, "%s: ERROR: could not open %s\n", __func__, dir);
+        return -1;
+    }
+    while((entry = readdir(dp)))
+    {
+        size_t name_len = strlen(entry->d_name);
+
+        if(name_len <= suffix_len ||
+           strcmp(&entry->d_name[name_len - suffix_len], SUMMARY_SUFFIX) != 0)
+        {
+            continue;
+        }
+        snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
+        if(summary_read(path) != 0)
+        {
+            ret = -1;
+        }
+    }
+    closedir(dp);
+
+    return ret;
+}
+
+int summary_compare(const void *a, const void *b)
+{
+    const struct summary_s *sa = (const struct summary_s *) a;
+    const struct summary_s *sb = (const struct summary_s *) b;
+
+    return strcmp(sa->directory ? sa->directory : "", sb->directory ? sb->directory : "");
+}
+
+void value_write(FILE *out, const char *value)
+{
+    const char *p;
+
+    if(csv)
+    {
+        if(!strpbrk(value, ",\"\r\n"))
+        {
+            fputs(value, out);
+            return;
+        }
+        putc('"', out);
+        for(p = value; *p; p++)
+        {
+            if(*p == '"')
+            {
+                putc('"', out);
+            }
+            putc(*p, out);
+        }
+        putc('"', out);
+        return;
+    }
+
+    if(!strpbrk(value, "\t\n\\"))
+    {
+        fputs(value, out);
+        return;
+    }
+    for(p = value; *p; p++)
+    {
+        switch(*p)
+        {
+            case '\t':
+                fputs("\\t", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            default:
+                putc(*p, out);
+        }
+    }
+}
+
+int owner_row_compare(const void *a, const void *b)
+{
+    unsigned long ia = ((const struct owner_row_s *) a)->id;
+    unsigned long ib = ((const struct owner_row_s *) b)->id;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/* Writes the owner report, a row per id summing its lines, sorted by id. A sum is left empty when
+ * any of its lines left the counter empty. */
+void owner_report_write(FILE *out)
+{
+    char sep = csv ? ',' : '\t';
+    size_t i;
+    size_t j;
+    int c;
+
+    qsort(owner_rows, owner_rows_count, sizeof(*owner_rows), owner_row_compare);
+
+    fputs(owner_key[0] == 'u' ? "uid" : "gid", out);
+    for(c = 0; c < OWNER_COUNTERS; c++)
+    {
+        fprintf(out, "%c%s", sep, owner_columns[c]);
+    }
+    putc('\n', out);
+
+    for(i = 0; i < owner_rows_count; i = j)
+    {
+        for(j = i + 1; j < owner_rows_count && owner_rows[j].id == owner_rows[i].id; j++)
+        {
+            for(c = 0; c < OWNER_COUNTERS; c++)
+            {
+                owner_rows[i].counters[c] += owner_rows[j].counters[c];
+            }
+            owner_rows[i].unknown |= owner_rows[j].unknown;
+        }
+        fprintf(out, "%lu", owner_rows[i].id);
+        for(c = 0; c < OWNER_COUNTERS; c++)
+        {
+            if(owner_rows[i].unknown & 1u << c)
+            {
+                putc(sep, out);
+                continue;
+            }
+            fprintf(out, "%c%llu", sep, owner_rows[i].counters[c]);
+        }
+        putc('\n', out);
+    }
+}
+
+/* Writes the report, a row per summary sorted by directory. */
+int report_write(FILE *out)
+{
+    const char **row;
+    char sep = csv ? ',' : '\t';
+    size_t i;
+    int c;
+
+    row = (const char **) malloc(columns_count * sizeof(char *));
+    if(!row)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate a row\n", __func__);
+        return -1;
+    }
+
+    qsort(summaries, summaries_count, sizeof(*summaries), summary_compare);
+
+    for(c = 0; c < columns_count; c++)
+    {
+        if(c > 0)
+        {
+            putc(sep, out);
+        }
+        value_write(out, columns[c]);
+    }
+    putc('\n', out);
+
+    for(i = 0; i < summaries_count; i++)
+    {
+        memset(row, 0, columns_count * sizeof(char *));
+        /* A value repeated within a summary keeps its last occurrence. */
+        for(c = 0; c < summaries[i].count; c++)
+        {
+            row[summaries[i].cols[c]] = summaries[i].values[c];
+        }
+        for(c = 0; c < columns_count; c++)
+        {
+            if(c > 0)
+            {
+                putc(sep, out);
+            }
+            if(row[c])
+            {
+                value_write(out, row[c]);
+            }
+        }
+        putc('\n', out);
+    }
+    free(row);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *report_path = NULL;
+    struct stat st;
+    FILE *out = stdout;
+    size_t i;
+    int ret = 0;
+    int opt;
+    int c;
+
+    while((opt = getopt(argc, argv, "cgo:uh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                csv = 1;
+                break;
+            case 'g':
+                owner_key = "gid_stats";
+                break;
+            case 'u':
+                owner_key = "uid_stats";
+                break;
+            case 'o':
+                report_path = optarg;
+                break;
+            case 'h':
+                usage(EXIT_SUCCESS);
+            default:
+                usage(EXIT_FAILURE);
+        }
+    }
+    if(optind == argc)
+    {
+        usage(EXIT_FAILURE);
+    }
+
+    if(column_find("directory", 0) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate the columns\n", __func__);
+        return 1;
+    }
+
+    for(c = optind; c < argc; c++)
+    {
+        if(stat(argv[c], &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            ret |= summaries_read_dir(argv[c]);
+        }
+        else
+        {
+            ret |= summary_read(argv[c]);
+        }
+    }
+    if(summaries_count == 0)
+    {
+        fprintf(stderr, "%s: ERROR: no summaries found\n", __func__);
+        return 1;
+    }
+
+    if(report_path)
+    {
+        out = fopen(report_path, "w");
+        if(!out)
+        {
+            fprintf(stderr, "%s: ERROR: could not create %s\n", __func__, report_path);
+            return 1;
+        }
+    }
+    if(owner_key)
+    {
+        owner_report_write(out);
+    }
+    else if(report_write(out) != 0)
+    {
+        ret = -1;
+    }
+    if((report_path ? fclose(out) : fflush(out)) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: could not write the report\n", __func__);
+        ret = -1;
+    }
+
+    for(i = 0; i < summaries_count; i++)
+    {
+        free(summaries[i].data);
+        free(summaries[i].cols);
+        free(summaries[i].values);
+    }
+    free(summaries);
+    free(owner_rows);
+    for(c = 0; c < columns_count; c++)
+    {
+        free(columns[c]);
+    }
+    free(columns);
+
+    return ret == 0 ? 0 : 1;
+}
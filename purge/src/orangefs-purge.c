@@ -37,13 +37,21 @@
  *
  * Note, log_dir defaults to /var/log/orangefs-purge/.
  *
+ * The summary of the purge (every line of the log but the R, K and concurrency_sample lines
+ * described below) is also written to a .summary file of the same name, so that it may be read
+ * without reading past the logged files. The orangefs-purge-report tool merges the .summary files
+ * of a log directory into a single tab or comma separated report:
+ *
+ *     # orangefs-purge-report -o report.tsv <log_dir>
+ *
  * Executing the following command enables the creation of a separate log for multiple "user
  * directories". Note, this will cause one scan to be run per user directory rather than one scan of
  * the overall parent directory:
  *
  *     find /users -mindepth 1 -maxdepth 1 -type d -exec bash -c "orangefs-purge '{}'" \;
  *
- * The above approach is used in the following script: ./scripts/orangefs-purge-user-dirs.sh
+ * The --users-dir option described below does the same from a single process and is used in the
+ * following script: ./scripts/orangefs-purge-user-dirs.sh
  *
  * Note, the parent directory of the log file must exist and be writable. "make install" will
  * attempt to set this up for you!.
@@ -75,6 +83,320 @@
  *
  *     K[ tab ]/users/myusername/myfile
  *
+ * The walkers only copy these lines into LOG_CHUNK_SIZE (256K) chunks, which a dedicated log writer
+ * thread writes to the log while the walkers fill the next ones. Only once the chunks waiting to be
+ * written exceed the following budget does a walker wait for the log writer, the time spent waiting
+ * being reported by the log_stalled_seconds value of the log. A budget of 0 writes every line from
+ * the walkers as they are found, as before.
+ *
+ *     --log-buffer SIZE       (default 16M)
+ *
+ * The R and K lines say nothing of the files beyond their paths. Passing the following option
+ * writes, beside each log and named after it, a .rec file of fixed size records (see
+ * orangefs-purge-log.h) holding the handle, parent directory handle, uid, gid, size, atime, mtime
+ * and decision (R, K, or D, L and U for directories, symbolic links and other entries) of every
+ * entry listed, and a .names file of the names the records point into:
+ *
+ *     --log-records
+ *
+ * The records go through the log writer as well, and the .rec file may be mmapped as is. The
+ * orangefs-purge-records tool prints them back as R and K lines.
+ *
+ * Kept file logs run to many gigabytes, most of each line repeating the path of the previous one.
+ * Passing the following option writes the R and K lines to a .lines.gz file beside each log
+ * instead:
+ *
+ *     --log-compressed
+ *
+ * The log writer stores each path as the number of leading bytes it shares with the previous path
+ * followed by the bytes that differ (front coding, see orangefs-purge-log.h), compressed with zlib.
+ * The orangefs-purge-lines tool expands the file back to R and K lines.
+ *
+ * Large directory trees may be walked by several threads at once by passing the following option
+ * to orangefs-purge:
+ *
+ *     --threads N
+ *
+ * Each thread keeps its own double ended queue of directories waiting to be scanned. A thread pops
+ * directories from the back of its own queue (depth first) and, when its queue is empty, steals
+ * directories from the front of another thread's queue (the oldest, and usually largest, subtrees).
+ * The summary statistics logged are identical to those of a single-threaded run; only the order of
+ * the R and K lines differs.
+ *
+ * Directories holding many entries are listed PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS entries at a
+ * time. Passing the following option requests the next batch of entries with the nonblocking
+ * PVFS_isys_readdirplus while the current batch is being classified and purged, hiding most of the
+ * readdirplus round trip latency:
+ *
+ *     --prefetch
+ *
+ * The entries_per_second value of the log may be used to compare runs with and without prefetch.
+ *
+ * As an alternative to walker threads, a single thread may keep many directory scans going at once
+ * by passing the following option to orangefs-purge:
+ *
+ *     --event-loop N
+ *
+ * This walker only uses nonblocking PVFS_isys_* functions (readdirplus and remove, along with the
+ * getattr, geteattr_list and ref_lookup needed by --kept-bytes, --exempt-xattr and --marker) and
+ * keeps up to N of these operations in flight, across as many directories as needed, waiting for
+ * them with PVFS_sys_testsome. It cannot be combined with --threads. A batch that has to wait for
+ * the sizes or tags of its entries to be fetched (see --kept-bytes, --marker and --exempt-xattr)
+ * has the next batch of its directory requested meanwhile, as --prefetch does for the walker
+ * threads; the next batch is classified once the previous one has been.
+ *
+ * No walker recurses: directories waiting to be scanned are queued and the memory they hold is
+ * accounted for. Once it exceeds the following budget, large directories are scanned one batch at a
+ * time, interleaved with their subdirectories, so that memory use stays bounded however deep or
+ * wide the directory tree is. The peak_queued_bytes value of the log reports the high-water mark.
+ *
+ *     --memory-budget SIZE    (default 64M)
+ *
+ * Removing a file striped over many I/O servers takes a round trip to each of them. Passing the
+ * following option lets each walker keep up to N nonblocking PVFS_isys_remove operations in flight
+ * instead of removing expired files one at a time. With --event-loop, it limits how many of the
+ * event loop's operations in flight may be removals. Failed removals are accounted for exactly as
+ * before.
+ *
+ *     --remove-window N
+ *
+ * OrangeFS spreads directories and files over its metadata servers by handle range, so a walk in
+ * tree order tends to keep the server owning the current part of the tree busy while the others
+ * idle. With --event-loop, passing the following option maps every handle to its metadata server
+ * and issues operations to each server in turn, with at most N of them in flight per server:
+ *
+ *     --server-inflight N
+ *
+ * A full speed walk slows down interactive use of the metadata servers, such as ls. To let purges
+ * run during the day, the following options limit the readdirplus, getattr and remove operations
+ * of all walkers to RATE per second with a token bucket, optionally with a different RATE for some
+ * periods of the day (local time, periods may span midnight):
+ *
+ *     --rate RATE
+ *     --rate-schedule HH:MM-HH:MM=RATE[,HH:MM-HH:MM=RATE]...
+ *
+ * A RATE of 0 means no limit. The throttled_seconds value of the log reports how long walkers
+ * waited for the limiter, summed over all walkers.
+ *
+ * Rather than keeping a fixed number of operations in flight, the event loop walker may tune it to
+ * what the file system can absorb at the moment by passing the following option along with
+ * --event-loop N:
+ *
+ *     --adaptive
+ *
+ * The walker starts with a single operation in flight and then, after every epoch of as many
+ * completed operations as it allows in flight, compares the latency of the epoch's readdirplus,
+ * getattr and remove operations to the lowest epoch latency seen so far for each kind (the
+ * baseline). As long as latency stays near the baseline, concurrency grows: it doubles until it
+ * first has to back off, then grows by one per epoch. Once latency climbs to twice the baseline,
+ * concurrency is halved. It never exceeds N. The log gets a line every second of the walk:
+ *
+ *     concurrency_sample[ tab ]<seconds since walk start>[ tab ]<concurrency>[ tab ]<latency ratio>
+ *
+ * Asking readdirplus for the size of a file striped over many I/O servers makes the metadata server
+ * ask each of them for the size of its part, even for the files that are kept. The following option
+ * lists directories with the type, atime and mtime of their entries only:
+ *
+ *     --kept-bytes MODE
+ *
+ * where MODE is one of:
+ *   - exact:    the default, sizes are listed along with the other attributes.
+ *   - estimate: sizes are fetched with nonblocking getattrs for the expired files of each batch and
+ *               for one kept file in --size-sample N (100 by default). kept_bytes is estimated from
+ *               the average size of the sampled files.
+ *   - omit:     sizes are only fetched for the expired files. kept_bytes, percent_bytes_removed,
+ *               pre_purge_avg_file_size and post_purge_avg_file_size are left out of the log, and
+ *               the kept_bytes of the uid_stats and gid_stats lines is left empty.
+ * The kept_bytes_mode value of the log tells which of exact, estimated or omitted kept_bytes is.
+ *
+ * Most directories of a monthly purge hold nothing but young files and have not changed since the
+ * previous run. Passing the following option records, for every directory listed, its handle, its
+ * mtime, the oldest max(atime, mtime) of its files, its kept file counters and its subdirectories:
+ *
+ *     --index FILE
+ *
+ * On the next run with the same FILE, a directory is not listed when its mtime is unchanged (no
+ * entry was created, removed or renamed in it) and its oldest file is still no older than the new
+ * removal-basis-time; its counters are taken from the index and its subdirectories are checked the
+ * same way, each with a getattr for its mtime. Reading or writing a file only makes it younger, so
+ * this never keeps a file that a full listing would remove, unless its atime or mtime was set back
+ * in time (touch -d) since the directory was listed. kept_bytes does not reflect the files of such
+ * directories that grew or shrank since, and their K lines are not logged. The following option
+ * lists every directory regardless, while still writing a fresh index:
+ *
+ *     --full
+ *
+ * The index is written next to FILE and renamed over it only if the walk succeeded. The
+ * index_skipped_directories value of the log counts the directories that were not listed. The index
+ * is in host byte order and only used by the threaded walkers (not with --event-loop).
+ *
+ * A walk of a large file system may be cut short by a server failover or a reboot. The following
+ * option saves the directories waiting to be scanned, where to resume the listing of those that
+ * were partially listed, the removal-basis-time and the counters so far to FILE every
+ * --checkpoint-interval seconds (600 by default, 0 for none) and when SIGTERM is received, after
+ * which the purge exits:
+ *
+ *     --checkpoint FILE
+ *
+ * Walkers first finish the batch of entries at hand and their removals in flight, so nothing is
+ * counted twice. A later run passed the same FILE and the following option carries on from there,
+ * without listing the directories that had been completed, and logs the counters of both runs:
+ *
+ *     --resume
+ *
+ * If the purge died instead, the removals that happened after the last checkpoint are missing from
+ * the counters. FILE is removed once the walk completes. Checkpoints are only written by the
+ * threaded walkers (not with --event-loop) and cannot be combined with --index.
+ *
+ * Rather than running orangefs-purge once per user directory, a single run may purge several
+ * directories, each with its own log named after the time its purge started as above, either by
+ * passing them all as arguments or by passing a parent directory along with the following option to
+ * purge each of its subdirectories:
+ *
+ *     # orangefs-purge --users-dir [OPTIONS]... /users
+ *
+ * Directories listed, one absolute path per line, in the file passed to the following option are
+ * skipped, whether a directory to purge or one found below it at any depth:
+ *
+ *     --exclude-file FILE
+ *
+ * Any component of a line may be a glob as in fnmatch(3), a * matching within a single component,
+ * so that /scratch/tmp* skips every directory of /scratch whose name starts with tmp. A component
+ * of ** matches any number of them, so that a line of /users, ** and .cache joined by slashes skips
+ * every .cache directory below /users. The lines are compiled into a trie of components, against
+ * which each subdirectory is checked before it is queued, so that no readdirplus is ever issued for
+ * an excluded directory nor any below it. The excluded_directories value of the log counts them.
+ * This option may be used with a single directory as well.
+ *
+ * The directories are started in alphabetical order, unless ordered by cost as described below, and
+ * up to --threads of them are purged at once, the walkers stealing directories from all of them.
+ * As orangefs-purge-user-dirs.sh does, an "excluding", "purging" or "FAILED" line followed by a
+ * tab and the directory is printed for each of them, the first two to stdout and the last to stderr
+ * once a directory could not be resolved or scanned; the others carry on. peak_queued_bytes and
+ * throttled_seconds are those of the whole run.
+ * Several directories cannot be purged with --event-loop, --index or --checkpoint.
+ *
+ * A run ends once its largest directory has been purged, so starting it last leaves the other
+ * walkers idle in the meantime. The following options start the costliest directories first
+ * (longest processing time first), directories of unknown cost coming last in alphabetical order:
+ *
+ *     --cost-logs DIR
+ *     --cost-table FILE
+ *
+ * DIR is the --log-dir of the previous run, whose logs give the duration_seconds and the number of
+ * entries of each directory being purged, the latest log of a directory being used. FILE records
+ * the entries listed under every directory up to COST_TABLE_DEPTH (2) levels below the directories
+ * being purged, and is rewritten by every run that completes. Once read, the directories being
+ * purged are ordered by it when their logs do not tell them apart, and the subdirectories found in
+ * every batch of entries are queued so that the walkers stealing them take the costliest first.
+ * --cost-logs needs several directories; --cost-table cannot be combined with --event-loop or
+ * --checkpoint.
+ *
+ * A run that may not outlast its maintenance window is bounded by:
+ *
+ *     --max-duration SECONDS
+ *     --deferred FILE
+ *
+ * Rather than purging the first directories to completion while the last ones wait, the time left
+ * is shared: each directory being purged gets a slice of the time left, divided among the
+ * directories not yet purged and multiplied by the number purged at once. Once its slice is over
+ * and other directories are waiting, the directories it has yet to scan are set aside, its walkers
+ * finish the batch at hand and the directory goes back to the end of the queue, its log left open.
+ * Once SECONDS have elapsed every directory still unfinished is set aside the same way, and its
+ * unscanned directories are saved to FILE. The next run given the same FILE starts with those
+ * directories and only scans what is left of them. Each log then ends with "scan_status" followed
+ * by "completed", "deferred" or "failed", and with --deferred starts with "scan_resumed" followed
+ * by "true" or "false". FILE is removed once nothing is deferred. Both options need several
+ * directories.
+ *
+ * To tell who the space removed and kept belongs to, the following options end the summary with a
+ * line per owner (or group) of the entries listed:
+ *
+ *     --uid-stats
+ *     --gid-stats
+ *
+ * Each line is "uid_stats" (or "gid_stats") followed by the id, removed_bytes, removed_files,
+ * failed_removed_bytes, failed_removed_files, kept_bytes, kept_files, directories, symlinks and
+ * unknown, tab separated and sorted by id, so that the lines of every owner add up to the counters
+ * of the summary. Estimated kept bytes use the samples of the whole directory, omitted ones are
+ * left empty. The entries of directories skipped thanks to --index are not attributed to any
+ * owner, and a --resume run only attributes those it listed itself. "orangefs-purge-report -u"
+ * (or -g) sums these lines over the summaries of a log directory.
+ *
+ * Files are removed when both their atime and mtime are older than the removal-basis-time unless
+ * the following option gives the rules deciding which files are removed:
+ *
+ *     --policy FILE
+ *
+ * Each line of FILE holds a rule, "remove" or "keep" followed by tests joined by "and", several
+ * such alternatives being joined by "or". A file is decided by the first rule, in the order of the
+ * file, with an alternative whose tests all pass, and kept when there is none. A test is a field,
+ * an operator and a value separated by blanks:
+ *   - atime, mtime: the age of the file, in seconds or with an s, m, h, d or w suffix, measured from
+ *                   the start of the run, compared with <, <=, >, >=, = or !=.
+ *   - size:         in bytes or with a K, M, G, T or P suffix, compared likewise.
+ *   - uid, gid:     compared likewise.
+ *   - name, path:   the name or absolute path of the file, = or != a glob pattern, see fnmatch(3).
+ * A '#' starts a comment. For example:
+ *
+ *     keep uid = 0
+ *     keep name = *.keep
+ *     keep path = /users/shared?*
+ *     remove atime > 31d and mtime > 31d or size > 1T and atime > 7d and mtime > 7d
+ *
+ * The rules are compiled once into a flat program of range checks, the default policy being the
+ * two comparisons of "remove atime > 31d and mtime > 31d". R and K lines, and --log-records, of the
+ * files decided by a rule end with a tab and the line of that rule in FILE. Directories and
+ * symbolic links are never removed. --policy cannot be combined with --removal-basis-time or
+ * --index, and one testing the size requires --kept-bytes exact.
+ *
+ * Project areas purged with different thresholds need not be walked by separate runs with their own
+ * --removal-basis-time. Each line of the file passed to the following option holds the absolute
+ * path of a directory and an age, in seconds or with an s, m, h, d or w suffix:
+ *
+ *     --basis-map FILE
+ *
+ *     /scratch/staging        14d
+ *     /scratch/projects/ocean 90d
+ *
+ * The files of the subtree of such a directory are removed once both their atime and mtime are
+ * older than the age, measured from the start of the run, unless a deeper directory of FILE holds
+ * them. The other files go by the removal-basis-time. The directories are resolved to their handles
+ * once at startup, those that cannot be are ignored with a warning, and the walkers then pass the
+ * removal basis time of each directory down to its subdirectories, in the same single pass. The
+ * log of a directory being purged gives the removal_basis_time of its top level directory.
+ * --basis-map cannot be combined with --policy.
+ *
+ * Users may protect a directory by creating an entry in it named as passed to the following option,
+ * such as .nopurge, and with the second option every directory below it as well:
+ *
+ *     --marker NAME
+ *     --marker-subtree
+ *
+ * The files of such a directory that would have been removed are kept and counted by the
+ * exempt_files and exempt_bytes values of the log rather than by kept_files and kept_bytes; they
+ * are logged as kept. The marker is found among the names each readdirplus batch returns, so most
+ * directories cost nothing more. A directory too large for its first batch gets a single lookup of
+ * the marker before any of its files is removed, in case it only comes in a later batch. Whether a
+ * directory holds the marker is saved along with it by --checkpoint and --deferred.
+ * --marker-subtree cannot be combined with --index, whose skipped directories are not listed.
+ *
+ * Files and directories may also be tagged with an extended attribute named by the following
+ * option, such as user.purge.exempt:
+ *
+ *     --exempt-xattr KEY
+ *
+ * A file that would have been removed is kept, and counted as exempt like those of --marker, when
+ * it carries the attribute, and so is every file below a directory that carries it. A value of
+ * until:EPOCH only exempts until EPOCH seconds, any other value for good. The attribute is only
+ * fetched for the files that would be removed and, once such a file turns up, for the directories
+ * above it up to the top level directory, each of them only once however many of its subdirectories
+ * hold such files. Nothing below a tagged directory is fetched, and a tree where nothing expires
+ * costs no fetch at all. The fetches of a readdirplus batch are issued together with nonblocking
+ * calls. A fetch that fails exempts its file, or everything below its directory. The directories
+ * whose tag is not fetched yet are saved along with the directories by --checkpoint and --deferred.
+ * --exempt-xattr cannot be combined with --index, whose skipped directories are not listed.
+ *
  * -------------------------------------------------------------------------------------------------
  *
  * The goal of this application is to purge files from an OrangeFS file system that have not been
@@ -124,13 +446,51 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <zlib.h>
 
 #include "pvfs2.h"
 #include <pvfs2-usrint.h>
 
+#include "orangefs-purge-log.h"
+
 #define PROGRAM_NAME "orangefs-purge"
 #define DEFAULT_LOG_DIR "/var/log/orangefs-purge"
 #define DRY_RUN_ENV_VAR     "DRY_RUN"
+#define DEFAULT_MEMORY_BUDGET (64 * 1024 * 1024)
+#define DEFAULT_LOG_BUFFER (16 * 1024 * 1024)
+/* R and K lines are formatted into chunks of this many bytes, see log_line. */
+#define LOG_CHUNK_SIZE (256 * 1024)
+#define DEFAULT_CHECKPOINT_INTERVAL 600
+
+/* --adaptive grows the event loop's concurrency while the operations of an epoch take less than
+ * ADAPTIVE_INCREASE_RATIO times the baseline latency, and halves it once they take more than
+ * ADAPTIVE_DECREASE_RATIO times the baseline. Baselines below ADAPTIVE_BASELINE_FLOOR seconds are
+ * raised to it, so that jitter of operations served from cache is not mistaken for congestion. */
+#define ADAPTIVE_INCREASE_RATIO 1.25
+#define ADAPTIVE_DECREASE_RATIO 2.0
+#define ADAPTIVE_BASELINE_FLOOR 0.001
+
+/* --index files start with this magic, see struct index_header_s. */
+#define INDEX_MAGIC "OFSPIDX1"
+/* --checkpoint files start with this magic, see struct checkpoint_header_s. */
+#define CHECKPOINT_MAGIC "OFSPCKP5"
+/* --cost-table files start with this magic, see struct cost_rec_s. Directories at most
+ * COST_TABLE_DEPTH levels below their root get a record. */
+#define COST_TABLE_MAGIC "OFSPCST1"
+/* --deferred files start with this magic, see struct deferred_root_s. */
+#define DEFERRED_MAGIC "OFSPDEF4"
+#define COST_TABLE_DEPTH 2
+/* Longest --exempt-xattr value read, until:EPOCH and short tags fit with room to spare. */
+#define TAG_VALUE_MAX 64
+#define INDEX_MTIME_UNKNOWN ((PVFS_time) -1)
 
 #define DAY_SECS            (24 * 60 * 60)
 #define THIRTYONE_DAYS_SECS (31 * DAY_SECS)
@@ -167,21 +527,119 @@ struct purge_stats_s {
     uint64_t lnks;          /* Number of symlinks discovered. */
     uint64_t dirs;          /* Number of directories discovered. */
     uint64_t unknown;       /* Number of dirents with unknown type discovered. */
+    uint64_t sampled_bytes; /* Bytes of the kept files sampled by --kept-bytes estimate. */
+    uint64_t sampled_fils;  /* Kept files sampled by --kept-bytes estimate. */
+    uint64_t excluded_dirs; /* Directories pruned by --exclude-file, not scanned. */
+    uint64_t exempt_bytes;  /* Bytes of the files kept by --marker or --exempt-xattr that would
+                             * have been removed. */
+    uint64_t exempt_fils;   /* Files kept by --marker or --exempt-xattr that would have been
+                             * removed. */
+};
+
+/* The counters of the entries of every owner (--uid-stats) and group (--gid-stats) seen, in an open
+ * addressing table keyed by OWNER_KEY and kept at most half full. Each walker counts into its own
+ * table per root slot, merged as its purge_stats_s are. */
+#define OWNER_UID 1
+#define OWNER_GID 2
+#define OWNER_KEY(kind, id) (((uint64_t) (kind) << 32) | (uint32_t) (id))
+
+struct owner_rec_s
+{
+    uint64_t key;           /* 0 for an empty slot. */
+    struct purge_stats_s stats;
+};
+
+struct owner_table_s
+{
+    struct owner_rec_s *slots;
+    uint64_t mask;
+    uint64_t count;
 };
 
 typedef enum
 {
     LOG_REMOVED_FILES = 256, /* well outside the range of ASCII characters one would use for opts */
-    LOG_KEPT_FILES
+    LOG_KEPT_FILES,
+    PREFETCH,
+    EVENT_LOOP,
+    MEMORY_BUDGET,
+    REMOVE_WINDOW,
+    KEPT_BYTES,
+    SIZE_SAMPLE,
+    SERVER_INFLIGHT,
+    RATE,
+    RATE_SCHEDULE,
+    ADAPTIVE,
+    INDEX,
+    FULL,
+    CHECKPOINT,
+    CHECKPOINT_INTERVAL,
+    RESUME,
+    USERS_DIR,
+    EXCLUDE_FILE,
+    COST_TABLE,
+    COST_LOGS,
+    MAX_DURATION,
+    DEFERRED,
+    LOG_BUFFER,
+    LOG_RECORDS,
+    LOG_COMPRESSED,
+    UID_STATS,
+    GID_STATS,
+    POLICY,
+    BASIS_MAP,
+    MARKER,
+    MARKER_SUBTREE,
+    EXEMPT_XATTR
 } long_opts_no_char_type;
 
+/* How kept_bytes is obtained, see --kept-bytes. */
+typedef enum
+{
+    KEPT_BYTES_EXACT,       /* readdirplus fetches the size of every file. */
+    KEPT_BYTES_ESTIMATE,    /* Sizes are fetched for expired files and a sample of the kept ones. */
+    KEPT_BYTES_OMIT         /* Sizes are fetched for expired files only. */
+} kept_bytes_mode_type;
+
 struct option const long_opts[] =
 {
+    {"adaptive", no_argument, NULL, ADAPTIVE},
+    {"basis-map", required_argument, NULL, BASIS_MAP},
+    {"checkpoint", required_argument, NULL, CHECKPOINT},
+    {"checkpoint-interval", required_argument, NULL, CHECKPOINT_INTERVAL},
+    {"cost-logs", required_argument, NULL, COST_LOGS},
+    {"cost-table", required_argument, NULL, COST_TABLE},
+    {"deferred", required_argument, NULL, DEFERRED},
     {"dry-run", no_argument, NULL, 'd'},
+    {"event-loop", required_argument, NULL, EVENT_LOOP},
+    {"exclude-file", required_argument, NULL, EXCLUDE_FILE},
+    {"exempt-xattr", required_argument, NULL, EXEMPT_XATTR},
+    {"full", no_argument, NULL, FULL},
+    {"gid-stats", no_argument, NULL, GID_STATS},
+    {"index", required_argument, NULL, INDEX},
+    {"kept-bytes", required_argument, NULL, KEPT_BYTES},
+    {"log-buffer", required_argument, NULL, LOG_BUFFER},
+    {"log-compressed", no_argument, NULL, LOG_COMPRESSED},
     {"log-dir", required_argument, NULL, 'l'},
     {"log-removed-files", no_argument, NULL, LOG_REMOVED_FILES},
     {"log-kept-files", no_argument, NULL, LOG_KEPT_FILES},
+    {"log-records", no_argument, NULL, LOG_RECORDS},
+    {"marker", required_argument, NULL, MARKER},
+    {"marker-subtree", no_argument, NULL, MARKER_SUBTREE},
+    {"max-duration", required_argument, NULL, MAX_DURATION},
+    {"memory-budget", required_argument, NULL, MEMORY_BUDGET},
+    {"policy", required_argument, NULL, POLICY},
+    {"prefetch", no_argument, NULL, PREFETCH},
+    {"rate", required_argument, NULL, RATE},
+    {"rate-schedule", required_argument, NULL, RATE_SCHEDULE},
     {"removal-basis-time", required_argument, NULL, 'r'},
+    {"remove-window", required_argument, NULL, REMOVE_WINDOW},
+    {"resume", no_argument, NULL, RESUME},
+    {"server-inflight", required_argument, NULL, SERVER_INFLIGHT},
+    {"size-sample", required_argument, NULL, SIZE_SAMPLE},
+    {"threads", required_argument, NULL, 't'},
+    {"uid-stats", no_argument, NULL, UID_STATS},
+    {"users-dir", no_argument, NULL, USERS_DIR},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}
 };
@@ -193,6 +651,161 @@ struct options_s
     int dry_run;
     int log_removed_files;
     int log_kept_files;
+    int threads;
+    int prefetch;
+    int event_loop;         /* Operations in flight of the event loop walker, 0 when not in use. */
+    uint64_t memory_budget; /* Bytes of memory the queued directories may hold. */
+    int remove_window;      /* Nonblocking removals in flight per walker, 0 for blocking ones. */
+    kept_bytes_mode_type kept_bytes_mode;
+    int size_sample;        /* One kept file in size_sample has its size fetched when estimating. */
+    int server_inflight;    /* Event loop operations in flight per metadata server, 0 for no limit. */
+    double rate;            /* Operations per second outside of rate_windows, 0 for no limit. */
+    struct rate_window_s *rate_windows;
+    int rate_windows_count;
+    int adaptive;           /* Tune the event loop's operations in flight to the observed latency. */
+    char *index_path;       /* Per directory index of the previous run, NULL when not in use. */
+    int full;               /* List every directory even if the index allows skipping it. */
+    char *checkpoint_path;  /* Where the walk is checkpointed, NULL when not in use. */
+    int checkpoint_interval;/* Seconds between checkpoints, 0 for SIGTERM only. */
+    int resume;             /* Continue the walk saved in checkpoint_path. */
+    int users_dir;          /* Purge each subdirectory of the directory argument as a root. */
+    char *exclude_file;     /* Roots not to purge, one absolute path per line. */
+    char *cost_table_path;  /* Entries listed per subtree, NULL when not in use. */
+    char *cost_logs_dir;    /* Logs of the previous run, to start the costliest roots first. */
+    int max_duration;       /* Seconds the roots may be purged for, 0 for no limit. */
+    char *deferred_path;    /* Where roots left unfinished are saved, NULL when not in use. */
+    uint64_t log_buffer;    /* Bytes of R and K lines waiting for the log writer, 0 for none. */
+    int log_records;        /* Write a struct purge_record_s per entry beside every log. */
+    int log_compressed;     /* Write the R and K lines front coded and compressed, not to the log. */
+    int uid_stats;          /* Count the entries of each owner, see struct owner_table_s. */
+    int gid_stats;          /* Likewise for each group. */
+    char *policy_path;      /* Rules deciding which files are removed, NULL for the default. */
+    char *basis_map_path;   /* Removal basis times per subtree, NULL when not in use. */
+    char *marker;           /* Name of the entry exempting the files of its directory, or NULL. */
+    int marker_subtree;     /* The marker also exempts the files of every directory below. */
+    char *exempt_xattr;     /* Extended attribute exempting a file or a subtree, or NULL. */
+};
+
+/* A daily period of --rate-schedule, in minutes since local midnight. end_min may be smaller than
+ * start_min for a period spanning midnight. */
+struct rate_window_s
+{
+    int start_min;
+    int end_min;
+    double rate;
+};
+
+/* A directory tree purged with its own log. Several of them are purged at once when passed
+ * --users-dir or more than one directory argument, each using one of roots_slots slots of the
+ * walkers' counters until it is finished. */
+struct root_s
+{
+    char *path;
+    PVFS_object_ref ref;
+    FILE *logp;
+    FILE *summaryp;                 /* See log_open. */
+    struct record_log_s *records;   /* With --log-records, see record_log_open. */
+    struct line_log_s *lines;       /* With --log-compressed, see line_log_open. */
+    PVFS_time current_time;     /* When its purge started, which names its log. */
+    struct timespec walk_start;
+    struct purge_stats_s stats; /* Merged from the walkers' slot once finished. */
+    struct owner_table_s owners;    /* Likewise, with --uid-stats or --gid-stats. */
+    uint64_t pending;           /* Directories queued or being scanned, and removals in flight. */
+    int slot;
+    int failed;
+    uint64_t cost_seconds;      /* duration_seconds of its previous purge, see cost_logs_load. */
+    uint64_t cost_entries;      /* Entries listed by its previous purge. */
+    PVFS_time cost_time;        /* current_time of the log cost_seconds was read from. */
+    double slice_end;           /* When its slice of --max-duration ends, see root_suspended. */
+    int suspended;              /* Its slice has ended, its directories are being saved. */
+    int resumed;                /* Continues where the previous run left it, see --deferred. */
+    int deferred;               /* Left unfinished once --max-duration was over. */
+    struct walk_item_s *saved;  /* Directories left by its last slice, or by the previous run. */
+    uint64_t saved_count;
+    uint64_t saved_size;
+};
+
+/* A --cost-table record: the entries listed in a directory and in those of its subdirectories that
+ * are too deep to get a record of their own. */
+struct cost_rec_s
+{
+    uint64_t handle;
+    uint64_t parent;            /* Handle of the parent directory, 0 for a root. */
+    uint64_t entries;
+};
+
+/* Whether the files of a directory are exempt from removal by --marker. */
+typedef enum
+{
+    EXEMPT_UNKNOWN,         /* The marker has not been looked for yet. */
+    EXEMPT_NONE,            /* The directory holds no marker. */
+    EXEMPT_MARKED,          /* The directory holds the marker. */
+    EXEMPT_INHERITED        /* A directory above holds the marker, with --marker-subtree. */
+} exempt_type;
+
+/* Whether a directory is tagged with --exempt-xattr, which exempts its whole subtree. */
+typedef enum
+{
+    TAG_UNKNOWN,            /* Its extended attribute, or one of tag_above, is not known yet. */
+    TAG_NONE,               /* Neither it nor a directory above is tagged. */
+    TAG_EXEMPT              /* It or a directory above is tagged. */
+} tag_type;
+
+/* A directory waiting to be scanned by one of the walkers. */
+struct walk_item_s
+{
+    PVFS_object_ref ref;
+    PVFS_ds_position token;     /* Where to resume an interrupted scan, or PVFS_READDIR_START. */
+    char *path;
+    PVFS_time mtime;            /* Of the directory when listed by its parent, or INDEX_MTIME_UNKNOWN. */
+    struct index_dir_s *idx;    /* Index record being built with --index, see index_dir_new. */
+    struct root_s *root;
+    struct cost_rec_s *cost;    /* Counts its entries with --cost-table, see cost_item_init. */
+    int depth;                  /* Below its root. */
+    uint64_t prev_cost;         /* Entries of its subtree in the previous run, 0 if unknown. */
+    PVFS_time basis;            /* Removal basis time of its files, see basis_find. */
+    exempt_type exempt;         /* See exempt_check. */
+    tag_type tag;               /* See fetch_batch_tags. */
+    PVFS_handle *tag_above;     /* Directories above whose tag is unknown, see tag_inherit. */
+    int tag_above_count;
+};
+
+/* Double ended queue of directories owned by a single walker thread. The owner pushes and pops at
+ * the back, other walkers steal from the front. */
+struct walk_deque_s
+{
+    pthread_mutex_t lock;
+    struct walk_item_s *items;
+    size_t head;            /* Index of the front (oldest) item. */
+    size_t count;           /* Number of queued items. */
+    size_t size;            /* Allocated number of items. */
+};
+
+struct walker_s
+{
+    int id;
+    pthread_t thread;
+    struct walk_deque_s deque;
+    struct purge_stats_s *stats;    /* One per root slot, merged once the root has finished. */
+    struct owner_table_s *owners;   /* Likewise, with --uid-stats or --gid-stats. */
+    struct root_s *root;            /* Of the directory being scanned, see walk_push. */
+    struct cost_rec_s *cost;        /* Likewise its cost record and depth, see cost_item_init. */
+    int depth;
+    PVFS_time basis;                /* Likewise its removal basis time and exemptions. */
+    exempt_type exempt;
+    tag_type tag;
+    PVFS_handle *tag_above;         /* Owned by the item being scanned. */
+    int tag_above_count;
+    PVFS_handle handle;             /* Likewise its handle, see walk_push. */
+    char *dirent_path;              /* PVFS_PATH_MAX bytes. */
+    struct remove_op_s **rm_window; /* opts.remove_window removals, rm_count of them in flight. */
+    int rm_count;
+    PVFS_sys_op_id *rm_op_ids;      /* Arguments of PVFS_sys_testsome. */
+    void **rm_user_ptrs;
+    int *rm_error_codes;
+    uint64_t size_sample;           /* Kept files considered for sampling, see dirent_needs_size. */
+    struct log_chunk_s *log_chunk;  /* R and K lines not yet handed to the log writer. */
+    struct log_chunk_s *rec_chunk;  /* Likewise for the records of --log-records. */
 };
 
 /* For any of this to work, the system time must be correct and roughly in sync between all the
@@ -204,12 +817,185 @@ struct options_s
  */
 
 /* GLOBAL VARIABLES */
-struct purge_stats_s pstats = {0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL};
+struct purge_stats_s pstats = {0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL, 0LL,
+                               0LL};
+struct owner_table_s powners = {NULL, 0LL, 0LL};
 PVFS_credential creds;
+/* Attributes requested by every readdirplus, file sizes are left out unless --kept-bytes is exact. */
+uint32_t rdplus_attrmask = PVFS_ATTR_SYS_ALL_NOHINT;
 PVFS_time removal_basis_time = 0LL;
 FILE *logp = NULL;
+FILE *summaryp = NULL;
 struct options_s opts;
 
+/* R and K lines of a single log, formatted by a walker and written by the log writer, to out or,
+ * with --log-compressed, to lines. A chunk of records holds instead, for each entry, its struct
+ * purge_record_s whose name_offset is the length of the name that follows it, see log_record. */
+struct log_chunk_s
+{
+    struct log_chunk_s *next;
+    FILE *out;
+    struct line_log_s *lines;
+    struct record_log_s *records;
+    size_t len;
+    char data[LOG_CHUNK_SIZE];
+};
+
+/* The .rec and .names files of a log with --log-records. Once opened, only the log writer (or, if
+ * it is not running, a walker holding log_writer_lock) writes them. */
+struct record_log_s
+{
+    FILE *recs;
+    FILE *names;
+    uint64_t names_len;
+    uint64_t count;
+    int failed;
+};
+
+/* The .lines.gz file of a log with --log-compressed, only written by the log writer as for struct
+ * record_log_s. prev holds the first bytes of the path of the previous line, which the next one is
+ * front coded against, and out the encoded lines waiting to be compressed. */
+struct line_log_s
+{
+    gzFile gz;
+    char prev[PATH_MAX];
+    size_t prev_len;
+    char out[LOG_CHUNK_SIZE];
+    size_t out_len;
+    uint64_t count;
+    int failed;
+};
+
+/* A nonblocking removal in flight, see remove_async. */
+struct remove_op_s
+{
+    PVFS_sys_op_id op_id;
+    struct root_s *root;
+    PVFS_size size;
+    PVFS_uid owner;
+    PVFS_gid group;
+    char path[];
+};
+
+/* The directory trees being purged, see struct root_s. roots_queue holds, in order, those waiting
+ * for a slot, including those whose slice of --max-duration has ended. roots_lock protects it along
+ * with roots_unfinished and the saved directories of every root. roots_failed is only modified with
+ * the __sync builtins. */
+struct root_s *roots = NULL;
+int roots_count = 0;
+struct root_s **roots_queue = NULL;
+int roots_queue_head = 0;
+int roots_queue_count = 0;
+int roots_unfinished = 0;
+pthread_mutex_t roots_lock = PTHREAD_MUTEX_INITIALIZER;
+struct timespec roots_started;
+int roots_slots = 1;
+int roots_multi = 0;
+int roots_failed = 0;
+
+/* Shared state of the walk. walk_pending counts directories queued or being scanned as well as
+ * removals in flight, and walk_queued_bytes the memory the directories hold, both are only modified
+ * with the __sync builtins. walk_lock protects walk_idle and walk_cond. */
+struct walker_s *walkers = NULL;
+int walkers_count = 0;
+uint64_t walk_pending = 0LL;
+uint64_t walk_queued_bytes = 0LL;
+uint64_t walk_peak_bytes = 0LL;
+int walk_aborted = 0;
+int walk_idle = 0;
+pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+
+/* Token bucket shared by every walker, see rate_limit_take. rate_lock protects all of it but
+ * rate_throttled_ns, which is only modified with the __sync builtins. */
+pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+double rate_tokens = 0.0;
+double rate_current = -1.0;     /* Rate in effect, negative until first looked up. */
+struct timespec rate_refilled;
+time_t rate_looked_up = 0;
+uint64_t rate_throttled_ns = 0LL;
+
+/* --index state. The index of the previous run is mapped read only at index_map and looked up with
+ * index_slots, an open addressing table of record offsets plus one (0 for an empty slot). The new
+ * index is written to index_out, index_lock serializes its records. */
+char *index_map = NULL;
+size_t index_map_size = 0;
+uint64_t *index_slots = NULL;
+uint64_t index_slots_mask = 0LL;
+FILE *index_out = NULL;
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+int index_failed = 0;
+uint64_t index_skipped = 0LL;
+
+/* --checkpoint state. checkpoint_signaled is set by the SIGTERM handler. Walkers park with
+ * walk_lock held, the last one to park writes the checkpoint and bumps checkpoint_gen to release
+ * the others. checkpoint_items holds the directories of the checkpoint being resumed until they are
+ * queued. */
+volatile sig_atomic_t checkpoint_signaled = 0;
+time_t checkpoint_last = 0;
+uint64_t checkpoint_gen = 0LL;
+int walk_parked = 0;
+int walk_stopped = 0;
+struct walk_item_s *checkpoint_items = NULL;
+uint64_t checkpoint_items_count = 0LL;
+int checkpoint_written = 0;
+
+/* --cost-table state. cost_prev holds the records of the previous run with the entries of whole
+ * subtrees, looked up with cost_slots (indexes plus one, 0 for an empty slot). cost_recs holds the
+ * records of this run, cost_lock serializes their allocation. */
+struct cost_rec_s *cost_prev = NULL;
+uint64_t cost_prev_count = 0LL;
+uint64_t *cost_slots = NULL;
+uint64_t cost_slots_mask = 0LL;
+struct cost_rec_s **cost_recs = NULL;
+uint64_t cost_recs_count = 0LL;
+uint64_t cost_recs_size = 0LL;
+pthread_mutex_t cost_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A directory whose --exempt-xattr has been fetched, or is being fetched while tag is TAG_UNKNOWN.
+ * Its tag only tells whether the directory itself is tagged. */
+struct tag_slot_s
+{
+    PVFS_handle handle;         /* 0 for an empty slot. */
+    tag_type tag;
+    struct tag_wait_s *waiters;
+};
+
+/* An event loop directory waiting for the tag of a directory above it, see tag_wait_add. */
+struct tag_wait_s
+{
+    struct ev_dir_s *dir;
+    struct tag_wait_s *next;
+};
+
+/* --exempt-xattr state. tag_slots is an open addressing table of the directories whose tag has
+ * been fetched, so that each directory is fetched once however many directories below it hold
+ * files to remove. tag_lock protects it, tag_cond is broadcast whenever a tag has been fetched. */
+struct tag_slot_s *tag_slots = NULL;
+uint64_t tag_slots_mask = 0LL;
+uint64_t tag_slots_count = 0LL;
+pthread_mutex_t tag_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tag_cond = PTHREAD_COND_INITIALIZER;
+
+/* Log writer state, see log_writer_main. log_writer_lock protects all of it. The chunks waiting to
+ * be written are queued from log_writer_head to log_writer_tail and hold log_writer_queued bytes of
+ * opts.log_buffer; written chunks are kept on log_writer_free for reuse. log_writer_submitted and
+ * log_writer_written count chunks, see log_writer_sync. */
+int log_writer_running = 0;
+int log_writer_stopping = 0;
+pthread_t log_writer_thread;
+pthread_mutex_t log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_writer_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t log_writer_done = PTHREAD_COND_INITIALIZER;
+struct log_chunk_s *log_writer_head = NULL;
+struct log_chunk_s *log_writer_tail = NULL;
+struct log_chunk_s *log_writer_free = NULL;
+uint64_t log_writer_queued = 0LL;
+uint64_t log_writer_submitted = 0LL;
+uint64_t log_writer_written = 0LL;
+uint64_t log_writer_failed = 0LL;
+uint64_t log_stalled_ns = 0LL;
+
 void orangefs_purge_option_init(struct options_s *x)
 {
     x->removal_basis_time = 0LL;
@@ -217,30 +1003,279 @@ void orangefs_purge_option_init(struct options_s *x)
     x->dry_run = 0;
     x->log_removed_files = 0;
     x->log_kept_files = 0;
+    x->threads = 1;
+    x->prefetch = 0;
+    x->event_loop = 0;
+    x->memory_budget = DEFAULT_MEMORY_BUDGET;
+    x->remove_window = 0;
+    x->kept_bytes_mode = KEPT_BYTES_EXACT;
+    x->size_sample = 100;
+    x->server_inflight = 0;
+    x->rate = 0.0;
+    x->rate_windows = NULL;
+    x->rate_windows_count = 0;
+    x->adaptive = 0;
+    x->index_path = NULL;
+    x->full = 0;
+    x->checkpoint_path = NULL;
+    x->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+    x->resume = 0;
+    x->users_dir = 0;
+    x->exclude_file = NULL;
+    x->cost_table_path = NULL;
+    x->cost_logs_dir = NULL;
+    x->max_duration = 0;
+    x->deferred_path = NULL;
+    x->log_buffer = DEFAULT_LOG_BUFFER;
+    x->log_records = 0;
+    x->log_compressed = 0;
+    x->uid_stats = 0;
+    x->gid_stats = 0;
+    x->policy_path = NULL;
+    x->basis_map_path = NULL;
+    x->marker = NULL;
+    x->marker_subtree = 0;
+    x->exempt_xattr = NULL;
 }
 
 void usage(int status)
 {
-    printf("Usage: %s [OPTION]... <ABSOLUTE_PATH_OF_DIRECTORY_TO_BE_PURGED>\n", PROGRAM_NAME);
+    printf("Usage: %s [OPTION]... <ABSOLUTE_PATH_OF_DIRECTORY_TO_BE_PURGED>...\n", PROGRAM_NAME);
     printf("\n\
     Walks an OrangeFS directory tree and purges OrangeFS files based on the removal-basis-time.\n\
     If the atime and mtime values of a file are both less than the removal-basis-time then the\n\
     file will be purged.\n\n\
         -h, --help                  show help/usage information.\n\
         -?\n\n\
+            --adaptive              with --event-loop, tune the number of operations in flight\n\
+                                    (at most the number given to --event-loop) to the latency\n\
+                                    of the operations.\n\n\
+            --basis-map             file of directories, each followed by the age its files\n\
+                                    must reach to be removed, which applies to its subtree\n\
+                                    rather than the removal-basis-time.\n\n\
+            --checkpoint            file where the progress of the walk is saved periodically\n\
+                                    and on SIGTERM, see --resume.\n\n\
+            --checkpoint-interval   seconds between checkpoints. The default is 600, 0 only\n\
+                                    checkpoints on SIGTERM.\n\n\
+            --cost-logs             log directory of the previous run, used to start the\n\
+                                    directories that took longest first.\n\n\
+            --cost-table            file of the entries listed per subtree, used to start the\n\
+                                    costliest directories and subtrees first and updated by\n\
+                                    this run.\n\n\
+            --deferred              file of the directories left unscanned by --max-duration,\n\
+                                    scanned first by the next run given the same file.\n\n\
         -d, --dry-run               does not remove any files but otherwise proceeds as normal.\n\n\
+            --event-loop            walk the directory tree from a single thread keeping up to\n\
+                                    the given number of nonblocking readdirplus and remove\n\
+                                    operations in flight. Cannot be combined with --threads.\n\n\
+            --exclude-file          file listing directories not to purge nor scan at any\n\
+                                    depth, one absolute path per line whose components may\n\
+                                    be globs, ** matching any number of them.\n\n\
+            --exempt-xattr          extended attribute, such as user.purge.exempt, that keeps\n\
+                                    a file or every file below a directory, counted as\n\
+                                    exempt. A value of until:EPOCH only keeps them until then.\n\n\
+            --full                  with --index, list every directory even if unchanged.\n\n\
+            --gid-stats             log the counters of the entries of each group, see\n\
+                                    --uid-stats.\n\n\
+            --index                 file of the per directory index that lets this run skip\n\
+                                    listing directories left unchanged since the previous run\n\
+                                    and holding no expired file, updated by this run.\n\n\
+            --kept-bytes            one of exact (the default), estimate or omit. Unless exact,\n\
+                                    directories are listed without file sizes, which are then\n\
+                                    only fetched for expired files and, when estimating, for a\n\
+                                    sample of the kept files (see --size-sample).\n\n\
+            --log-buffer            bytes (K, M and G suffixes are accepted) of logged files\n\
+                                    that may wait for the log writer thread before the walk\n\
+                                    waits for it. The default is 16M, 0 writes the logged\n\
+                                    files from the walkers.\n\n\
+            --log-compressed        writes the logged files front coded and compressed beside\n\
+                                    the log rather than to it, see orangefs-purge-lines.\n\n\
         -l, --log-dir               specify the absolute path of the directory where you want\n\
                                     orangefs-purge to generate its log file. The default is:\n\
                                     /var/log/orangefs-purge/.\n\n\
             --log-kept-files        logs all files that will be kept.\n\n\
+            --log-records           writes a binary record of every entry beside the log, see\n\
+                                    orangefs-purge-records.\n\n\
             --log-removed-files     logs all files that will be removed.\n\n\
+            --marker                name of an entry, such as .nopurge, whose presence in a\n\
+                                    directory keeps all of its files, counted as exempt.\n\n\
+            --marker-subtree        with --marker, also keep the files of every directory\n\
+                                    below one holding the marker.\n\n\
+            --max-duration          seconds after which the directories still being purged\n\
+                                    are deferred, see --deferred. Until then every directory\n\
+                                    is purged in turn for its share of the time left. The\n\
+                                    default is 0 which means no limit.\n\n\
+            --memory-budget         bytes of memory (K, M and G suffixes are accepted) that the\n\
+                                    directories waiting to be scanned may hold before large\n\
+                                    directories are scanned piecewise. The default is 64M.\n\n\
+            --policy                file of the rules deciding which files are removed, rather\n\
+                                    than those whose atime and mtime are both older than the\n\
+                                    removal-basis-time.\n\n\
+            --prefetch              request the next batch of directory entries while the\n\
+                                    current batch is being processed.\n\n\
+            --rate                  maximum number of readdirplus, getattr and remove\n\
+                                    operations per second, across all walkers. The default\n\
+                                    is 0 which means no limit.\n\n\
+            --rate-schedule         comma separated HH:MM-HH:MM=RATE periods of the day (local\n\
+                                    time) using their own --rate, for example\n\
+                                    08:00-18:00=100,18:00-22:00=1000.\n\n\
         -r, --removal-basis-time    supply your own removal-basis-time (in seconds since the\n\
                                     UNIX epoch), rather than relying on the default which is 31\n\
-                                    days previous to this program's execution time.\n");
+                                    days previous to this program's execution time.\n\n\
+            --remove-window         number of nonblocking removals each walker keeps in flight.\n\
+                                    The default is 0 which removes files one at a time.\n\n\
+            --resume                continue the walk saved in the --checkpoint file.\n\n\
+            --server-inflight       with --event-loop, the number of operations in flight per\n\
+                                    metadata server. Operations are queued per metadata server\n\
+                                    and issued to each server in turn.\n\n\
+            --size-sample           fetch the size of one kept file in this many when using\n\
+                                    --kept-bytes estimate. The default is 100.\n\n\
+        -t, --threads               number of threads walking the directory tree concurrently.\n\
+                                    The default is 1.\n\n\
+            --uid-stats             log the counters of the entries owned by each uid as\n\
+                                    uid_stats lines of the summary.\n\n\
+            --users-dir             purge each subdirectory of the given directory with its\n\
+                                    own log rather than the directory itself.\n");
     exit(status);
 }
 
-/* Log purge statistics */
+/* Parses a number of bytes with an optional K, M or G (powers of 1024) suffix. */
+int parse_size(const char *str, uint64_t *sizep)
+{
+    char *end = NULL;
+    uint64_t size = strtoull(str, &end, 0);
+
+    if(end == str)
+    {
+        return -1;
+    }
+
+    switch(*end)
+    {
+        case 'P':
+        case 'p':
+            size *= 1024;
+            /* fall through */
+        case 'T':
+        case 't':
+            size *= 1024;
+            /* fall through */
+        case 'G':
+        case 'g':
+            size *= 1024;
+            /* fall through */
+        case 'M':
+        case 'm':
+            size *= 1024;
+            /* fall through */
+        case 'K':
+        case 'k':
+            size *= 1024;
+            end++;
+            /* fall through */
+        case 0:
+            break;
+        default:
+            return -1;
+    }
+
+    if(*end)
+    {
+        return -1;
+    }
+
+    *sizep = size;
+    return 0;
+}
+
+/* Parses a number of seconds, optionally with an s, m, h, d or w suffix. */
+int parse_age(const char *str, uint64_t *secsp)
+{
+    char *end = NULL;
+    uint64_t secs = strtoull(str, &end, 10);
+
+    if(end == str)
+    {
+        return -1;
+    }
+
+    switch(*end)
+    {
+        case 'w':
+            secs *= 7;
+            /* fall through */
+        case 'd':
+            secs *= 24;
+            /* fall through */
+        case 'h':
+            secs *= 60;
+            /* fall through */
+        case 'm':
+            secs *= 60;
+            /* fall through */
+        case 's':
+            end++;
+            /* fall through */
+        case 0:
+            break;
+        default:
+            return -1;
+    }
+
+    if(*end)
+    {
+        return -1;
+    }
+
+    *secsp = secs;
+    return 0;
+}
+
+/* Parses the HH:MM-HH:MM=RATE[,...] periods of --rate-schedule into opts. */
+int parse_rate_schedule(const char *str)
+{
+    const char *p = str;
+
+    while(*p)
+    {
+        struct rate_window_s *windows;
+        int sh, sm, eh, em, n = 0;
+        double rate;
+
+        if(sscanf(p, "%d:%d-%d:%d=%lf%n", &sh, &sm, &eh, &em, &rate, &n) != 5 ||
+           sh < 0 || sh > 24 || sm < 0 || sm > 59 || eh < 0 || eh > 24 || em < 0 || em > 59 ||
+           rate < 0.0)
+        {
+            return -1;
+        }
+
+        windows = realloc(opts.rate_windows,
+                          (opts.rate_windows_count + 1) * sizeof(struct rate_window_s));
+        if(!windows)
+        {
+            return -1;
+        }
+        opts.rate_windows = windows;
+        windows[opts.rate_windows_count].start_min = sh * 60 + sm;
+        windows[opts.rate_windows_count].end_min = eh * 60 + em;
+        windows[opts.rate_windows_count].rate = rate;
+        opts.rate_windows_count++;
+
+        p += n;
+        if(*p == ',')
+        {
+            p++;
+        }
+        else if(*p)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Log purge statistics. kept_bytes is left out when --kept-bytes omit did not count it. */
 void log_pstats(FILE *out, struct purge_stats_s *psp)
 {
     if(out && psp)
@@ -249,17 +1284,20 @@ void log_pstats(FILE *out, struct purge_stats_s *psp)
                 "removed_bytes\t%llu\n"
                 "removed_files\t%llu\n"
                 "failed_removed_bytes\t%llu\n"
-                "failed_removed_files\t%llu\n"
-                "kept_bytes\t%llu\n"
+                "failed_removed_files\t%llu\n",
+                LLU(psp->rm_bytes),
+                LLU(psp->rm_fils),
+                LLU(psp->frm_bytes),
+                LLU(psp->frm_fils));
+        if(opts.kept_bytes_mode != KEPT_BYTES_OMIT)
+        {
+            fprintf(out, "kept_bytes\t%llu\n", LLU(psp->kept_bytes));
+        }
+        fprintf(out,
                 "kept_files\t%llu\n"
                 "directories\t%llu\n"
                 "symlinks\t%llu\n"
                 "unknown\t%llu\n",
-                LLU(psp->rm_bytes),
-                LLU(psp->rm_fils),
-                LLU(psp->frm_bytes),
-                LLU(psp->frm_fils),
-                LLU(psp->kept_bytes),
                 LLU(psp->kept_fils),
                 LLU(psp->dirs),
                 LLU(psp->lnks),
@@ -341,9 +1379,33 @@ float ps_purged_avg_file_size(struct purge_stats_s *psp)
                    1.0);
 }
 
+/* Directory entries (of any type) scanned per second of the walk. The walk duration is measured
+ * with sub-second resolution, so PS_CORRECT_NAN, which expects an integer denominator, is not used.
+ */
+float ps_entries_per_second(struct purge_stats_s *psp, double walk_secs)
+{
+    if(psp && walk_secs > 0.0)
+    {
+        return (psp->rm_fils + psp->frm_fils + psp->kept_fils + psp->dirs + psp->lnks +
+                psp->unknown) / walk_secs;
+    }
+
+    return 0.0;
+}
+
+/* Like log_pstats, the ratios needing kept_bytes are left out when --kept-bytes omit did not count
+ * it. */
 void log_pstats_more(FILE *out, struct purge_stats_s *psp)
 {
-    if(out && psp)
+    if(out && psp && opts.kept_bytes_mode == KEPT_BYTES_OMIT)
+    {
+        fprintf(out,
+                "percent_files_removed\t%f\n"
+                "purged_avg_file_size\t%f\n",
+                ps_percent_files_removed(psp),
+                ps_purged_avg_file_size(psp));
+    }
+    else if(out && psp)
     {
         fprintf(out,
                 "percent_bytes_removed\t%f\n"
@@ -373,330 +1435,7321 @@ PVFS_time get_current_time(void)
     return current_time;
 }
 
-/* Converts the supplied PVFS_time to a human readable string format. The returned string should be
- * freed when you are finished with it! */
-char *human_readable_time(PVFS_time t)
+/* Returns the number of seconds elapsed since *startp, which was filled in by clock_gettime. */
+double elapsed_seconds(struct timespec *startp)
 {
-    char *human_time = NULL;
-    char *ret = NULL;
-    time_t t1 = (time_t) t;
-    human_time = ctime(&t1);
-    if(human_time)
-    {
-        ret = strdup(human_time);
-    }
-    return ret;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - startp->tv_sec) + (now.tv_nsec - startp->tv_nsec) / 1000000000.0;
 }
 
-/* A clone of an internal OrangeFS convenience function for converting PVFS_sys_attr attributes to
- * normal struct stat attributes. */
-int sys_attr_to_stat(struct stat *bufp, PVFS_sys_attr *attrp, PVFS_object_ref ref)
+/* Returns the rate of the --rate-schedule period covering the current local time, or opts.rate. */
+double rate_scheduled(time_t now)
 {
-    if(!(bufp && attrp) ||
-        (ref.handle == PVFS_HANDLE_NULL || ref.fs_id == PVFS_FS_ID_NULL))
-    {
-        return -1;
-    }
+    struct tm tm;
+    int min;
+    int i;
 
-    /* We adapt iocommon_stat to convert PVFS_sys_attr to regular struct stat */
-    memset(bufp, 0, sizeof(struct stat));
+    localtime_r(&now, &tm);
+    min = tm.tm_hour * 60 + tm.tm_min;
 
-    /* copy attributes into standard stat struct */
-    bufp->st_dev = ref.fs_id;
-    bufp->st_ino = ref.handle;
-    bufp->st_mode = attrp->perms;
-    if (attrp->objtype == PVFS_TYPE_METAFILE)
+    for(i = 0; i < opts.rate_windows_count; i++)
     {
-        bufp->st_mode |= S_IFREG;
-        bufp->st_nlink = 1; /* PVFS does not allow hard links */
+        struct rate_window_s *rw = &opts.rate_windows[i];
+
+        if(rw->start_min <= rw->end_min ? (min >= rw->start_min && min < rw->end_min) :
+                                          (min >= rw->start_min || min < rw->end_min))
+        {
+            return rw->rate;
+        }
     }
-    if (attrp->objtype == PVFS_TYPE_DIRECTORY)
+
+    return opts.rate;
+}
+
+/* Takes a token for one readdirplus, getattr or remove operation from the bucket shared by every
+ * walker. The bucket is refilled at the rate in effect and holds at most one second worth of
+ * tokens. Returns 0 if the operation may be issued, or else the number of nanoseconds until the
+ * next token. */
+int64_t rate_limit_take(void)
+{
+    struct timespec now;
+    int64_t wait_ns = 0;
+    double rate;
+
+    if(opts.rate == 0.0 && opts.rate_windows_count == 0)
     {
-        bufp->st_mode |= S_IFDIR;
-        bufp->st_nlink = attrp->dirent_count + 2;
+        return 0;
     }
-    if (attrp->objtype == PVFS_TYPE_SYMLINK)
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&rate_lock);
+    if(rate_looked_up != now.tv_sec)
     {
-        bufp->st_mode |= S_IFLNK;
-        bufp->st_nlink = 1; /* PVFS does not allow hard links */
+        /* Look the schedule up at most once per second. */
+        rate = rate_scheduled(time(NULL));
+        if(rate != rate_current)
+        {
+            rate_current = rate;
+            rate_tokens = rate < 1.0 ? rate : 1.0;
+            rate_refilled = now;
+        }
+        rate_looked_up = now.tv_sec;
     }
-    bufp->st_uid = attrp->owner;
-    bufp->st_gid = attrp->group;
-    bufp->st_rdev = 0; /* no dev special files */
-    bufp->st_size = attrp->size;
-#if PVFS_USER_ENV_VARS_ENABLED
-    if(env_vars.env_var_array[ORANGEFS_STRIP_SIZE_AS_BLKSIZE].env_var_value &&
-       strcmp(env_vars.env_var_array[ORANGEFS_STRIP_SIZE_AS_BLKSIZE].env_var_value, "true") == 0)
+    rate = rate_current;
+
+    if(rate > 0.0)
     {
-        if(attrp->dfile_count > 0)
+        rate_tokens += ((now.tv_sec - rate_refilled.tv_sec) +
+                        (now.tv_nsec - rate_refilled.tv_nsec) / 1000000000.0) * rate;
+        rate_refilled = now;
+        if(rate_tokens > (rate < 1.0 ? 1.0 : rate))
+        {
+            rate_tokens = rate < 1.0 ? 1.0 : rate;
+        }
+
+        if(rate_tokens >= 1.0)
         {
-            bufp->st_blksize = attrp->blksize / attrp->dfile_count;
+            rate_tokens -= 1.0;
         }
         else
         {
-            bufp->st_blksize = attrp->blksize;
+            wait_ns = (int64_t) ((1.0 - rate_tokens) / rate * 1000000000.0) + 1;
         }
     }
-    else
-    {
-        bufp->st_blksize = attrp->blksize;
-    }
-#else
-    bufp->st_blksize = attrp->blksize;
-#endif
-    bufp->st_blocks = (attrp->size + (S_BLKSIZE - 1)) / S_BLKSIZE;
-    /* we don't have nsec so we left the memset zero them */
-    bufp->st_atime = attrp->atime;
-    bufp->st_mtime = attrp->mtime;
-    bufp->st_ctime = attrp->ctime;
+    pthread_mutex_unlock(&rate_lock);
 
-    return 0;
+    return wait_ns;
 }
 
-/* Walks an OrangeFS directory tree using a recursive algorithm and the PVFS_sys_readdirplus
- * function which is the most efficient way to gather stats from multiple entries at once when using
- * OrangeFS.
- */
-int walk_rdp_and_purge(char *path, PVFS_object_ref *dir_refp)
-{
-    /* This is a recursive algorithm so I try not to declare too many local variables and
-     * parameters to avoid a stack overflow. My development machine stack limit is 8 MB:
-     *
-     * $ ulimit -s
-     * 8192
-     *
-     */
-    PVFS_sysresp_readdirplus rdplus_response;       /* 48 B */
-    PVFS_object_ref dirent_ref;                     /* 16 B */
-    char * dirent_path;                             /*  8 B */
-    PVFS_ds_position token = PVFS_READDIR_START;    /*  8 B */
-    uint64_t entry_count = 0LL;                     /*  8 B */
-    int ret = 0;                                    /*  4 B */
-    short dir_len = 0;                              /*  2 B */
+/* Blocks until rate_limit_take grants an operation, accounting for the time spent waiting. */
+void rate_limit_wait(void)
+{
+    int64_t wait_ns;
+
+    while((wait_ns = rate_limit_take()) > 0)
+    {
+        struct timespec ts;
+
+        ts.tv_sec = wait_ns / 1000000000;
+        ts.tv_nsec = wait_ns % 1000000000;
+        nanosleep(&ts, NULL);
+        __sync_add_and_fetch(&rate_throttled_ns, wait_ns);
+    }
+}
+
+/* Converts the supplied PVFS_time to a human readable string format. The returned string should be
+ * freed when you are finished with it! */
+char *human_readable_time(PVFS_time t)
+{
+    char *human_time = NULL;
+    char *ret = NULL;
+    time_t t1 = (time_t) t;
+    human_time = ctime(&t1);
+    if(human_time)
+    {
+        ret = strdup(human_time);
+    }
+    return ret;
+}
+
+/* Finds the handle of a directory to be purged given its absolute path on a mounted OrangeFS file
+ * system. */
+int root_resolve(const char *dir, PVFS_object_ref *dir_refp)
+{
+    char resolved_path[PVFS_PATH_MAX] = { 0 };
+    struct stat arg_stat;
+    PVFS_sysresp_lookup lk_response;
+    PVFS_fs_id fs_id;
+    int ret;
+
+    if((ret = lstat(dir, &arg_stat)))
+    {
+        perror("ERROR: Could not stat path supplied as the first argument, reason= ");
+        return -1;
+    }
+
+    if((arg_stat.st_mode & S_IFMT) != S_IFDIR)
+    {
+        fprintf(stderr,
+                "ERROR: supplied argument is a valid path but not a directory! path = %s\n",
+                dir);
+        return -1;
+    }
+
+    ret = PVFS_util_resolve(dir,
+                            &fs_id,
+                            resolved_path,
+                            PVFS_PATH_MAX);
+
+    if (ret < 0)
+    {
+        fprintf(stderr,
+                "%s: ERROR: PVFS_util_resolve failed, could not find"
+                " file system for %s\n",
+                __func__,
+                dir);
+        return -1;
+    }
+
+    /* Resolved path does not include the OrangeFS mount prefix e.g. /mnt/orangefs */
+    DEBUG("INFO: PVFS path resolved. fs_id = %d, resolved_path = %s\n",
+          fs_id,
+          resolved_path);
+
+    if(strlen(resolved_path) == 0)
+    {
+        DEBUG("INFO: Detected a resolved path of length == 0. "
+              "Continuing assuming the OrangeFS '/' path was the intended target.\n");
+        resolved_path[0] = '/';
+        resolved_path[1] = 0;
+    }
+
+    /* What directory are we scanning? */
+    ret = PVFS_sys_lookup(fs_id,
+                          resolved_path,
+                          &creds,
+                          &lk_response,
+                          PVFS2_LOOKUP_LINK_NO_FOLLOW,
+                          NULL);
+    if(ret < 0)
+    {
+        PVFS_perror("ERROR: PVFS_sys_lookup", ret);
+        return -1;
+    }
+
+    dir_refp->handle = lk_response.ref.handle;
+    dir_refp->fs_id = fs_id;
+
+    DEBUG("INFO: dir_ref.handle = %llu, dir_ref.fs_id = %d\n",
+          LLU(dir_refp->handle),
+          dir_refp->fs_id);
+
+    return 0;
+}
+
+/* The subtrees of --basis-map, sorted by handle, each with its own removal basis time. Their paths
+ * are kept to find the subtree of a directory known only by its path, see basis_of_path. */
+struct basis_rec_s
+{
+    PVFS_handle handle;
+    PVFS_time basis;
+    char *path;
+};
+
+struct basis_rec_s *basis_map = NULL;
+int basis_map_count = 0;
+
+void basis_map_free(void)
+{
+    int i;
+
+    for(i = 0; i < basis_map_count; i++)
+    {
+        free(basis_map[i].path);
+    }
+    free(basis_map);
+    basis_map = NULL;
+    basis_map_count = 0;
+}
+
+int basis_rec_compare(const void *a, const void *b)
+{
+    PVFS_handle ha = ((const struct basis_rec_s *) a)->handle;
+    PVFS_handle hb = ((const struct basis_rec_s *) b)->handle;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+/* Loads the --basis-map file at path, each line of which holds the absolute path of a directory and
+ * the age, measured from now, its files must reach to be removed. The directories are resolved to
+ * their handles here, once; those that cannot be are left out with a warning. */
+int basis_map_load(const char *path, PVFS_time now)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    int size = 0;
+    int lineno = 0;
+    FILE *fp;
+    int ret = -1;
+    int i;
+
+    fp = fopen(path, "r");
+    if(!fp)
+    {
+        fprintf(stderr, "%s: ERROR: could not open %s\n", __func__, path);
+        return -1;
+    }
+
+    while(getline(&line, &line_size, fp) != -1)
+    {
+        PVFS_object_ref ref;
+        struct stat st;
+        char *saveptr = NULL;
+        char *dir;
+        char *age;
+        uint64_t secs;
+        size_t n;
+
+        lineno++;
+        if((dir = strchr(line, '#')))
+        {
+            *dir = 0;
+        }
+        dir = strtok_r(line, " \t\r\n", &saveptr);
+        if(!dir)
+        {
+            continue;
+        }
+        age = strtok_r(NULL, " \t\r\n", &saveptr);
+        if(dir[0] != '/' || !age || parse_age(age, &secs) != 0 ||
+           strtok_r(NULL, " \t\r\n", &saveptr))
+        {
+            fprintf(stderr, "%s: ERROR: %s:%d: expected a directory and an age\n",
+                    __func__, path, lineno);
+            goto cleanup;
+        }
+
+        /* Prefixes never end with a slash, see basis_of_path. */
+        n = strlen(dir);
+        while(n > 1 && dir[n - 1] == '/')
+        {
+            dir[--n] = 0;
+        }
+
+        if(lstat(dir, &st) != 0 || root_resolve(dir, &ref) != 0)
+        {
+            fprintf(stderr, "%s: WARNING: %s:%d: ignoring %s\n", __func__, path, lineno, dir);
+            continue;
+        }
+
+        if(basis_map_count == size)
+        {
+            struct basis_rec_s *grown;
+
+            size = size ? 2 * size : 16;
+            grown = (struct basis_rec_s *) realloc(basis_map, size * sizeof(struct basis_rec_s));
+            if(!grown)
+            {
+                fprintf(stderr, "%s: ERROR: could not allocate the basis map\n", __func__);
+                goto cleanup;
+            }
+            basis_map = grown;
+        }
+        basis_map[basis_map_count].handle = ref.handle;
+        basis_map[basis_map_count].basis = now - (PVFS_time) secs;
+        basis_map[basis_map_count].path = strdup(dir);
+        if(!basis_map[basis_map_count].path)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate the basis map\n", __func__);
+            goto cleanup;
+        }
+        basis_map_count++;
+    }
+
+    qsort(basis_map, basis_map_count, sizeof(struct basis_rec_s), basis_rec_compare);
+    for(i = 1; i < basis_map_count; i++)
+    {
+        if(basis_map[i].handle == basis_map[i - 1].handle)
+        {
+            fprintf(stderr, "%s: ERROR: %s: %s is listed twice\n",
+                    __func__, path, basis_map[i].path);
+            goto cleanup;
+        }
+    }
+    ret = 0;
+
+cleanup:
+    free(line);
+    fclose(fp);
+    if(ret != 0)
+    {
+        basis_map_free();
+    }
+
+    return ret;
+}
+
+/* Returns the removal basis time of the directory handle whose parent's is parent_basis. */
+PVFS_time basis_find(PVFS_handle handle, PVFS_time parent_basis)
+{
+    int lo = 0;
+    int hi = basis_map_count - 1;
+
+    while(lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if(basis_map[mid].handle == handle)
+        {
+            return basis_map[mid].basis;
+        }
+        if(basis_map[mid].handle < handle)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return parent_basis;
+}
+
+/* Returns the removal basis time of the directory at path: that of the deepest subtree of the basis
+ * map holding it, or removal_basis_time. Only used for the directories a walk starts from. */
+PVFS_time basis_of_path(const char *path)
+{
+    PVFS_time basis = removal_basis_time;
+    size_t best = 0;
+    int i;
+
+    for(i = 0; i < basis_map_count; i++)
+    {
+        size_t n = strlen(basis_map[i].path);
+
+        if(n > best && strncmp(path, basis_map[i].path, n) == 0 &&
+           (path[n] == 0 || path[n] == '/' || n == 1))
+        {
+            basis = basis_map[i].basis;
+            best = n;
+        }
+    }
+
+    return basis;
+}
+
+/* Names a file of the log of the directory tree at dir in the log directory. */
+void log_path_make(char *log_path, const char *dir, PVFS_time current_time, const char *suffix)
+{
+    /* determine basename of supplied path and embed it in the log file name. */
+    snprintf(log_path,
+             PATH_MAX,
+             "%s/%llu-%s%s",
+             opts.log_dir ? opts.log_dir : DEFAULT_LOG_DIR,
+             LLU(current_time),
+             basename(dir),
+             suffix);
+}
+
+/* Writes a line of the summary to the log out and to its .summary file, when there is one. */
+void log_kv(FILE *out, FILE *summary, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+    if(summary)
+    {
+        va_start(args, format);
+        vfprintf(summary, format, args);
+        va_end(args);
+    }
+}
+
+/* Creates the log of the directory tree at dir, named after current_time, the time its purge
+ * started, and writes its header. Logs to stderr if the log cannot be created. The lines of the
+ * summary also go to *summaryp, a .summary file beside the log that holds them without the R, K and
+ * concurrency_sample lines, or NULL if it cannot be created. */
+FILE *log_open(const char *dir, PVFS_time current_time, FILE **summaryp)
+{
+    char log_path[PATH_MAX] = { 0 };
+    char *current_time_str = NULL;
+    char *removal_basis_time_str = NULL;
+    PVFS_time basis = basis_of_path(dir);
+    FILE *out = NULL;
+    FILE *summary = NULL;
+
+    /* Convert time to human readable string format. */
+    current_time_str = human_readable_time(current_time);
+    removal_basis_time_str = human_readable_time(basis);
+
+    log_path_make(log_path, dir, current_time, ".log");
+    DEBUG("INFO: log_path\t%s\n", log_path);
+    out = fopen(log_path, "w");
+    if(!out)
+    {
+        fprintf(stderr,
+                "ERROR: Couldn't open orangefs-purge log. Now logging to stderr!\n");
+        out = stderr;
+    }
+    log_path_make(log_path, dir, current_time, ".summary");
+    summary = fopen(log_path, "w");
+    if(!summary)
+    {
+        fprintf(stderr, "%s: ERROR: could not create %s\n", __func__, log_path);
+    }
+
+    log_kv(out, summary, "directory\t%s\n", dir);
+    log_kv(out, summary, "dry_run\t%s\n", opts.dry_run == 0 ? "false" : "true");
+    log_kv(out, summary, "current_time\t%llu\n", LLU(current_time));
+    log_kv(out, summary, "current_time_str\t%s", current_time_str);
+    log_kv(out, summary, "removal_basis_time\t%llu\n", LLU(basis));
+    log_kv(out, summary, "removal_basis_time_str\t%s", removal_basis_time_str);
+    if(opts.basis_map_path)
+    {
+        log_kv(out, summary, "basis_map\t%s\n", opts.basis_map_path);
+    }
+    if(opts.policy_path)
+    {
+        log_kv(out, summary, "policy\t%s\n", opts.policy_path);
+    }
+    if(opts.exempt_xattr)
+    {
+        log_kv(out, summary, "exempt_xattr\t%s\n", opts.exempt_xattr);
+    }
+    if(opts.marker)
+    {
+        log_kv(out,
+               summary,
+               "marker\t%s%s\n",
+               opts.marker,
+               opts.marker_subtree ? "\tsubtree" : "");
+    }
+    if(opts.checkpoint_path)
+    {
+        log_kv(out, summary, "resumed\t%s\n", opts.resume ? "true" : "false");
+    }
+    free(current_time_str);
+    free(removal_basis_time_str);
+
+    *summaryp = summary;
+    return out;
+}
+
+int owner_rec_compare(const void *a, const void *b)
+{
+    uint64_t ka = ((const struct owner_rec_s *) a)->key;
+    uint64_t kb = ((const struct owner_rec_s *) b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+/* Writes a uid_stats or gid_stats line per owner of ot, sorted by kind and id. Kept bytes are
+ * estimated from the samples of the whole walk, psp, as those of an owner are too few. */
+void log_owner_stats(FILE *out, FILE *summary, struct owner_table_s *ot, struct purge_stats_s *psp)
+{
+    struct owner_rec_s *recs;
+    uint64_t count = 0;
+    uint64_t i;
+
+    if(ot->count == 0)
+    {
+        return;
+    }
+    recs = (struct owner_rec_s *) malloc(ot->count * sizeof(struct owner_rec_s));
+    if(!recs)
+    {
+        fprintf(stderr, "%s: ERROR: could not sort the owner counters\n", __func__);
+        return;
+    }
+    for(i = 0; i <= ot->mask; i++)
+    {
+        if(ot->slots[i].key)
+        {
+            recs[count++] = ot->slots[i];
+        }
+    }
+    qsort(recs, count, sizeof(struct owner_rec_s), owner_rec_compare);
+
+    for(i = 0; i < count; i++)
+    {
+        struct purge_stats_s *osp = &recs[i].stats;
+        char kept_bytes[24] = "";
+
+        if(opts.kept_bytes_mode == KEPT_BYTES_ESTIMATE && psp->sampled_fils > 0)
+        {
+            osp->kept_bytes = (uint64_t) ((double) psp->sampled_bytes / psp->sampled_fils *
+                                          osp->kept_fils + 0.5);
+        }
+        if(opts.kept_bytes_mode != KEPT_BYTES_OMIT)
+        {
+            snprintf(kept_bytes, sizeof(kept_bytes), "%llu", LLU(osp->kept_bytes));
+        }
+        log_kv(out,
+               summary,
+               "%s\t%u\t%llu\t%llu\t%llu\t%llu\t%s\t%llu\t%llu\t%llu\t%llu\n",
+               recs[i].key >> 32 == OWNER_UID ? "uid_stats" : "gid_stats",
+               (uint32_t) recs[i].key,
+               LLU(osp->rm_bytes),
+               LLU(osp->rm_fils),
+               LLU(osp->frm_bytes),
+               LLU(osp->frm_fils),
+               kept_bytes,
+               LLU(osp->kept_fils),
+               LLU(osp->dirs),
+               LLU(osp->lnks),
+               LLU(osp->unknown));
+    }
+    free(recs);
+}
+
+/* Writes the summary of a finished walk to its log, followed by the counters per owner of ot.
+ * peak_queued_bytes and throttled_seconds are those of the whole run. */
+void log_summary(FILE *out,
+                 FILE *summary,
+                 struct purge_stats_s *psp,
+                 struct owner_table_s *ot,
+                 PVFS_time current_time,
+                 double walk_secs)
+{
+    PVFS_time finish_time = 0LL;
+    char *finish_time_str = NULL;
+
+    if(opts.kept_bytes_mode == KEPT_BYTES_ESTIMATE && psp->sampled_fils > 0)
+    {
+        psp->kept_bytes = (uint64_t) ((double) psp->sampled_bytes / psp->sampled_fils *
+                                      psp->kept_fils + 0.5);
+    }
+
+    finish_time = get_current_time();
+    finish_time_str = human_readable_time(finish_time);
+    log_kv(out, summary, "finish_time\t%llu\n", LLU(finish_time));
+    log_kv(out, summary, "finish_time_str\t%s", finish_time_str);
+    free(finish_time_str);
+
+    log_kv(out, summary, "duration_seconds\t%llu\n", LLU(finish_time - current_time));
+    log_kv(out, summary, "entries_per_second\t%f\n", ps_entries_per_second(psp, walk_secs));
+    log_kv(out, summary, "peak_queued_bytes\t%llu\n", LLU(walk_peak_bytes));
+    log_kv(out, summary, "throttled_seconds\t%f\n", rate_throttled_ns / 1000000000.0);
+    log_kv(out, summary, "log_stalled_seconds\t%f\n", log_stalled_ns / 1000000000.0);
+    log_kv(out, summary, "index_skipped_directories\t%llu\n", LLU(index_skipped));
+    log_kv(out, summary, "excluded_directories\t%llu\n", LLU(psp->excluded_dirs));
+    if(opts.marker || opts.exempt_xattr)
+    {
+        log_kv(out, summary, "exempt_bytes\t%llu\n", LLU(psp->exempt_bytes));
+        log_kv(out, summary, "exempt_files\t%llu\n", LLU(psp->exempt_fils));
+    }
+    log_pstats(out, psp);
+    log_pstats(summary, psp);
+    log_kv(out,
+           summary,
+           "kept_bytes_mode\t%s\n",
+           opts.kept_bytes_mode == KEPT_BYTES_EXACT ? "exact" :
+           opts.kept_bytes_mode == KEPT_BYTES_ESTIMATE ? "estimated" : "omitted");
+    if(opts.kept_bytes_mode == KEPT_BYTES_ESTIMATE)
+    {
+        log_kv(out, summary, "kept_bytes_sampled_files\t%llu\n", LLU(psp->sampled_fils));
+    }
+    log_pstats_more(out, psp);
+    log_pstats_more(summary, psp);
+    log_owner_stats(out, summary, ot, psp);
+}
+
+void log_close(FILE *out, FILE *summary, int ret)
+{
+    log_kv(out, summary, "purge_success\t%s\n", ret == 0 ? "true" : "false");
+    if(out != stderr)
+    {
+        fclose(out);
+    }
+    if(summary)
+    {
+        fclose(summary);
+    }
+}
+
+/* Creates the .lines.gz file beside the log of the directory tree at dir. Returns NULL, leaving the
+ * lines to the log, if it cannot be created. */
+struct line_log_s *line_log_open(const char *dir, PVFS_time current_time)
+{
+    char path[PATH_MAX];
+    struct line_log_s *ll;
+
+    ll = (struct line_log_s *) calloc(1, sizeof(struct line_log_s));
+    if(!ll)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate the lines of %s\n", __func__, dir);
+        return NULL;
+    }
+
+    log_path_make(path, dir, current_time, PURGE_LINES_SUFFIX);
+    ll->gz = gzopen(path, "wb");
+    if(!ll->gz)
+    {
+        fprintf(stderr,
+                "%s: ERROR: could not create %s, logging its lines to the log\n",
+                __func__,
+                path);
+        free(ll);
+        return NULL;
+    }
+
+    memcpy(ll->out, PURGE_LINES_MAGIC, strlen(PURGE_LINES_MAGIC));
+    ll->out_len = strlen(PURGE_LINES_MAGIC);
+
+    return ll;
+}
+
+/* Compresses the encoded lines waiting in ll->out. */
+void line_log_flush(struct line_log_s *ll)
+{
+    if(ll->out_len > 0 && gzwrite(ll->gz, ll->out, ll->out_len) != (int) ll->out_len)
+    {
+        ll->failed = 1;
+    }
+    ll->out_len = 0;
+}
+
+void line_log_varint(struct line_log_s *ll, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        ll->out[ll->out_len++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    ll->out[ll->out_len++] = (char) value;
+}
+
+/* Encodes the line of path, path_len bytes long, front coded against the previous line. */
+void line_log_put(struct line_log_s *ll, char tag, const char *path, size_t path_len)
+{
+    size_t shared = 0;
+    size_t prev_len;
+
+    /* The tag and two varints take at most 21 bytes. */
+    if(ll->out_len + path_len + 21 > sizeof(ll->out))
+    {
+        line_log_flush(ll);
+    }
+
+    while(shared < ll->prev_len && shared < path_len && ll->prev[shared] == path[shared])
+    {
+        shared++;
+    }
+    ll->out[ll->out_len++] = tag;
+    line_log_varint(ll, shared);
+    line_log_varint(ll, path_len - shared);
+    memcpy(&ll->out[ll->out_len], &path[shared], path_len - shared);
+    ll->out_len += path_len - shared;
+    ll->count++;
+
+    /* Only the bytes that differ are copied. A longer path is front coded against its beginning. */
+    prev_len = path_len < sizeof(ll->prev) ? path_len : sizeof(ll->prev);
+    memcpy(&ll->prev[shared], &path[shared], prev_len - shared);
+    ll->prev_len = prev_len;
+}
+
+/* Ends the lines with their count and closes the file. Every chunk of the log must have been
+ * written. */
+void line_log_close(struct line_log_s *ll)
+{
+    if(!ll)
+    {
+        return;
+    }
+
+    if(ll->out_len + 11 > sizeof(ll->out))
+    {
+        line_log_flush(ll);
+    }
+    ll->out[ll->out_len++] = PURGE_LINES_END;
+    line_log_varint(ll, ll->count);
+    line_log_flush(ll);
+    if(gzclose(ll->gz) != Z_OK)
+    {
+        ll->failed = 1;
+    }
+    if(ll->failed)
+    {
+        fprintf(stderr, "%s: ERROR: some logged files could not be written\n", __func__);
+    }
+    free(ll);
+}
+
+/* Writes a chunk to its log, to the .lines.gz file of its log, or to the .rec and .names files of
+ * its records, giving each record the offset of its name. */
+int log_chunk_write(struct log_chunk_s *chunk)
+{
+    struct record_log_s *rl = chunk->records;
+    struct purge_record_s rec;
+    size_t off = 0;
+
+    if(chunk->lines)
+    {
+        /* Lines are null terminated in these chunks, see log_line. */
+        while(off < chunk->len)
+        {
+            size_t line_len = strlen(&chunk->data[off]);
+
+            line_log_put(chunk->lines, chunk->data[off], &chunk->data[off + 2], line_len - 2);
+            off += line_len + 1;
+        }
+        return chunk->lines->failed ? -1 : 0;
+    }
+
+    if(!rl)
+    {
+        return fwrite(chunk->data, 1, chunk->len, chunk->out) == chunk->len ? 0 : -1;
+    }
+
+    while(off < chunk->len)
+    {
+        size_t name_len;
+
+        memcpy(&rec, &chunk->data[off], sizeof(rec));
+        off += sizeof(rec);
+        name_len = rec.name_offset;
+        rec.name_offset = rl->names_len;
+        if(fwrite(&chunk->data[off], 1, name_len, rl->names) != name_len ||
+           fwrite(&rec, sizeof(rec), 1, rl->recs) != 1)
+        {
+            rl->failed = 1;
+        }
+        rl->names_len += name_len;
+        rl->count++;
+        off += name_len;
+    }
+
+    return rl->failed ? -1 : 0;
+}
+
+/* Writes the queued chunks in order until log_writer_stop, so that the walkers only ever copy their
+ * R and K lines into memory. */
+void *log_writer_main(void *arg)
+{
+    struct log_chunk_s *chunk;
+
+    pthread_mutex_lock(&log_writer_lock);
+    for(;;)
+    {
+        while(!log_writer_head && !log_writer_stopping)
+        {
+            pthread_cond_wait(&log_writer_work, &log_writer_lock);
+        }
+        if(!log_writer_head)
+        {
+            break;
+        }
+
+        chunk = log_writer_head;
+        log_writer_head = chunk->next;
+        if(!log_writer_head)
+        {
+            log_writer_tail = NULL;
+        }
+        pthread_mutex_unlock(&log_writer_lock);
+
+        if(log_chunk_write(chunk) != 0)
+        {
+            __sync_add_and_fetch(&log_writer_failed, 1);
+        }
+
+        pthread_mutex_lock(&log_writer_lock);
+        log_writer_queued -= LOG_CHUNK_SIZE;
+        log_writer_written++;
+        chunk->next = log_writer_free;
+        log_writer_free = chunk;
+        pthread_cond_broadcast(&log_writer_done);
+    }
+    pthread_mutex_unlock(&log_writer_lock);
+
+    return NULL;
+}
+
+/* Starts the log writer when files are logged and opts.log_buffer allows it. */
+int log_writer_start(void)
+{
+    int ret;
+
+    if(opts.log_buffer == 0 ||
+       (!opts.log_removed_files && !opts.log_kept_files && !opts.log_records))
+    {
+        return 0;
+    }
+
+    ret = pthread_create(&log_writer_thread, NULL, log_writer_main, NULL);
+    if(ret != 0)
+    {
+        fprintf(stderr, "%s: ERROR: pthread_create failed with ret= %d\n", __func__, ret);
+        return -1;
+    }
+    log_writer_running = 1;
+
+    return 0;
+}
+
+/* Hands a chunk over to the log writer, waiting while opts.log_buffer bytes are already queued, and
+ * leaves *chunkp empty. The chunk is written directly if the log writer is not running. */
+void log_chunk_submit(struct log_chunk_s **chunkp)
+{
+    struct log_chunk_s *chunk = *chunkp;
+    struct timespec stalled_since;
+    int stalled = 0;
+
+    if(!chunk || chunk->len == 0)
+    {
+        return;
+    }
+    *chunkp = NULL;
+
+    if(!log_writer_running)
+    {
+        /* Only chunks of records and of --log-compressed lines are built without the log
+         * writer, see log_record and log_line. */
+        pthread_mutex_lock(&log_writer_lock);
+        if(log_chunk_write(chunk) != 0)
+        {
+            log_writer_failed++;
+        }
+        pthread_mutex_unlock(&log_writer_lock);
+        free(chunk);
+        return;
+    }
+
+    pthread_mutex_lock(&log_writer_lock);
+    /* A single chunk is always let through, whatever the budget. */
+    while(log_writer_queued > 0 && log_writer_queued + LOG_CHUNK_SIZE > opts.log_buffer)
+    {
+        if(!stalled)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &stalled_since);
+            stalled = 1;
+        }
+        pthread_cond_wait(&log_writer_done, &log_writer_lock);
+    }
+    chunk->next = NULL;
+    if(log_writer_tail)
+    {
+        log_writer_tail->next = chunk;
+    }
+    else
+    {
+        log_writer_head = chunk;
+    }
+    log_writer_tail = chunk;
+    log_writer_queued += LOG_CHUNK_SIZE;
+    log_writer_submitted++;
+    pthread_cond_signal(&log_writer_work);
+    pthread_mutex_unlock(&log_writer_lock);
+
+    if(stalled)
+    {
+        __sync_add_and_fetch(&log_stalled_ns,
+                             (uint64_t) (elapsed_seconds(&stalled_since) * 1000000000.0));
+    }
+}
+
+/* Sets *chunkp to an empty chunk for out, lines or the records rl, reusing a written one if any. */
+struct log_chunk_s *log_chunk_new(struct log_chunk_s **chunkp,
+                                  FILE *out,
+                                  struct line_log_s *lines,
+                                  struct record_log_s *rl)
+{
+    struct log_chunk_s *chunk;
+
+    pthread_mutex_lock(&log_writer_lock);
+    chunk = log_writer_free;
+    if(chunk)
+    {
+        log_writer_free = chunk->next;
+    }
+    pthread_mutex_unlock(&log_writer_lock);
+
+    if(!chunk)
+    {
+        chunk = (struct log_chunk_s *) malloc(sizeof(struct log_chunk_s));
+        if(!chunk)
+        {
+            return NULL;
+        }
+    }
+    chunk->out = out;
+    chunk->lines = lines;
+    chunk->records = rl;
+    chunk->len = 0;
+    *chunkp = chunk;
+
+    return chunk;
+}
+
+/* Appends "<tag>\t<dir>/<name>\n" to *chunkp for the log of root, submitting the chunk first when
+ * it is full or holds the lines of another log. The line of the --policy rule deciding the file, if
+ * any, is appended after a tab. Without the log writer, lines go straight to the
+ * log as before. With --log-compressed, lines end with a null byte instead of a newline, which a
+ * name may hold, and are front coded by the log writer, or right away without it. */
+void log_line(struct log_chunk_s **chunkp,
+              struct root_s *root,
+              char tag,
+              const char *dir,
+              size_t dir_len,
+              const char *name,
+              uint32_t rule)
+{
+    struct log_chunk_s *chunk = *chunkp;
+    FILE *out = root->logp;
+    struct line_log_s *lines = root->lines;
+    char rule_str[16] = "";
+    size_t rule_len = 0;
+    size_t name_len;
+    char *p;
+
+    if(rule)
+    {
+        rule_len = snprintf(rule_str, sizeof(rule_str), "\t%u", rule);
+    }
+
+    if(!log_writer_running && !lines)
+    {
+        fprintf(out, "%c\t%s/%s%s\n", tag, dir, name, rule_str);
+        return;
+    }
+
+    name_len = strlen(name);
+    if(chunk && (chunk->out != out || chunk->lines != lines ||
+                 chunk->len + dir_len + name_len + rule_len + 4 > LOG_CHUNK_SIZE))
+    {
+        log_chunk_submit(chunkp);
+        chunk = NULL;
+    }
+
+    if(!chunk && !(chunk = log_chunk_new(chunkp, out, lines, NULL)))
+    {
+        /* Not worth failing the walk over. */
+        if(lines)
+        {
+            __sync_add_and_fetch(&log_writer_failed, 1);
+        }
+        else
+        {
+            fprintf(out, "%c\t%s/%s%s\n", tag, dir, name, rule_str);
+        }
+        return;
+    }
+
+    /* PVFS_PATH_MAX and PVFS_NAME_MAX bound a line well below LOG_CHUNK_SIZE. */
+    p = chunk->data + chunk->len;
+    *p++ = tag;
+    *p++ = '\t';
+    memcpy(p, dir, dir_len);
+    p += dir_len;
+    *p++ = '/';
+    memcpy(p, name, name_len);
+    p += name_len;
+    memcpy(p, rule_str, rule_len);
+    p += rule_len;
+    *p++ = lines ? 0 : '\n';
+    chunk->len = p - chunk->data;
+}
+
+/* Creates the .rec and .names files beside the log of the directory tree at dir. The records they
+ * hold are only counted in the header once record_log_close completes them. */
+struct record_log_s *record_log_open(const char *dir, PVFS_time current_time, PVFS_fs_id fs_id)
+{
+    struct purge_records_header_s header;
+    char path[PATH_MAX];
+    struct record_log_s *rl;
+
+    rl = (struct record_log_s *) calloc(1, sizeof(struct record_log_s));
+    if(!rl)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate the records of %s\n", __func__, dir);
+        return NULL;
+    }
+
+    log_path_make(path, dir, current_time, PURGE_RECORDS_SUFFIX);
+    rl->recs = fopen(path, "w");
+    log_path_make(path, dir, current_time, PURGE_NAMES_SUFFIX);
+    rl->names = fopen(path, "w");
+    if(!rl->recs || !rl->names)
+    {
+        fprintf(stderr, "%s: ERROR: could not create the records of %s\n", __func__, dir);
+        goto error;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PURGE_RECORDS_MAGIC, sizeof(header.magic));
+    header.fs_id = fs_id;
+    header.current_time = current_time;
+    header.removal_basis_time = removal_basis_time;
+    header.count = UINT64_MAX;
+    if(fwrite(&header, sizeof(header), 1, rl->recs) != 1)
+    {
+        fprintf(stderr, "%s: ERROR: could not write the records of %s\n", __func__, dir);
+        goto error;
+    }
+
+    return rl;
+
+error:
+    if(rl->recs)
+    {
+        fclose(rl->recs);
+    }
+    if(rl->names)
+    {
+        fclose(rl->names);
+    }
+    free(rl);
+    return NULL;
+}
+
+/* Records a directory whose parent is not listed by this run, with its absolute path as its name.
+ * Only called before any record of the log has been queued. */
+void record_log_top(struct record_log_s *rl, PVFS_handle handle, const char *path)
+{
+    struct purge_record_s rec;
+    size_t name_len = strlen(path) + 1;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.handle = handle;
+    rec.decision = PURGE_RECORD_DIR;
+    rec.name_offset = rl->names_len;
+    if(fwrite(path, 1, name_len, rl->names) != name_len ||
+       fwrite(&rec, sizeof(rec), 1, rl->recs) != 1)
+    {
+        rl->failed = 1;
+    }
+    rl->names_len += name_len;
+    rl->count++;
+}
+
+/* Counts the records in the header of the .rec file and closes both files. Every chunk of the log
+ * must have been written. */
+void record_log_close(struct record_log_s *rl)
+{
+    if(!rl)
+    {
+        return;
+    }
+
+    if(fseek(rl->recs, offsetof(struct purge_records_header_s, count), SEEK_SET) != 0 ||
+       fwrite(&rl->count, sizeof(rl->count), 1, rl->recs) != 1)
+    {
+        rl->failed = 1;
+    }
+    if(fclose(rl->recs) != 0 || fclose(rl->names) != 0)
+    {
+        rl->failed = 1;
+    }
+    if(rl->failed)
+    {
+        fprintf(stderr, "%s: ERROR: some records could not be written\n", __func__);
+    }
+    free(rl);
+}
+
+/* Waits until every chunk submitted so far has been written, so that the logs they belong to may be
+ * completed or closed. */
+void log_writer_sync(void)
+{
+    uint64_t target;
+
+    if(!log_writer_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&log_writer_lock);
+    target = log_writer_submitted;
+    while(log_writer_written < target)
+    {
+        pthread_cond_wait(&log_writer_done, &log_writer_lock);
+    }
+    pthread_mutex_unlock(&log_writer_lock);
+}
+
+/* Writes what is left, stops the log writer and frees its chunks. */
+void log_writer_stop(void)
+{
+    struct log_chunk_s *chunk;
+
+    if(log_writer_running)
+    {
+        pthread_mutex_lock(&log_writer_lock);
+        log_writer_stopping = 1;
+        pthread_cond_signal(&log_writer_work);
+        pthread_mutex_unlock(&log_writer_lock);
+        pthread_join(log_writer_thread, NULL);
+        log_writer_running = 0;
+    }
+
+    while((chunk = log_writer_free))
+    {
+        log_writer_free = chunk->next;
+        free(chunk);
+    }
+
+    if(log_writer_failed > 0)
+    {
+        fprintf(stderr,
+                "%s: ERROR: could not write %llu chunks of logged files\n",
+                __func__,
+                LLU(log_writer_failed));
+    }
+}
+
+/* A node of the exclusions trie, one per path component of the --exclude-file lines. The literal
+ * children are sorted by name once the file is loaded, the glob children are matched in turn. */
+struct exclude_node_s
+{
+    char *name;                         /* A path component, or a glob of one. */
+    int excluded;                       /* The path up to this component is excluded. */
+    struct exclude_node_s *literals;
+    int literals_count;
+    struct exclude_node_s *globs;
+    int globs_count;
+};
+
+struct exclude_node_s exclusions;       /* The root, "/". */
+int exclusions_count = 0;
+
+void exclude_node_free(struct exclude_node_s *node)
+{
+    int i;
+
+    for(i = 0; i < node->literals_count; i++)
+    {
+        exclude_node_free(&node->literals[i]);
+    }
+    for(i = 0; i < node->globs_count; i++)
+    {
+        exclude_node_free(&node->globs[i]);
+    }
+    free(node->literals);
+    free(node->globs);
+    free(node->name);
+    memset(node, 0, sizeof(struct exclude_node_s));
+}
+
+int exclude_node_compare(const void *a, const void *b)
+{
+    return strcmp(((struct exclude_node_s *) a)->name, ((struct exclude_node_s *) b)->name);
+}
+
+void exclude_node_sort(struct exclude_node_s *node)
+{
+    int i;
+
+    if(node->literals_count > 1)
+    {
+        qsort(node->literals,
+              node->literals_count,
+              sizeof(struct exclude_node_s),
+              exclude_node_compare);
+    }
+    for(i = 0; i < node->literals_count; i++)
+    {
+        exclude_node_sort(&node->literals[i]);
+    }
+    for(i = 0; i < node->globs_count; i++)
+    {
+        exclude_node_sort(&node->globs[i]);
+    }
+}
+
+/* Returns the child of node named name, adding it if new, or NULL if it could not be allocated. */
+struct exclude_node_s *exclude_node_child(struct exclude_node_s *node, const char *name)
+{
+    int glob = strpbrk(name, "*?[") != NULL;
+    struct exclude_node_s **childrenp = glob ? &node->globs : &node->literals;
+    int *countp = glob ? &node->globs_count : &node->literals_count;
+    struct exclude_node_s *grown;
+    int i;
+
+    for(i = 0; i < *countp; i++)
+    {
+        if(strcmp((*childrenp)[i].name, name) == 0)
+        {
+            return &(*childrenp)[i];
+        }
+    }
+
+    grown = (struct exclude_node_s *) realloc(*childrenp,
+                                              (*countp + 1) * sizeof(struct exclude_node_s));
+    if(!grown)
+    {
+        return NULL;
+    }
+    *childrenp = grown;
+    memset(&grown[*countp], 0, sizeof(struct exclude_node_s));
+    grown[*countp].name = strdup(name);
+    if(!grown[*countp].name)
+    {
+        return NULL;
+    }
+    return &grown[(*countp)++];
+}
+
+/* Loads the directories not to purge of --exclude-file into the exclusions trie, one absolute path
+ * per line, any component of which may be a glob. */
+int exclude_load(const char *path)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int lineno = 0;
+    int ret = 0;
+
+    fp = fopen(path, "r");
+    if(!fp)
+    {
+        perror("ERROR: Could not open the exclusions file, reason= ");
+        return -1;
+    }
+
+    while((len = getline(&line, &line_size, fp)) >= 0)
+    {
+        struct exclude_node_s *node = &exclusions;
+        char *saveptr = NULL;
+        char *component;
+
+        lineno++;
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '/'))
+        {
+            line[--len] = 0;
+        }
+        if(len == 0)
+        {
+            continue;
+        }
+        if(line[0] != '/')
+        {
+            fprintf(stderr,
+                    "%s: ERROR: %s:%d: not an absolute path: %s\n",
+                    __func__,
+                    path,
+                    lineno,
+                    line);
+            ret = -1;
+            goto cleanup;
+        }
+
+        for(component = strtok_r(line, "/", &saveptr);
+            component;
+            component = strtok_r(NULL, "/", &saveptr))
+        {
+            node = exclude_node_child(node, component);
+            if(!node)
+            {
+                fprintf(stderr, "%s: ERROR: could not allocate the exclusions\n", __func__);
+                ret = -1;
+                goto cleanup;
+            }
+        }
+        node->excluded = 1;
+        exclusions_count++;
+    }
+    exclude_node_sort(&exclusions);
+
+cleanup:
+    free(line);
+    fclose(fp);
+
+    return ret;
+}
+
+/* Returns 1 if the path below node, path pointing past a '/', is excluded. */
+int exclude_match_node(struct exclude_node_s *node, const char *path)
+{
+    char component[NAME_MAX + 1];
+    struct exclude_node_s key;
+    struct exclude_node_s *child;
+    const char *slash;
+    const char *next;
+    size_t len;
+    int i;
+
+    if(node->excluded)
+    {
+        return 1;
+    }
+    if(!*path)
+    {
+        return 0;
+    }
+
+    slash = strchr(path, '/');
+    len = slash ? (size_t) (slash - path) : strlen(path);
+    next = slash ? slash + 1 : path + len;
+    if(len > NAME_MAX)
+    {
+        return 0;
+    }
+    memcpy(component, path, len);
+    component[len] = 0;
+
+    key.name = component;
+    child = (struct exclude_node_s *) bsearch(&key,
+                                              node->literals,
+                                              node->literals_count,
+                                              sizeof(struct exclude_node_s),
+                                              exclude_node_compare);
+    if(child && exclude_match_node(child, next))
+    {
+        return 1;
+    }
+
+    for(i = 0; i < node->globs_count; i++)
+    {
+        child = &node->globs[i];
+        if(strcmp(child->name, "**") == 0)
+        {
+            /* Any number of components, including none. */
+            const char *rest = path;
+
+            while(1)
+            {
+                if(exclude_match_node(child, rest))
+                {
+                    return 1;
+                }
+                if(!*rest)
+                {
+                    break;
+                }
+                slash = strchr(rest, '/');
+                rest = slash ? slash + 1 : rest + strlen(rest);
+            }
+        }
+        else if(fnmatch(child->name, component, 0) == 0 && exclude_match_node(child, next))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns 1 if the directory at path, absolute and without a trailing slash, or one of its parents
+ * matches a line of --exclude-file. */
+int exclude_match(const char *path)
+{
+    return exclusions_count > 0 && path[0] == '/' && exclude_match_node(&exclusions, path + 1);
+}
+
+/* Fills roots with the directory trees to purge: the count directories of args, or with
+ * --users-dir the subdirectories of args[0] in alphabetical order, less those of --exclude-file.
+ * Like orangefs-purge-user-dirs.sh, prints each excluded root to stdout and each one that cannot be
+ * resolved to stderr, the latter failing the run but not the other roots. */
+int roots_collect(char **args, int count)
+{
+    struct dirent **entries = NULL;
+    int entries_count = 0;
+    char path[PATH_MAX];
+    int ret = 0;
+    int i;
+
+    if(opts.users_dir)
+    {
+        entries_count = scandir(args[0], &entries, NULL, alphasort);
+        if(entries_count < 0)
+        {
+            perror("ERROR: Could not list the users directory, reason= ");
+            entries_count = 0;
+            ret = -1;
+            goto cleanup;
+        }
+        count = entries_count;
+    }
+
+    roots = (struct root_s *) calloc(count > 0 ? count : 1, sizeof(struct root_s));
+    if(!roots)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate %d roots\n", __func__, count);
+        ret = -1;
+        goto cleanup;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        struct stat sb;
+        size_t n;
+
+        if(opts.users_dir)
+        {
+            if(strcmp(entries[i]->d_name, ".") == 0 || strcmp(entries[i]->d_name, "..") == 0)
+            {
+                continue;
+            }
+            snprintf(path, PATH_MAX, "%s/%s", args[0], entries[i]->d_name);
+            if(lstat(path, &sb) != 0 || !S_ISDIR(sb.st_mode))
+            {
+                continue;
+            }
+        }
+        else
+        {
+            snprintf(path, PATH_MAX, "%s", args[i]);
+        }
+
+        /* Exclusions never end with a slash. */
+        n = strlen(path);
+        while(n > 1 && path[n - 1] == '/')
+        {
+            path[--n] = 0;
+        }
+
+        if(exclude_match(path))
+        {
+            printf("excluding\t%s\n", path);
+            continue;
+        }
+
+        if(root_resolve(path, &roots[roots_count].ref) != 0)
+        {
+            fprintf(stderr, "FAILED\t%s\n", path);
+            roots_failed++;
+            continue;
+        }
+
+        roots[roots_count].path = strdup(path);
+        if(!roots[roots_count].path)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate the root path\n", __func__);
+            ret = -1;
+            goto cleanup;
+        }
+        roots_count++;
+    }
+    fflush(stdout);
+
+    /* Each walker purges one root at a time at most. */
+    roots_slots = roots_count < opts.threads ? roots_count : opts.threads;
+    if(roots_slots < 1)
+    {
+        roots_slots = 1;
+    }
+
+cleanup:
+    for(i = 0; i < entries_count; i++)
+    {
+        free(entries[i]);
+    }
+    free(entries);
+
+    return ret;
+}
+
+/* Classification of a directory entry, shared by every walker. */
+typedef enum
+{
+    DIRENT_REMOVE,          /* A file not read nor written since removal_basis_time. */
+    DIRENT_KEEP,            /* A file to be kept. */
+    DIRENT_EXEMPT,          /* A file to be removed but for --marker or --exempt-xattr. */
+    DIRENT_DIR,
+    DIRENT_LNK,
+    DIRENT_UNKNOWN
+} dirent_class_type;
+
+/* What the walkers need to know about a directory entry, see dirent_record. The walkers used to
+ * convert every entry's PVFS_sys_attr to a struct stat first, which is several times larger. */
+struct dirent_rec_s
+{
+    dirent_class_type cls;
+    PVFS_handle handle;
+    PVFS_size size;         /* Unless --kept-bytes is exact, only valid if needed for the entry. */
+    PVFS_uid owner;
+    PVFS_gid group;
+    uint32_t rule;          /* The line of the --policy rule that decided a file, 0 without one. */
+    const char *name;       /* Points into the readdirplus response. */
+};
+
+/* The --policy file compiled into a flat program of tests, see policy_load. The tests of a rule's
+ * alternative follow each other; the last one carries the rule's line and action. A test that fails
+ * goes on with the first test of the next alternative, so a file is decided by the first
+ * alternative whose tests all pass, or kept when none does. Every numeric test is a range check of
+ * one attribute, ages having been turned into times when the policy was loaded. */
+typedef enum
+{
+    POLICY_TRUE,            /* The test of a rule without conditions. */
+    POLICY_ATIME,
+    POLICY_MTIME,
+    POLICY_SIZE,
+    POLICY_UID,
+    POLICY_GID,
+    POLICY_NAME,            /* The name of the file matches a glob pattern. */
+    POLICY_PATH             /* Likewise for its absolute path. */
+} policy_field_type;
+
+struct policy_test_s
+{
+    policy_field_type field;
+    int negate;             /* Passes when the value is outside of [lo, hi] or the pattern fails. */
+    int64_t lo;
+    int64_t hi;
+    char *pattern;
+    uint32_t fail;          /* The test to go on with when this one fails. */
+    uint32_t rule;          /* On the last test of an alternative, the line of its rule, else 0. */
+    dirent_class_type action;
+};
+
+struct policy_test_s *policy = NULL;
+uint32_t policy_count = 0;
+uint32_t policy_fields = 0;     /* A bit per policy_field_type tested. */
+
+/* The most words of a --policy rule. */
+#define POLICY_WORDS_MAX 256
+
+void policy_free(void)
+{
+    uint32_t i;
+
+    for(i = 0; i < policy_count; i++)
+    {
+        free(policy[i].pattern);
+    }
+    free(policy);
+    policy = NULL;
+    policy_count = 0;
+}
+
+/* Appends a test to the program. */
+struct policy_test_s *policy_add(uint32_t *sizep)
+{
+    if(policy_count == *sizep)
+    {
+        struct policy_test_s *grown;
+
+        *sizep = *sizep ? 2 * *sizep : 16;
+        grown = (struct policy_test_s *) realloc(policy, *sizep * sizeof(struct policy_test_s));
+        if(!grown)
+        {
+            return NULL;
+        }
+        policy = grown;
+    }
+    memset(&policy[policy_count], 0, sizeof(struct policy_test_s));
+
+    return &policy[policy_count++];
+}
+
+/* Compiles the test "field op value" into t. Ages are turned into times before now, with the
+ * comparison reversed. Returns -1 if the test is invalid. */
+int policy_test_compile(struct policy_test_s *t,
+                        const char *field,
+                        const char *op,
+                        const char *value,
+                        PVFS_time now)
+{
+    static const char *ops[] = {"<", "<=", ">", ">=", "=", "!="};
+    uint64_t number = 0;
+    int64_t c;
+    char *end = NULL;
+    int o;
+
+    for(o = 0; o < 6 && strcmp(op, ops[o]) != 0; o++)
+    {
+    }
+    if(o == 6)
+    {
+        return -1;
+    }
+
+    if(strcmp(field, "name") == 0 || strcmp(field, "path") == 0)
+    {
+        if(o < 4)
+        {
+            return -1;
+        }
+        t->field = field[0] == 'n' ? POLICY_NAME : POLICY_PATH;
+        t->negate = o == 5;
+        t->pattern = strdup(value);
+        return t->pattern ? 0 : -1;
+    }
+
+    if(strcmp(field, "atime") == 0 || strcmp(field, "mtime") == 0)
+    {
+        t->field = field[0] == 'a' ? POLICY_ATIME : POLICY_MTIME;
+        if(parse_age(value, &number) != 0)
+        {
+            return -1;
+        }
+        /* An age older than A is a time before now - A. */
+        c = now - (int64_t) number;
+        o = o == 4 || o == 5 ? o : o ^ 2;
+    }
+    else if(strcmp(field, "size") == 0)
+    {
+        t->field = POLICY_SIZE;
+        if(parse_size(value, &number) != 0)
+        {
+            return -1;
+        }
+        c = (int64_t) number;
+    }
+    else if(strcmp(field, "uid") == 0 || strcmp(field, "gid") == 0)
+    {
+        t->field = field[0] == 'u' ? POLICY_UID : POLICY_GID;
+        number = strtoull(value, &end, 10);
+        if(end == value || *end)
+        {
+            return -1;
+        }
+        c = (int64_t) number;
+    }
+    else
+    {
+        return -1;
+    }
+
+    t->lo = o == 0 || o == 1 ? INT64_MIN : o == 2 ? c + 1 : c;
+    t->hi = o == 2 || o == 3 ? INT64_MAX : o == 0 ? c - 1 : c;
+    t->negate = o == 5;
+
+    return 0;
+}
+
+/* Loads and compiles the --policy file at path, ages being measured from now. Each line holds a
+ * rule: "remove" or "keep", optionally followed by tests joined by "and" and alternatives joined by
+ * "or", every word separated by blanks. A '#' starts a comment. */
+int policy_load(const char *path, PVFS_time now)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    uint32_t size = 0;
+    uint32_t lineno = 0;
+    FILE *fp;
+    int ret = -1;
+
+    fp = fopen(path, "r");
+    if(!fp)
+    {
+        fprintf(stderr, "%s: ERROR: could not open %s\n", __func__, path);
+        return -1;
+    }
+
+    while(getline(&line, &line_size, fp) != -1)
+    {
+        char *words[POLICY_WORDS_MAX];
+        char *saveptr = NULL;
+        char *word;
+        dirent_class_type action;
+        uint32_t first;
+        uint32_t j;
+        int count = 0;
+        int i = 1;
+
+        lineno++;
+        if((word = strchr(line, '#')))
+        {
+            *word = 0;
+        }
+        for(word = strtok_r(line, " \t\r\n", &saveptr);
+            word && count < POLICY_WORDS_MAX;
+            word = strtok_r(NULL, " \t\r\n", &saveptr))
+        {
+            words[count++] = word;
+        }
+        if(count == 0)
+        {
+            continue;
+        }
+        if(word)
+        {
+            fprintf(stderr, "%s: ERROR: %s:%u: rule too long\n", __func__, path, lineno);
+            goto cleanup;
+        }
+        if(strcmp(words[0], "remove") == 0)
+        {
+            action = DIRENT_REMOVE;
+        }
+        else if(strcmp(words[0], "keep") == 0)
+        {
+            action = DIRENT_KEEP;
+        }
+        else
+        {
+            fprintf(stderr, "%s: ERROR: %s:%u: expected remove or keep\n", __func__, path, lineno);
+            goto cleanup;
+        }
+
+        do
+        {
+            struct policy_test_s *t;
+
+            first = policy_count;
+            for(;;)
+            {
+                t = policy_add(&size);
+                if(!t)
+                {
+                    fprintf(stderr, "%s: ERROR: could not allocate the policy\n", __func__);
+                    goto cleanup;
+                }
+                if(count == 1)
+                {
+                    /* A rule without tests. */
+                    t->field = POLICY_TRUE;
+                    break;
+                }
+                if(count - i < 3 ||
+                   policy_test_compile(t, words[i], words[i + 1], words[i + 2], now) != 0)
+                {
+                    fprintf(stderr,
+                            "%s: ERROR: %s:%u: invalid test at word %d\n",
+                            __func__, path, lineno, i + 1);
+                    goto cleanup;
+                }
+                policy_fields |= 1 << t->field;
+                i += 3;
+                if(i == count || strcmp(words[i], "and") != 0)
+                {
+                    break;
+                }
+                i++;
+            }
+
+            t->rule = lineno;
+            t->action = action;
+            for(j = first; j < policy_count; j++)
+            {
+                policy[j].fail = policy_count;
+            }
+
+            if(i < count && (strcmp(words[i], "or") != 0 || i + 1 == count))
+            {
+                fprintf(stderr,
+                        "%s: ERROR: %s:%u: unexpected %s at word %d\n",
+                        __func__, path, lineno, words[i], i + 1);
+                goto cleanup;
+            }
+        } while(++i < count);
+    }
+    ret = 0;
+
+cleanup:
+    free(line);
+    fclose(fp);
+    if(ret != 0)
+    {
+        policy_free();
+    }
+
+    return ret;
+}
+
+/* Returns 1 if the file of attributes attrp named name in the directory dir passes test t. */
+static inline int policy_test(struct policy_test_s *t,
+                              PVFS_sys_attr *attrp,
+                              const char *dir,
+                              const char *name)
+{
+    char path[PVFS_PATH_MAX];
+    int64_t value;
+
+    switch(t->field)
+    {
+        case POLICY_ATIME:
+            value = attrp->atime;
+            break;
+        case POLICY_MTIME:
+            value = attrp->mtime;
+            break;
+        case POLICY_SIZE:
+            value = attrp->size;
+            break;
+        case POLICY_UID:
+            value = attrp->owner;
+            break;
+        case POLICY_GID:
+            value = attrp->group;
+            break;
+        case POLICY_NAME:
+            return (fnmatch(t->pattern, name, 0) == 0) != t->negate;
+        case POLICY_PATH:
+            snprintf(path, PVFS_PATH_MAX, "%s/%s", dir, name);
+            return (fnmatch(t->pattern, path, 0) == 0) != t->negate;
+        default:
+            return 1;
+    }
+
+    return (value >= t->lo && value <= t->hi) != t->negate;
+}
+
+/* Runs the policy program for a file, setting *rulep to the line of the rule deciding it. */
+dirent_class_type policy_decide(PVFS_sys_attr *attrp,
+                                const char *dir,
+                                const char *name,
+                                uint32_t *rulep)
+{
+    uint32_t i = 0;
+
+    while(i < policy_count)
+    {
+        struct policy_test_s *t = &policy[i];
+
+        if(!policy_test(t, attrp, dir, name))
+        {
+            i = t->fail;
+        }
+        else if(t->rule)
+        {
+            *rulep = t->rule;
+            return t->action;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    return DIRENT_KEEP;
+}
+
+/* Decides what to do with the entry name of the directory dir based on its attributes, files being
+ * removed once older than basis. The --policy rule deciding a file is stored in *rulep. */
+dirent_class_type classify_dirent(PVFS_sys_attr *attrp,
+                                  PVFS_time basis,
+                                  const char *dir,
+                                  const char *name,
+                                  uint32_t *rulep)
+{
+    /* file/link/dir? */
+    switch(attrp->objtype)
+    {
+        case PVFS_TYPE_METAFILE:
+            DEBUG("\t\tFILE\n");
+
+#if DEBUG_ON == 1
+            char *readable_time = NULL;
+            DEBUG("INFO: atime was %llu or %s",
+                  LLU(attrp->atime),
+                  (readable_time = human_readable_time(attrp->atime)));
+            free(readable_time);
+#endif
+
+            if(policy)
+            {
+                return policy_decide(attrp, dir, name, rulep);
+            }
+
+            if(attrp->atime < basis && attrp->mtime < basis)
+            {
+                return DIRENT_REMOVE;
+            }
+
+            return DIRENT_KEEP;
+
+        case PVFS_TYPE_DIRECTORY:
+            DEBUG("\t\tDIR\n");
+            return DIRENT_DIR;
+
+        case PVFS_TYPE_SYMLINK:
+            DEBUG("\t\tLNK\n");
+            return DIRENT_LNK;
+
+        default:
+            return DIRENT_UNKNOWN;
+    }
+}
+
+/* Classifies an entry of dir into *recp, a file to remove being kept instead when exempt by
+ * --marker or --exempt-xattr. */
+void dirent_record(struct dirent_rec_s *recp,
+                   PVFS_time basis,
+                   int exempt,
+                   const char *dir,
+                   PVFS_dirent *direntp,
+                   PVFS_sys_attr *attrp)
+{
+    recp->rule = 0;
+    recp->cls = classify_dirent(attrp, basis, dir, direntp->d_name, &recp->rule);
+    if(recp->cls == DIRENT_REMOVE && exempt)
+    {
+        recp->cls = DIRENT_EXEMPT;
+    }
+    recp->handle = direntp->handle;
+    recp->size = attrp->size;
+    recp->owner = attrp->owner;
+    recp->group = attrp->group;
+    recp->name = direntp->d_name;
+}
+
+/* Settles whether the files of a directory are exempt from removal by --marker as far as its batch
+ * resp read from token tells. The marker is looked for among the names of every batch, which costs
+ * nothing. Returns 1 if *exemptp is left unsettled: a directory that does not fit in its first
+ * batch needs a lookup of the marker as well (see exempt_lookup_done), so that none of its files is
+ * removed before a later batch turns up the marker. */
+int exempt_scan(exempt_type *exemptp, PVFS_ds_position token, PVFS_sysresp_readdirplus *resp)
+{
+    int i;
+
+    if(!opts.marker || *exemptp >= EXEMPT_MARKED)
+    {
+        return 0;
+    }
+
+    for(i = 0; i < resp->pvfs_dirent_outcount; i++)
+    {
+        if(strcmp(resp->dirent_array[i].d_name, opts.marker) == 0)
+        {
+            *exemptp = EXEMPT_MARKED;
+            return 0;
+        }
+    }
+
+    if(*exemptp == EXEMPT_NONE ||
+       (token == PVFS_READDIR_START && resp->token == PVFS_ITERATE_END))
+    {
+        *exemptp = EXEMPT_NONE;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Settles *exemptp from the lookup of the marker in the directory at path, done by lookup_fn and
+ * returning ret. Should the lookup fail, the files of the directory are kept. */
+void exempt_lookup_done(exempt_type *exemptp, const char *path, const char *lookup_fn, int ret)
+{
+    if(ret == -PVFS_ENOENT)
+    {
+        *exemptp = EXEMPT_NONE;
+        return;
+    }
+    if(ret < 0)
+    {
+        PVFS_perror(lookup_fn, ret);
+        fprintf(stderr,
+                "%s: WARNING: could not look for the marker, keeping the files of path = %s\n",
+                __func__,
+                path);
+    }
+    *exemptp = EXEMPT_MARKED;
+}
+
+/* Settles whether the files of the directory at ref, listed at path, are exempt from removal by
+ * --marker, given its batch resp read from token, looking the marker up with the blocking
+ * PVFS_sys_ref_lookup when exempt_scan needs it. The event loop issues that lookup nonblocking
+ * instead (see ev_fetch_marker). */
+void exempt_check(exempt_type *exemptp,
+                  PVFS_object_ref ref,
+                  const char *path,
+                  PVFS_ds_position token,
+                  PVFS_sysresp_readdirplus *resp)
+{
+    PVFS_sysresp_lookup lk_response;
+    int ret;
+
+    if(!exempt_scan(exemptp, token, resp))
+    {
+        return;
+    }
+
+    memset(&lk_response, 0, sizeof(PVFS_sysresp_lookup));
+    ret = PVFS_sys_ref_lookup(ref.fs_id,
+                              opts.marker,
+                              ref,
+                              &creds,
+                              &lk_response,
+                              PVFS2_LOOKUP_LINK_NO_FOLLOW,
+                              NULL);
+    exempt_lookup_done(exemptp, path, "PVFS_sys_ref_lookup", ret);
+}
+
+/* Appends the record of an entry of the directory parent to *chunkp, submitting it first when it is
+ * full or holds the records of another log. */
+void log_record(struct log_chunk_s **chunkp,
+                struct record_log_s *rl,
+                struct dirent_rec_s *recp,
+                PVFS_handle parent,
+                PVFS_sys_attr *attrp)
+{
+    struct log_chunk_s *chunk = *chunkp;
+    struct purge_record_s rec;
+    size_t name_len = strlen(recp->name) + 1;
+
+    if(chunk && (chunk->records != rl || chunk->len + sizeof(rec) + name_len > LOG_CHUNK_SIZE))
+    {
+        log_chunk_submit(chunkp);
+        chunk = NULL;
+    }
+    if(!chunk && !(chunk = log_chunk_new(chunkp, NULL, NULL, rl)))
+    {
+        rl->failed = 1;
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.handle = recp->handle;
+    rec.parent = parent;
+    rec.size = recp->size;
+    rec.atime = attrp->atime;
+    rec.mtime = attrp->mtime;
+    rec.uid = attrp->owner;
+    rec.gid = attrp->group;
+    rec.name_offset = name_len;
+    rec.rule = recp->rule;
+    switch(recp->cls)
+    {
+        case DIRENT_REMOVE:
+            rec.decision = PURGE_RECORD_REMOVED;
+            break;
+        case DIRENT_KEEP:
+        case DIRENT_EXEMPT:
+            rec.decision = PURGE_RECORD_KEPT;
+            break;
+        case DIRENT_DIR:
+            rec.decision = PURGE_RECORD_DIR;
+            break;
+        case DIRENT_LNK:
+            rec.decision = PURGE_RECORD_LINK;
+            break;
+        default:
+            rec.decision = PURGE_RECORD_UNKNOWN;
+            break;
+    }
+
+    memcpy(&chunk->data[chunk->len], &rec, sizeof(rec));
+    memcpy(&chunk->data[chunk->len + sizeof(rec)], recp->name, name_len);
+    chunk->len += sizeof(rec) + name_len;
+}
+
+/* Completes the path of an entry in a path buffer of PVFS_PATH_MAX bytes which already holds the
+ * path of its directory followed by a '/', dir_len + 1 bytes in all. The walkers only do so when a
+ * full path is needed, to queue a subdirectory or to remove a file; log lines and error messages
+ * print the directory path and the name instead. Returns NULL if the path would be too long. */
+char *dirent_path_fill(char *dirent_path, size_t dir_len, struct dirent_rec_s *recp)
+{
+    size_t name_len = strlen(recp->name);
+
+    if(dir_len + 1 + name_len >= PVFS_PATH_MAX)
+    {
+        fprintf(stderr,
+                "%s: ERROR: path too long, path = %.*s%s\n",
+                __func__,
+                (int) dir_len + 1,
+                dirent_path,
+                recp->name);
+        return NULL;
+    }
+
+    /* Copy starting after the '/' character, including the terminating null byte. */
+    memcpy(&dirent_path[dir_len + 1], recp->name, name_len + 1);
+    return dirent_path;
+}
+
+/* Returns the counters of id in ot, adding them if new, or NULL if the table could not grow. */
+struct purge_stats_s *owner_find(struct owner_table_s *ot, int kind, uint32_t id)
+{
+    uint64_t key = OWNER_KEY(kind, id);
+    uint64_t i;
+
+    if(2 * (ot->count + 1) > (ot->slots ? ot->mask + 1 : 0))
+    {
+        uint64_t size = ot->slots ? 2 * (ot->mask + 1) : 64;
+        struct owner_rec_s *slots;
+        uint64_t j;
+
+        slots = (struct owner_rec_s *) calloc(size, sizeof(struct owner_rec_s));
+        if(!slots)
+        {
+            fprintf(stderr, "%s: ERROR: could not grow the owner counters\n", __func__);
+            return NULL;
+        }
+        for(j = 0; ot->slots && j <= ot->mask; j++)
+        {
+            if(ot->slots[j].key)
+            {
+                for(i = (ot->slots[j].key * 0x9E3779B97F4A7C15ULL >> 32) & (size - 1);
+                    slots[i].key;
+                    i = (i + 1) & (size - 1))
+                {
+                }
+                slots[i] = ot->slots[j];
+            }
+        }
+        free(ot->slots);
+        ot->slots = slots;
+        ot->mask = size - 1;
+    }
+
+    for(i = (key * 0x9E3779B97F4A7C15ULL >> 32) & ot->mask;
+        ot->slots[i].key;
+        i = (i + 1) & ot->mask)
+    {
+        if(ot->slots[i].key == key)
+        {
+            return &ot->slots[i].stats;
+        }
+    }
+    ot->slots[i].key = key;
+    ot->count++;
+
+    return &ot->slots[i].stats;
+}
+
+void owner_table_free(struct owner_table_s *ot)
+{
+    free(ot->slots);
+    memset(ot, 0, sizeof(*ot));
+}
+
+/* Sets targets to psp followed by the counters in ot of the owner and group of an entry, as far as
+ * --uid-stats and --gid-stats ask for them, and returns how many there are. ot may be NULL. */
+int account_targets(struct purge_stats_s *psp,
+                    struct owner_table_s *ot,
+                    PVFS_uid owner,
+                    PVFS_gid group,
+                    struct purge_stats_s **targets)
+{
+    int count = 0;
+
+    targets[count++] = psp;
+    if(ot && opts.uid_stats && (targets[count] = owner_find(ot, OWNER_UID, owner)))
+    {
+        count++;
+    }
+    if(ot && opts.gid_stats && (targets[count] = owner_find(ot, OWNER_GID, group)))
+    {
+        count++;
+    }
+
+    return count;
+}
+
+/* Accounts for an expired file given the result of removing it: 0 on success (or a dry-run) and
+ * the negative PVFS error code otherwise. */
+void account_removal(struct purge_stats_s *psp,
+                     struct owner_table_s *ot,
+                     PVFS_uid owner,
+                     PVFS_gid group,
+                     char *path,
+                     PVFS_size size,
+                     int ret)
+{
+    struct purge_stats_s *targets[3];
+    int count = account_targets(psp, ot, owner, group, targets);
+    int i;
+
+    if(ret < 0)
+    {
+        for(i = 0; i < count; i++)
+        {
+            targets[i]->frm_fils++;
+            targets[i]->frm_bytes += size;
+        }
+        PVFS_perror("PVFS_sys_remove", ret);
+        fprintf(stderr,
+                "%s: WARNING: failed to remove path = %s\n",
+                __func__,
+                path);
+        return;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        targets[i]->rm_fils++;
+        targets[i]->rm_bytes += size;
+    }
+}
+
+/* Accounts for a kept file. Unless --kept-bytes is exact, only the sizes fetched for the sample are
+ * known (see dirent_needs_size). */
+void account_kept(struct purge_stats_s *psp, struct owner_table_s *ot, PVFS_sys_attr *attrp)
+{
+    struct purge_stats_s *targets[3];
+    int count = account_targets(psp, ot, attrp->owner, attrp->group, targets);
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        targets[i]->kept_fils++;
+
+        if(opts.kept_bytes_mode == KEPT_BYTES_EXACT)
+        {
+            targets[i]->kept_bytes += attrp->size;
+        }
+        else if(attrp->mask & PVFS_ATTR_SYS_SIZE)
+        {
+            targets[i]->sampled_fils++;
+            targets[i]->sampled_bytes += attrp->size;
+        }
+    }
+}
+
+/* Accounts for an expired file kept by --marker or --exempt-xattr. */
+void account_exempt(struct purge_stats_s *psp,
+                    struct owner_table_s *ot,
+                    PVFS_uid owner,
+                    PVFS_gid group,
+                    PVFS_size size)
+{
+    struct purge_stats_s *targets[3];
+    int count = account_targets(psp, ot, owner, group, targets);
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        targets[i]->exempt_fils++;
+        targets[i]->exempt_bytes += size;
+    }
+}
+
+/* Accounts for a directory, symbolic link or entry of unknown type. */
+void account_other(struct purge_stats_s *psp,
+                   struct owner_table_s *ot,
+                   PVFS_sys_attr *attrp,
+                   dirent_class_type cls)
+{
+    struct purge_stats_s *targets[3];
+    int count = account_targets(psp, ot, attrp->owner, attrp->group, targets);
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        if(cls == DIRENT_DIR)
+        {
+            targets[i]->dirs++;
+        }
+        else if(cls == DIRENT_LNK)
+        {
+            targets[i]->lnks++;
+        }
+        else
+        {
+            targets[i]->unknown++;
+        }
+    }
+}
+
+/* Returns 1 if the size of an entry listed without it must be fetched with a getattr: the size of
+ * every expired file is needed to account for its removal and, when estimating kept_bytes, that of
+ * one kept file in opts.size_sample. *samplep counts the kept files seen so far. Until then the
+ * entry's size is 0 and PVFS_ATTR_SYS_SIZE is cleared from its mask. */
+int dirent_needs_size(PVFS_sys_attr *attrp,
+                      PVFS_time basis,
+                      const char *dir,
+                      const char *name,
+                      uint64_t *samplep)
+{
+    uint32_t rule;
+
+    attrp->mask &= ~PVFS_ATTR_SYS_SIZE;
+    attrp->size = 0;
+
+    switch(classify_dirent(attrp, basis, dir, name, &rule))
+    {
+        case DIRENT_REMOVE:
+            return 1;
+        case DIRENT_KEEP:
+            return opts.kept_bytes_mode == KEPT_BYTES_ESTIMATE &&
+                   (*samplep)++ % opts.size_sample == 0;
+        default:
+            return 0;
+    }
+}
+
+/* Fetches the sizes a batch listed without them needs (see dirent_needs_size). All of the getattrs
+ * are issued with the nonblocking PVFS_isys_getattr before waiting for any of them. A size which
+ * cannot be fetched is left at 0. */
+void fetch_batch_sizes(PVFS_sysresp_readdirplus *rdplus_responsep,
+                       PVFS_fs_id fs_id,
+                       PVFS_time basis,
+                       const char *dir,
+                       uint64_t *samplep)
+{
+    PVFS_sysresp_getattr getattr_responses[PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS];
+    PVFS_sys_op_id op_ids[PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS];
+    int indexes[PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS];
+    PVFS_object_ref ref;
+    int count = 0;
+    int ret;
+    int i;
+
+    ref.fs_id = fs_id;
+
+    for(i = 0; i < rdplus_responsep->pvfs_dirent_outcount &&
+               i < PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS; i++)
+    {
+        if(!dirent_needs_size(&rdplus_responsep->attr_array[i],
+                              basis,
+                              dir,
+                              rdplus_responsep->dirent_array[i].d_name,
+                              samplep))
+        {
+            continue;
+        }
+        ref.handle = rdplus_responsep->dirent_array[i].handle;
+
+        memset(&getattr_responses[count], 0, sizeof(PVFS_sysresp_getattr));
+        rate_limit_wait();
+        ret = PVFS_isys_getattr(ref,
+                                PVFS_ATTR_SYS_SIZE,
+                                &creds,
+                                &getattr_responses[count],
+                                &op_ids[count],
+                                NULL,
+                                NULL);
+        if(ret < 0)
+        {
+            PVFS_perror("PVFS_isys_getattr", ret);
+            fprintf(stderr,
+                    "%s: WARNING: could not fetch the size of entry = %s\n",
+                    __func__,
+                    rdplus_responsep->dirent_array[i].d_name);
+            continue;
+        }
+        indexes[count++] = i;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        PVFS_sys_attr *attrp = &rdplus_responsep->attr_array[indexes[i]];
+        int op_ret = 0;
+
+        if(PVFS_sys_wait(op_ids[i], "getattr", &op_ret) < 0 || op_ret < 0)
+        {
+            fprintf(stderr,
+                    "%s: WARNING: could not fetch the size of entry = %s\n",
+                    __func__,
+                    rdplus_responsep->dirent_array[indexes[i]].d_name);
+            continue;
+        }
+
+        attrp->size = getattr_responses[i].attr.size;
+        attrp->mask |= PVFS_ATTR_SYS_SIZE;
+        PVFS_util_release_sys_attr(&getattr_responses[i].attr);
+    }
+}
+
+/* Returns whether a lookup of --exempt-xattr that completed with err, reading *valp, exempts its
+ * object. An absent attribute does not exempt, and neither does until:EPOCH once EPOCH has passed;
+ * any other value does. So does a lookup that failed, leaving a file which cannot be told apart
+ * from a tagged one in place. */
+int tag_exempts(PVFS_error err, PVFS_ds_keyval *valp)
+{
+    char value[TAG_VALUE_MAX + 1];
+    char *end;
+    long long until;
+    int len;
+
+    if(err == -PVFS_ENOENT || err == -PVFS_ENODATA)
+    {
+        return 0;
+    }
+    if(err < 0)
+    {
+        PVFS_perror("PVFS_sys_geteattr_list", err);
+        return 1;
+    }
+
+    len = valp->read_sz < TAG_VALUE_MAX ? valp->read_sz : TAG_VALUE_MAX;
+    memcpy(value, valp->buffer, len);
+    value[len] = '\0';
+    if(strncmp(value, "until:", 6) != 0)
+    {
+        return 1;
+    }
+    until = strtoll(&value[6], &end, 10);
+    if(end == &value[6] || (*end != '\0' && *end != '\n'))
+    {
+        return 1;
+    }
+    return until > (long long) time(NULL);
+}
+
+/* Warns that --exempt-xattr could not be fetched for entry index of a batch of dir or, when index
+ * is -1 - k, for the directory k levels above dir (dir itself when k is 0), then exempt. */
+void tag_warn(const char *dir, PVFS_sysresp_readdirplus *rdplus_responsep, int index)
+{
+    int len = strlen(dir);
+    int k;
+
+    for(k = -1 - index; k > 0 && len > 1; k--)
+    {
+        while(len > 1 && dir[len - 1] != '/')
+        {
+            len--;
+        }
+        if(len > 1)
+        {
+            len--;
+        }
+    }
+
+    fprintf(stderr,
+            "%s: WARNING: could not fetch %s, exempting path = %.*s%s%s\n",
+            __func__,
+            opts.exempt_xattr,
+            len,
+            dir,
+            index < 0 ? "" : "/",
+            index < 0 ? "" : rdplus_responsep->dirent_array[index].d_name);
+}
+
+/* Returns the handle of entry index of a batch of the directory at handle or, when index is -1 - k,
+ * of the directory k levels above it, the last of the above_count directories above being its
+ * parent. */
+PVFS_handle tag_handle(PVFS_sysresp_readdirplus *rdplus_responsep,
+                       PVFS_handle handle,
+                       const PVFS_handle *above,
+                       int above_count,
+                       int index)
+{
+    if(index >= 0)
+    {
+        return rdplus_responsep->dirent_array[index].handle;
+    }
+    if(index == -1)
+    {
+        return handle;
+    }
+    return above[above_count + 1 + index];
+}
+
+/* Sets the tag of a subdirectory, *tagp, and the directories above it whose tag is unknown,
+ * *abovep and *above_countp, given the tag of its parent at handle and the above_count directories
+ * above the parent. Nothing is fetched until a batch of the subdirectory holds a file to remove
+ * (see tag_claim), so a tree where nothing expires costs no fetch. Returns -1 if the list could not
+ * be allocated. */
+int tag_inherit(tag_type tag,
+                const PVFS_handle *above,
+                int above_count,
+                PVFS_handle handle,
+                tag_type *tagp,
+                PVFS_handle **abovep,
+                int *above_countp)
+{
+    *tagp = tag == TAG_EXEMPT ? TAG_EXEMPT : TAG_UNKNOWN;
+    *abovep = NULL;
+    *above_countp = 0;
+    if(!opts.exempt_xattr || tag != TAG_UNKNOWN)
+    {
+        return 0;
+    }
+
+    *abovep = (PVFS_handle *) malloc((above_count + 1) * sizeof(PVFS_handle));
+    if(!*abovep)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate the directories above\n", __func__);
+        return -1;
+    }
+    if(above_count > 0)
+    {
+        memcpy(*abovep, above, above_count * sizeof(PVFS_handle));
+    }
+    (*abovep)[above_count] = handle;
+    *above_countp = above_count + 1;
+    return 0;
+}
+
+/* Returns the slot of handle in tag_slots, or NULL if it is not there unless add is set, in which
+ * case it is added as being fetched. tag_lock must be held and, to add, tag_slots_reserve
+ * called. */
+struct tag_slot_s *tag_slot(PVFS_handle handle, int add)
+{
+    uint64_t i;
+
+    if(!tag_slots)
+    {
+        return NULL;
+    }
+
+    for(i = (handle * 0x9E3779B97F4A7C15ULL >> 32) & tag_slots_mask;
+        tag_slots[i].handle;
+        i = (i + 1) & tag_slots_mask)
+    {
+        if(tag_slots[i].handle == handle)
+        {
+            return &tag_slots[i];
+        }
+    }
+    if(!add)
+    {
+        return NULL;
+    }
+
+    tag_slots[i].handle = handle;
+    tag_slots[i].tag = TAG_UNKNOWN;
+    tag_slots[i].waiters = NULL;
+    tag_slots_count++;
+    return &tag_slots[i];
+}
+
+/* Grows tag_slots, tag_lock being held, so that count more directories can be added. */
+int tag_slots_reserve(uint64_t count)
+{
+    uint64_t size = tag_slots ? tag_slots_mask + 1 : 0;
+    struct tag_slot_s *slots;
+    uint64_t i;
+    uint64_t j;
+
+    if(2 * (tag_slots_count + count) <= size)
+    {
+        return 0;
+    }
+
+    size = size ? size : 64;
+    while(2 * (tag_slots_count + count) > size)
+    {
+        size *= 2;
+    }
+    slots = (struct tag_slot_s *) calloc(size, sizeof(struct tag_slot_s));
+    if(!slots)
+    {
+        fprintf(stderr, "%s: ERROR: could not grow the tags\n", __func__);
+        return -1;
+    }
+    for(j = 0; tag_slots && j <= tag_slots_mask; j++)
+    {
+        if(tag_slots[j].handle)
+        {
+            for(i = (tag_slots[j].handle * 0x9E3779B97F4A7C15ULL >> 32) & (size - 1);
+                slots[i].handle;
+                i = (i + 1) & (size - 1))
+            {
+            }
+            slots[i] = tag_slots[j];
+        }
+    }
+    free(tag_slots);
+    tag_slots = slots;
+    tag_slots_mask = size - 1;
+    return 0;
+}
+
+void tag_slots_free(void)
+{
+    uint64_t i;
+
+    for(i = 0; tag_slots && i <= tag_slots_mask; i++)
+    {
+        while(tag_slots[i].waiters)
+        {
+            struct tag_wait_s *wait = tag_slots[i].waiters;
+
+            tag_slots[i].waiters = wait->next;
+            free(wait);
+        }
+    }
+    free(tag_slots);
+    tag_slots = NULL;
+    tag_slots_mask = 0;
+    tag_slots_count = 0;
+}
+
+/* Looks up the tags of the chain of the directory dir at handle: the above_count directories above
+ * it from the top down, then dir itself, chain index i being entry index -1 - (above_count - i) for
+ * tag_handle. claimed[i] is set for those fetched by no one yet, which the caller must fetch and
+ * pass to tag_publish; the others are known or being fetched for another directory. Returns
+ * TAG_EXEMPT, claiming none, if one of them is known to be tagged or the table could not grow, and
+ * TAG_UNKNOWN otherwise. */
+tag_type tag_claim(const PVFS_handle *above,
+                   int above_count,
+                   PVFS_handle handle,
+                   const char *dir,
+                   char *claimed)
+{
+    struct tag_slot_s *slot;
+    int i;
+
+    pthread_mutex_lock(&tag_lock);
+    for(i = 0; i <= above_count; i++)
+    {
+        slot = tag_slot(i < above_count ? above[i] : handle, 0);
+        if(slot && slot->tag == TAG_EXEMPT)
+        {
+            pthread_mutex_unlock(&tag_lock);
+            return TAG_EXEMPT;
+        }
+    }
+
+    if(tag_slots_reserve(above_count + 1) != 0)
+    {
+        pthread_mutex_unlock(&tag_lock);
+        fprintf(stderr, "%s: WARNING: exempting path = %s\n", __func__, dir);
+        return TAG_EXEMPT;
+    }
+    for(i = 0; i <= above_count; i++)
+    {
+        uint64_t count = tag_slots_count;
+
+        tag_slot(i < above_count ? above[i] : handle, 1);
+        claimed[i] = tag_slots_count != count;
+    }
+    pthread_mutex_unlock(&tag_lock);
+
+    return TAG_UNKNOWN;
+}
+
+/* Records the tag fetched for handle, claimed with tag_claim, waking up the walker threads waiting
+ * for it. Returns the event loop directories waiting for it, see tag_wait_add. */
+struct tag_wait_s *tag_publish(PVFS_handle handle, int exempts)
+{
+    struct tag_wait_s *waiters = NULL;
+    struct tag_slot_s *slot;
+
+    pthread_mutex_lock(&tag_lock);
+    slot = tag_slot(handle, 0);
+    if(slot)
+    {
+        slot->tag = exempts ? TAG_EXEMPT : TAG_NONE;
+        waiters = slot->waiters;
+        slot->waiters = NULL;
+    }
+    pthread_cond_broadcast(&tag_cond);
+    pthread_mutex_unlock(&tag_lock);
+
+    return waiters;
+}
+
+/* Adds the event loop directory dir to those waiting for the tag of handle, claimed by another
+ * directory. Returns 1 if dir has to wait for it, 0 if it is known already, or -1 if dir could not
+ * be added. */
+int tag_wait_add(PVFS_handle handle, struct ev_dir_s *dir)
+{
+    struct tag_slot_s *slot;
+    struct tag_wait_s *wait;
+
+    pthread_mutex_lock(&tag_lock);
+    slot = tag_slot(handle, 0);
+    if(!slot || slot->tag != TAG_UNKNOWN)
+    {
+        pthread_mutex_unlock(&tag_lock);
+        return 0;
+    }
+    wait = (struct tag_wait_s *) malloc(sizeof(struct tag_wait_s));
+    if(!wait)
+    {
+        pthread_mutex_unlock(&tag_lock);
+        return -1;
+    }
+    wait->dir = dir;
+    wait->next = slot->waiters;
+    slot->waiters = wait;
+    pthread_mutex_unlock(&tag_lock);
+
+    return 1;
+}
+
+/* Returns the tag of the directory at handle once its chain (see tag_claim) has been fetched:
+ * TAG_EXEMPT if one of its directories is tagged, TAG_NONE otherwise. With wait set, waits for the
+ * tags other walker threads are still fetching. The event loop rather waits with tag_wait_add, a
+ * tag still unknown then exempts. */
+tag_type tag_settle(const PVFS_handle *above, int above_count, PVFS_handle handle, int wait)
+{
+    tag_type tag = TAG_NONE;
+    int i;
+
+    pthread_mutex_lock(&tag_lock);
+    for(i = 0; i <= above_count && tag == TAG_NONE; i++)
+    {
+        PVFS_handle h = i < above_count ? above[i] : handle;
+        struct tag_slot_s *slot = tag_slot(h, 0);
+
+        while(wait && slot && slot->tag == TAG_UNKNOWN)
+        {
+            pthread_cond_wait(&tag_cond, &tag_lock);
+            slot = tag_slot(h, 0);
+        }
+        if(!slot || slot->tag != TAG_NONE)
+        {
+            tag = TAG_EXEMPT;
+        }
+    }
+    pthread_mutex_unlock(&tag_lock);
+
+    return tag;
+}
+
+/* Lists in indexes the files of a batch of dir that would be removed, which need --exempt-xattr
+ * fetched, as does the chain of dir (see tag_claim) while its tag is unknown. Nothing is needed
+ * under a tagged directory nor for files the marker already exempts, so that a batch with nothing
+ * to remove costs no fetch. Returns the number of indexes. */
+int tag_wanted(PVFS_sysresp_readdirplus *rdplus_responsep,
+               PVFS_time basis,
+               const char *dir,
+               exempt_type exempt,
+               tag_type tag,
+               int *indexes)
+{
+    int count = 0;
+    int i;
+
+    if(!opts.exempt_xattr || tag == TAG_EXEMPT || exempt >= EXEMPT_MARKED)
+    {
+        return 0;
+    }
+
+    for(i = 0; i < rdplus_responsep->pvfs_dirent_outcount &&
+               i < PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS; i++)
+    {
+        PVFS_sys_attr *attrp = &rdplus_responsep->attr_array[i];
+        uint32_t rule = 0;
+
+        if(attrp->objtype != PVFS_TYPE_DIRECTORY &&
+           classify_dirent(attrp,
+                           basis,
+                           dir,
+                           rdplus_responsep->dirent_array[i].d_name,
+                           &rule) == DIRENT_REMOVE)
+        {
+            indexes[count++] = i;
+        }
+    }
+
+    return count;
+}
+
+/* A fetch of --exempt-xattr by fetch_batch_tags, index being that of tag_handle. */
+struct tag_fetch_s
+{
+    int index;
+    PVFS_sys_op_id op_id;
+    PVFS_sysresp_geteattr response;
+    PVFS_ds_keyval val;
+    PVFS_error err;
+    char value[TAG_VALUE_MAX];
+};
+
+/* Fetches --exempt-xattr for the files of a batch of the directory at dir_ref listed by tag_wanted,
+ * marking the exempt files in tagged. When *tagp is unknown, it is settled as well, fetching the
+ * tags of the chain of the directory, its above_count directories above and itself, that no walker
+ * has fetched yet (see tag_claim). All of the lookups are issued with the nonblocking
+ * PVFS_isys_geteattr_list before waiting for any of them. */
+void fetch_batch_tags(PVFS_sysresp_readdirplus *rdplus_responsep,
+                      PVFS_object_ref dir_ref,
+                      PVFS_time basis,
+                      const char *dir,
+                      exempt_type exempt,
+                      const PVFS_handle *above,
+                      int above_count,
+                      tag_type *tagp,
+                      char *tagged)
+{
+    int indexes[PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS];
+    struct tag_fetch_s *fetches = NULL;
+    char *claimed = NULL;
+    PVFS_ds_keyval key;
+    PVFS_object_ref ref;
+    int wanted;
+    int count = 0;
+    int ret;
+    int i;
+
+    memset(tagged, 0, PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS);
+    wanted = tag_wanted(rdplus_responsep, basis, dir, exempt, *tagp, indexes);
+    if(wanted == 0)
+    {
+        return;
+    }
+
+    fetches = (struct tag_fetch_s *) malloc((wanted + above_count + 1) *
+                                            sizeof(struct tag_fetch_s));
+    claimed = (char *) malloc(above_count + 1);
+    if(!fetches || !claimed)
+    {
+        fprintf(stderr, "%s: WARNING: could not allocate the fetches, exempting path = %s\n",
+                __func__,
+                dir);
+        for(i = 0; i < wanted; i++)
+        {
+            tagged[indexes[i]] = 1;
+        }
+        goto cleanup;
+    }
+
+    if(*tagp == TAG_UNKNOWN)
+    {
+        *tagp = tag_claim(above, above_count, dir_ref.handle, dir, claimed);
+        if(*tagp == TAG_EXEMPT)
+        {
+            goto cleanup;
+        }
+        for(i = 0; i <= above_count; i++)
+        {
+            if(claimed[i])
+            {
+                fetches[count++].index = -1 - (above_count - i);
+            }
+        }
+    }
+    for(i = 0; i < wanted; i++)
+    {
+        fetches[count++].index = indexes[i];
+    }
+
+    key.buffer = opts.exempt_xattr;
+    key.buffer_sz = strlen(opts.exempt_xattr) + 1;
+    ref.fs_id = dir_ref.fs_id;
+
+    wanted = count;
+    count = 0;
+    for(i = 0; i < wanted; i++)
+    {
+        struct tag_fetch_s *fp = &fetches[count];
+
+        fp->index = fetches[i].index;
+        ref.handle = tag_handle(rdplus_responsep, dir_ref.handle, above, above_count, fp->index);
+        fp->val.buffer = fp->value;
+        fp->val.buffer_sz = TAG_VALUE_MAX;
+        fp->val.read_sz = 0;
+        fp->err = 0;
+        fp->response.val_array = &fp->val;
+        fp->response.err_array = &fp->err;
+        rate_limit_wait();
+        ret = PVFS_isys_geteattr_list(ref,
+                                      &creds,
+                                      1,
+                                      &key,
+                                      &fp->response,
+                                      &fp->op_id,
+                                      NULL,
+                                      NULL);
+        if(ret < 0)
+        {
+            PVFS_perror("PVFS_isys_geteattr_list", ret);
+            tag_warn(dir, rdplus_responsep, fp->index);
+            if(fp->index < 0)
+            {
+                tag_publish(ref.handle, 1);
+            }
+            else
+            {
+                tagged[fp->index] = 1;
+            }
+            continue;
+        }
+        count++;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        struct tag_fetch_s *fp = &fetches[i];
+        int op_ret = 0;
+        int exempts;
+
+        ret = PVFS_sys_wait(fp->op_id, "geteattr", &op_ret);
+        if(ret >= 0)
+        {
+            ret = op_ret < 0 ? op_ret : fp->err;
+        }
+        exempts = tag_exempts(ret, &fp->val);
+        if(ret < 0 && exempts)
+        {
+            tag_warn(dir, rdplus_responsep, fp->index);
+        }
+
+        if(fp->index < 0)
+        {
+            tag_publish(tag_handle(rdplus_responsep, dir_ref.handle, above, above_count, fp->index),
+                        exempts);
+        }
+        else
+        {
+            tagged[fp->index] = exempts;
+        }
+    }
+
+    if(*tagp == TAG_UNKNOWN)
+    {
+        *tagp = tag_settle(above, above_count, dir_ref.handle, 1);
+    }
+
+cleanup:
+    free(fetches);
+    free(claimed);
+}
+
+/* Frees the arrays allocated by the OrangeFS library for a readdirplus response. */
+void release_rdplus_response(PVFS_sysresp_readdirplus *rdplus_responsep)
+{
+    /* TODO Why must I do this pointer arithmetic below?!
+     * Is there a problem with PINT_MALLOC?
+     * Why can't I just free! */
+#if USING_PINT_MALLOC == 1
+    /* TODO This was required prior to OrangeFS 2.9.5or6? */
+    free((char *) (rdplus_responsep->dirent_array) - 32);
+    free((char *) (rdplus_responsep->stat_err_array) - 32);
+    free((char *) (rdplus_responsep->attr_array) - 32);
+#else
+    /* This seems to work in version OrangeFS 2.9.6 */
+    free(rdplus_responsep->dirent_array);
+    free(rdplus_responsep->stat_err_array);
+    free(rdplus_responsep->attr_array);
+#endif
+}
+
+void walk_done(struct walker_s *w, struct root_s *root, int failed);
+
+/* Accounts for the removals of the walker's window that have completed. Waits until at least one
+ * has completed or, when all is set, until the window is empty. */
+void remove_window_wait(struct walker_s *w, int all)
+{
+    int completed = 0;
+
+    while(w->rm_count > 0 && (all || completed == 0))
+    {
+        int count = w->rm_count;
+        int ret;
+        int i;
+
+        for(i = 0; i < count; i++)
+        {
+            w->rm_op_ids[i] = w->rm_window[i]->op_id;
+        }
+
+        ret = PVFS_sys_testsome(w->rm_op_ids, &count, w->rm_user_ptrs, w->rm_error_codes, 100);
+        if(ret < 0)
+        {
+            /* Fall back on waiting for the oldest removal. */
+            PVFS_perror("PVFS_sys_testsome", ret);
+            count = 1;
+            w->rm_op_ids[0] = w->rm_window[0]->op_id;
+            w->rm_user_ptrs[0] = w->rm_window[0];
+            if(PVFS_sys_wait(w->rm_op_ids[0], "remove", &w->rm_error_codes[0]) < 0)
+            {
+                w->rm_error_codes[0] = -1;
+            }
+        }
+        else
+        {
+            for(i = 0; i < count; i++)
+            {
+                PVFS_sys_release(w->rm_op_ids[i]);
+            }
+        }
+
+        for(i = 0; i < count; i++)
+        {
+            struct remove_op_s *op = (struct remove_op_s *) w->rm_user_ptrs[i];
+            struct root_s *root = op->root;
+            int j;
+
+            account_removal(&w->stats[root->slot],
+                            w->owners ? &w->owners[root->slot] : NULL,
+                            op->owner,
+                            op->group,
+                            op->path,
+                            op->size,
+                            w->rm_error_codes[i]);
+
+            for(j = 0; j < w->rm_count; j++)
+            {
+                if(w->rm_window[j] == op)
+                {
+                    w->rm_window[j] = w->rm_window[--w->rm_count];
+                    break;
+                }
+            }
+            free(op);
+            completed++;
+            walk_done(w, root, 0);
+        }
+    }
+}
+
+/* Removes the expired file at path, whose entry name starts at path + name_offset, from the
+ * directory *dir_refp with the nonblocking PVFS_isys_remove. At most opts.remove_window removals
+ * are in flight per walker; when the window is full this waits for one of them to complete. The
+ * outcome is accounted for with account_removal exactly as for a blocking removal. */
+void remove_async(struct walker_s *w,
+                  PVFS_object_ref *dir_refp,
+                  char *path,
+                  size_t name_offset,
+                  PVFS_size size,
+                  PVFS_uid owner,
+                  PVFS_gid group)
+{
+    struct owner_table_s *ot = w->owners ? &w->owners[w->root->slot] : NULL;
+    size_t path_len = strlen(path);
+    struct remove_op_s *op;
+    int ret;
+
+    if(w->rm_count == opts.remove_window)
+    {
+        remove_window_wait(w, 0);
+    }
+
+    /* PVFS_isys_remove keeps a pointer to the entry name until the removal completes. */
+    op = (struct remove_op_s *) malloc(sizeof(struct remove_op_s) + path_len + 1);
+    if(!op)
+    {
+        fprintf(stderr, "%s: WARNING: could not allocate removal of path = %s\n", __func__, path);
+        account_removal(&w->stats[w->root->slot], ot, owner, group, path, size, -1);
+        return;
+    }
+    memcpy(op->path, path, path_len + 1);
+    op->root = w->root;
+    op->size = size;
+    op->owner = owner;
+    op->group = group;
+
+    rate_limit_wait();
+    ret = PVFS_isys_remove(&op->path[name_offset], *dir_refp, &creds, &op->op_id, NULL, op);
+    if(ret < 0)
+    {
+        account_removal(&w->stats[w->root->slot], ot, owner, group, path, size, ret);
+        free(op);
+        return;
+    }
+
+    /* The root is not finished until its removals have completed, see walk_done. */
+    __sync_add_and_fetch(&op->root->pending, 1);
+    __sync_add_and_fetch(&walk_pending, 1);
+    w->rm_window[w->rm_count++] = op;
+}
+
+int walk_push(struct walker_s *w,
+              char *path,
+              PVFS_object_ref *dir_refp,
+              PVFS_ds_position token,
+              PVFS_time mtime,
+              struct index_dir_s *idx);
+int walk_enqueue(struct walker_s *w, struct walk_item_s *itemp);
+int root_suspended(struct root_s *root);
+void walk_deque_sink(struct walk_deque_s *dq, size_t depth);
+void walk_deque_order(struct walk_deque_s *dq, size_t n);
+void walk_account_bytes(int64_t bytes);
+int walk_over_budget(void);
+int checkpoint_wanted(void);
+void purge_stats_add(struct purge_stats_s *dst, struct purge_stats_s *src);
+void owner_table_merge(struct owner_table_s *dst, struct owner_table_s *src);
+
+/* An --index file is a struct index_header_s followed by one struct index_rec_s per directory, each
+ * followed by children_len bytes of subdirectory entries: the handle (8 bytes), the name length (2
+ * bytes) and the name, not null terminated. */
+struct index_header_s
+{
+    char magic[8];
+    uint64_t fs_id;
+    uint64_t root_handle;   /* Of the directory being purged. */
+};
+
+struct index_rec_s
+{
+    uint64_t handle;
+    int64_t mtime;          /* Of the directory, before it was listed. */
+    int64_t min_use;        /* Oldest max(atime, mtime) of the directory's files, INT64_MAX if none. */
+    uint64_t kept_bytes;
+    uint64_t kept_fils;
+    uint64_t sampled_bytes;
+    uint64_t sampled_fils;
+    uint64_t lnks;
+    uint64_t unknown;
+    uint64_t nchildren;
+    uint64_t children_len;
+};
+
+#define INDEX_CHILD_HEADER (sizeof(uint64_t) + sizeof(uint16_t))
+
+/* The record of a directory being listed. Its memory is accounted for as queued memory. */
+struct index_dir_s
+{
+    struct index_rec_s rec;
+    char *children;
+    size_t children_size;
+};
+
+uint64_t index_hash(uint64_t handle)
+{
+    uint64_t x = handle * 0x9E3779B97F4A7C15ULL;
+
+    return x ^ (x >> 32);
+}
+
+/* Maps the index written by the previous run, if any, and hashes the offsets of its records. An
+ * index that is unreadable, truncated or of another directory is ignored with a warning, so that
+ * every directory gets listed. Returns -1 only if memory could not be allocated. */
+int index_load(const char *path, PVFS_fs_id fs_id, PVFS_handle root_handle)
+{
+    struct index_header_s header;
+    struct index_rec_s rec;
+    struct stat index_stat;
+    uint64_t count = 0LL;
+    uint64_t slots = 16;
+    size_t off;
+    int pass;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        /* First run with this index. */
+        return 0;
+    }
+
+    if(fstat(fd, &index_stat) != 0 || (size_t) index_stat.st_size < sizeof(header))
+    {
+        fprintf(stderr, "%s: WARNING: ignoring unreadable index = %s\n", __func__, path);
+        close(fd);
+        return 0;
+    }
+
+    index_map = mmap(NULL, index_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(index_map == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: WARNING: ignoring unreadable index = %s\n", __func__, path);
+        index_map = NULL;
+        return 0;
+    }
+    index_map_size = index_stat.st_size;
+
+    memcpy(&header, index_map, sizeof(header));
+    if(memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+       header.fs_id != (uint64_t) fs_id ||
+       header.root_handle != root_handle)
+    {
+        fprintf(stderr, "%s: WARNING: ignoring index of another directory = %s\n", __func__, path);
+        goto ignore;
+    }
+
+    /* Validate and count the records first, then hash them. */
+    for(pass = 0; pass < 2; pass++)
+    {
+        off = sizeof(header);
+        while(off < index_map_size)
+        {
+            size_t child_off;
+            uint64_t i;
+
+            if(index_map_size - off < sizeof(rec))
+            {
+                goto truncated;
+            }
+            memcpy(&rec, &index_map[off], sizeof(rec));
+            if(rec.children_len > index_map_size - off - sizeof(rec))
+            {
+                goto truncated;
+            }
+
+            if(pass == 0)
+            {
+                child_off = 0;
+                for(i = 0; i < rec.nchildren; i++)
+                {
+                    uint16_t name_len;
+
+                    if(rec.children_len - child_off < INDEX_CHILD_HEADER)
+                    {
+                        goto truncated;
+                    }
+                    memcpy(&name_len, &index_map[off + sizeof(rec) + child_off + sizeof(uint64_t)],
+                           sizeof(name_len));
+                    child_off += INDEX_CHILD_HEADER;
+                    if(rec.children_len - child_off < name_len)
+                    {
+                        goto truncated;
+                    }
+                    child_off += name_len;
+                }
+                count++;
+            }
+            else
+            {
+                uint64_t slot = index_hash(rec.handle) & index_slots_mask;
+
+                while(index_slots[slot] != 0)
+                {
+                    slot = (slot + 1) & index_slots_mask;
+                }
+                index_slots[slot] = off + 1;
+            }
+
+            off += sizeof(rec) + rec.children_len;
+        }
+
+        if(pass == 0)
+        {
+            while(slots < 2 * count)
+            {
+                slots *= 2;
+            }
+            index_slots = (uint64_t *) calloc(slots, sizeof(uint64_t));
+            if(!index_slots)
+            {
+                fprintf(stderr,
+                        "%s: ERROR: could not allocate the index of %llu directories\n",
+                        __func__,
+                        LLU(count));
+                munmap(index_map, index_map_size);
+                index_map = NULL;
+                return -1;
+            }
+            index_slots_mask = slots - 1;
+        }
+    }
+
+    DEBUG("INFO: loaded the index of %llu directories\n", LLU(count));
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: WARNING: ignoring truncated index = %s\n", __func__, path);
+ignore:
+    munmap(index_map, index_map_size);
+    index_map = NULL;
+    return 0;
+}
+
+/* Returns the record of a directory in the index of the previous run, or NULL. */
+const char *index_find(PVFS_handle handle)
+{
+    uint64_t slot;
+
+    if(!index_slots)
+    {
+        return NULL;
+    }
+
+    for(slot = index_hash(handle) & index_slots_mask;
+        index_slots[slot] != 0;
+        slot = (slot + 1) & index_slots_mask)
+    {
+        const char *recp = &index_map[index_slots[slot] - 1];
+        uint64_t rec_handle;
+
+        memcpy(&rec_handle, recp, sizeof(rec_handle));
+        if(rec_handle == handle)
+        {
+            return recp;
+        }
+    }
+
+    return NULL;
+}
+
+/* Appends a directory record and its children to the new index. A failed write only keeps the new
+ * index from replacing the previous one. */
+void index_write(const void *recp, const void *children, size_t children_len)
+{
+    pthread_mutex_lock(&index_lock);
+    if(fwrite(recp, sizeof(struct index_rec_s), 1, index_out) != 1 ||
+       (children_len > 0 && fwrite(children, children_len, 1, index_out) != 1))
+    {
+        index_failed = 1;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+struct index_dir_s *index_dir_new(PVFS_handle handle, PVFS_time mtime)
+{
+    struct index_dir_s *idx = (struct index_dir_s *) calloc(1, sizeof(struct index_dir_s));
+
+    if(!idx)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate an index record\n", __func__);
+        return NULL;
+    }
+    idx->rec.handle = handle;
+    idx->rec.mtime = mtime;
+    idx->rec.min_use = INT64_MAX;
+    walk_account_bytes(sizeof(struct index_dir_s));
+
+    return idx;
+}
+
+void index_dir_free(struct index_dir_s *idx)
+{
+    if(!idx)
+    {
+        return;
+    }
+    walk_account_bytes(-(int64_t) (sizeof(struct index_dir_s) + idx->children_size));
+    free(idx->children);
+    free(idx);
+}
+
+/* Writes the record of a directory whose listing is complete, then frees it. */
+void index_dir_finish(struct index_dir_s *idx)
+{
+    index_write(&idx->rec, idx->children, idx->rec.children_len);
+    index_dir_free(idx);
+}
+
+int index_dir_add_child(struct index_dir_s *idx, PVFS_handle handle, const char *name)
+{
+    uint16_t name_len = (uint16_t) strlen(name);
+    size_t needed = idx->rec.children_len + INDEX_CHILD_HEADER + name_len;
+    uint64_t child_handle = handle;
+
+    if(needed > idx->children_size)
+    {
+        size_t new_size = idx->children_size ? idx->children_size * 2 : 1024;
+        char *children;
+
+        while(new_size < needed)
+        {
+            new_size *= 2;
+        }
+        children = (char *) realloc(idx->children, new_size);
+        if(!children)
+        {
+            fprintf(stderr, "%s: ERROR: could not grow an index record\n", __func__);
+            return -1;
+        }
+        walk_account_bytes(new_size - idx->children_size);
+        idx->children = children;
+        idx->children_size = new_size;
+    }
+
+    memcpy(&idx->children[idx->rec.children_len], &child_handle, sizeof(child_handle));
+    memcpy(&idx->children[idx->rec.children_len + sizeof(child_handle)], &name_len, sizeof(name_len));
+    memcpy(&idx->children[idx->rec.children_len + INDEX_CHILD_HEADER], name, name_len);
+    idx->rec.children_len = needed;
+    idx->rec.nchildren++;
+
+    return 0;
+}
+
+/* Expired files count as well: the directory must be listed again if one failed to be removed or
+ * this is a dry-run, and removing one changes the directory's mtime anyway. */
+void index_dir_note_file(struct index_dir_s *idx, PVFS_sys_attr *attrp)
+{
+    PVFS_time last_use = attrp->atime > attrp->mtime ? attrp->atime : attrp->mtime;
+
+    if(last_use < idx->rec.min_use)
+    {
+        idx->rec.min_use = last_use;
+    }
+}
+
+/* Adds what a batch of the directory added to the walker's kept file counters. */
+void index_dir_add_stats(struct index_dir_s *idx,
+                         struct purge_stats_s *beforep,
+                         struct purge_stats_s *afterp)
+{
+    idx->rec.kept_bytes += afterp->kept_bytes - beforep->kept_bytes;
+    idx->rec.kept_fils += afterp->kept_fils - beforep->kept_fils;
+    idx->rec.sampled_bytes += afterp->sampled_bytes - beforep->sampled_bytes;
+    idx->rec.sampled_fils += afterp->sampled_fils - beforep->sampled_fils;
+    idx->rec.lnks += afterp->lnks - beforep->lnks;
+    idx->rec.unknown += afterp->unknown - beforep->unknown;
+}
+
+/* Decides whether the directory of a walk item may be skipped thanks to the index of the previous
+ * run. If so, its counters are taken from the index, its subdirectories are queued, its record is
+ * copied to the new index and 1 is returned. Returns 0 if it must be listed, and -1 on error.
+ * itemp->mtime is fetched with a getattr if the parent's listing did not provide it. */
+int index_try_skip(struct walker_s *w, struct walk_item_s *itemp)
+{
+    PVFS_sysresp_getattr getattr_response;
+    PVFS_object_ref child_ref;
+    struct index_rec_s rec;
+    const char *recp = NULL;
+    const char *childp = NULL;
+    char *dirent_path = w->dirent_path;
+    struct purge_stats_s *psp = &w->stats[itemp->root->slot];
+    size_t dir_len = strlen(itemp->path);
+    uint64_t i;
+    int ret;
+
+    if(itemp->mtime == INDEX_MTIME_UNKNOWN)
+    {
+        memset(&getattr_response, 0, sizeof(getattr_response));
+        rate_limit_wait();
+        ret = PVFS_sys_getattr(itemp->ref,
+                               PVFS_ATTR_SYS_COMMON_ALL,
+                               &creds,
+                               &getattr_response,
+                               NULL);
+        if(ret < 0)
+        {
+            fprintf(stderr,
+                    "%s: ERROR: PVFS_sys_getattr failed with ret= %d, path = %s\n",
+                    __func__,
+                    ret,
+                    itemp->path);
+            return -1;
+        }
+        itemp->mtime = getattr_response.attr.mtime;
+        PVFS_util_release_sys_attr(&getattr_response.attr);
+    }
+
+    if(opts.full || !(recp = index_find(itemp->ref.handle)))
+    {
+        return 0;
+    }
+
+    memcpy(&rec, recp, sizeof(rec));
+    if(rec.mtime != itemp->mtime || rec.min_use < itemp->basis)
+    {
+        return 0;
+    }
+
+    DEBUG("INFO: skipping unchanged path = %s\n", itemp->path);
+
+    psp->kept_bytes += rec.kept_bytes;
+    psp->kept_fils += rec.kept_fils;
+    psp->sampled_bytes += rec.sampled_bytes;
+    psp->sampled_fils += rec.sampled_fils;
+    psp->lnks += rec.lnks;
+    psp->unknown += rec.unknown;
+    psp->dirs += rec.nchildren;
+
+    memcpy(dirent_path, itemp->path, dir_len);
+    dirent_path[dir_len] = '/';
+    child_ref.fs_id = itemp->ref.fs_id;
+    childp = recp + sizeof(rec);
+    for(i = 0; i < rec.nchildren; i++)
+    {
+        uint64_t child_handle;
+        uint16_t name_len;
+
+        memcpy(&child_handle, childp, sizeof(child_handle));
+        memcpy(&name_len, childp + sizeof(child_handle), sizeof(name_len));
+        childp += INDEX_CHILD_HEADER;
+        if(dir_len + 1 + name_len >= PVFS_PATH_MAX)
+        {
+            fprintf(stderr,
+                    "%s: ERROR: path too long, path = %s/%.*s\n",
+                    __func__,
+                    itemp->path,
+                    (int) name_len,
+                    childp);
+            return -1;
+        }
+        memcpy(&dirent_path[dir_len + 1], childp, name_len);
+        dirent_path[dir_len + 1 + name_len] = 0;
+        childp += name_len;
+
+        child_ref.handle = child_handle;
+        if(walk_push(w, dirent_path, &child_ref, PVFS_READDIR_START, INDEX_MTIME_UNKNOWN, NULL) != 0)
+        {
+            return -1;
+        }
+    }
+
+    index_write(recp, recp + sizeof(rec), rec.children_len);
+    __sync_add_and_fetch(&index_skipped, 1);
+
+    return 1;
+}
+
+/* Scans one directory of an OrangeFS directory tree using the PVFS_sys_readdirplus function which
+ * is the most efficient way to gather stats from multiple entries at once when using OrangeFS.
+ *
+ * The directory tree used to be walked recursively, holding every ancestor's readdirplus arrays and
+ * path buffer while descending. Subdirectories are now queued on the walker's deque instead, and
+ * the arrays of a batch are freed before any of its subdirectories is scanned. Scanning starts at
+ * itemp->token, which is PVFS_READDIR_START unless the scan of a directory was interrupted because
+ * the memory budget was exceeded (see walk_over_budget).
+ *
+ * With --index, a directory is only listed if index_try_skip says so, and its record is built along
+ * the way in itemp->idx, which is handed to the item resuming an interrupted scan.
+ */
+/* A --cost-table file is a struct cost_header_s followed by one struct cost_rec_s per directory at
+ * most COST_TABLE_DEPTH levels below its root. */
+struct cost_header_s
+{
+    char magic[8];
+    uint64_t fs_id;
+};
+
+/* Returns the record of a directory in the cost table of the previous run, or NULL. */
+struct cost_rec_s *cost_find(PVFS_handle handle)
+{
+    uint64_t slot;
+
+    if(!cost_slots)
+    {
+        return NULL;
+    }
+
+    for(slot = index_hash(handle) & cost_slots_mask;
+        cost_slots[slot] != 0;
+        slot = (slot + 1) & cost_slots_mask)
+    {
+        if(cost_prev[cost_slots[slot] - 1].handle == handle)
+        {
+            return &cost_prev[cost_slots[slot] - 1];
+        }
+    }
+
+    return NULL;
+}
+
+/* Reads the cost table written by the previous run, if any, and turns the entries of each record
+ * into those of the directory's whole subtree. A table that is unreadable, truncated or of another
+ * file system is ignored with a warning. Returns -1 only if memory could not be allocated. */
+int cost_load(const char *path, PVFS_fs_id fs_id)
+{
+    struct cost_header_s header;
+    struct stat cost_stat;
+    uint64_t *own = NULL;
+    uint64_t slots = 16;
+    uint64_t count;
+    uint64_t i;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if(!fp)
+    {
+        /* First run with this table. */
+        return 0;
+    }
+
+    if(fstat(fileno(fp), &cost_stat) != 0 || (size_t) cost_stat.st_size < sizeof(header) ||
+       fread(&header, sizeof(header), 1, fp) != 1 ||
+       memcmp(header.magic, COST_TABLE_MAGIC, sizeof(header.magic)) != 0 ||
+       header.fs_id != (uint64_t) fs_id ||
+       (cost_stat.st_size - sizeof(header)) % sizeof(struct cost_rec_s) != 0)
+    {
+        fprintf(stderr, "%s: WARNING: ignoring unusable cost table = %s\n", __func__, path);
+        fclose(fp);
+        return 0;
+    }
+    count = (cost_stat.st_size - sizeof(header)) / sizeof(struct cost_rec_s);
+
+    while(slots < 2 * count)
+    {
+        slots *= 2;
+    }
+    cost_prev = (struct cost_rec_s *) malloc((count ? count : 1) * sizeof(struct cost_rec_s));
+    own = (uint64_t *) malloc((count ? count : 1) * sizeof(uint64_t));
+    cost_slots = (uint64_t *) calloc(slots, sizeof(uint64_t));
+    if(!cost_prev || !own || !cost_slots)
+    {
+        fprintf(stderr,
+                "%s: ERROR: could not allocate the cost table of %llu directories\n",
+                __func__,
+                LLU(count));
+        fclose(fp);
+        free(own);
+        return -1;
+    }
+    cost_slots_mask = slots - 1;
+
+    if(count > 0 && fread(cost_prev, sizeof(struct cost_rec_s), count, fp) != count)
+    {
+        fprintf(stderr, "%s: WARNING: ignoring truncated cost table = %s\n", __func__, path);
+        fclose(fp);
+        free(own);
+        free(cost_slots);
+        cost_slots = NULL;
+        return 0;
+    }
+    fclose(fp);
+    cost_prev_count = count;
+
+    for(i = 0; i < count; i++)
+    {
+        uint64_t slot = index_hash(cost_prev[i].handle) & cost_slots_mask;
+
+        while(cost_slots[slot] != 0)
+        {
+            slot = (slot + 1) & cost_slots_mask;
+        }
+        cost_slots[slot] = i + 1;
+        own[i] = cost_prev[i].entries;
+    }
+
+    /* Add the entries of every directory to those of its ancestors. */
+    for(i = 0; i < count; i++)
+    {
+        struct cost_rec_s *recp = &cost_prev[i];
+        int depth;
+
+        for(depth = 0; depth < COST_TABLE_DEPTH && recp->parent != 0; depth++)
+        {
+            recp = cost_find(recp->parent);
+            if(!recp)
+            {
+                break;
+            }
+            recp->entries += own[i];
+        }
+    }
+    free(own);
+
+    DEBUG("INFO: loaded the cost table of %llu directories\n", LLU(count));
+    return 0;
+}
+
+/* Writes the cost table of this run next to path and renames it over path. */
+int cost_write(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    struct cost_header_s header;
+    uint64_t i;
+    FILE *fp;
+    int ret = 0;
+
+    snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+    fp = fopen(tmp_path, "w");
+    if(!fp)
+    {
+        perror("ERROR: Could not create the cost table, reason= ");
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COST_TABLE_MAGIC, sizeof(header.magic));
+    header.fs_id = cost_recs_count > 0 ? (uint64_t) roots[0].ref.fs_id : 0;
+    if(fwrite(&header, sizeof(header), 1, fp) != 1)
+    {
+        ret = -1;
+    }
+    for(i = 0; ret == 0 && i < cost_recs_count; i++)
+    {
+        if(fwrite(cost_recs[i], sizeof(struct cost_rec_s), 1, fp) != 1)
+        {
+            ret = -1;
+        }
+    }
+
+    if(fclose(fp) != 0 || ret != 0 || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr,
+                "%s: WARNING: the cost table was not updated, cost table = %s\n",
+                __func__,
+                path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+void cost_free(void)
+{
+    uint64_t i;
+
+    for(i = 0; i < cost_recs_count; i++)
+    {
+        free(cost_recs[i]);
+    }
+    free(cost_recs);
+    free(cost_prev);
+    free(cost_slots);
+}
+
+/* Sets the depth, cost record and previous cost of an item queued by w. The rest of a directory
+ * keeps those of the directory. A subdirectory of the directory w is scanning, or a root when it
+ * is scanning none, gets a record of its own with --cost-table unless it is too deep, in which case
+ * its entries are counted in the record of its parent. */
+int cost_item_init(struct walker_s *w, struct walk_item_s *itemp, PVFS_ds_position token)
+{
+    struct cost_rec_s *recp;
+
+    itemp->depth = token == PVFS_READDIR_START ? w->depth + 1 : w->depth;
+    itemp->cost = w->cost;
+    itemp->prev_cost = 0;
+
+    if(itemp->depth > COST_TABLE_DEPTH)
+    {
+        return 0;
+    }
+
+    recp = cost_find(itemp->ref.handle);
+    if(recp)
+    {
+        itemp->prev_cost = recp->entries;
+    }
+
+    if(!opts.cost_table_path || token != PVFS_READDIR_START)
+    {
+        return 0;
+    }
+
+    recp = (struct cost_rec_s *) calloc(1, sizeof(struct cost_rec_s));
+    if(!recp)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate a cost record\n", __func__);
+        return -1;
+    }
+    recp->handle = itemp->ref.handle;
+    recp->parent = w->cost ? w->cost->handle : 0;
+
+    pthread_mutex_lock(&cost_lock);
+    if(cost_recs_count == cost_recs_size)
+    {
+        uint64_t new_size = cost_recs_size ? cost_recs_size * 2 : 64;
+        struct cost_rec_s **grown = realloc(cost_recs, new_size * sizeof(struct cost_rec_s *));
+
+        if(!grown)
+        {
+            pthread_mutex_unlock(&cost_lock);
+            fprintf(stderr, "%s: ERROR: could not grow the cost table\n", __func__);
+            free(recp);
+            return -1;
+        }
+        cost_recs = grown;
+        cost_recs_size = new_size;
+    }
+    cost_recs[cost_recs_count++] = recp;
+    pthread_mutex_unlock(&cost_lock);
+
+    itemp->cost = recp;
+    return 0;
+}
+
+/* Reads the duration and entry counts of the roots from their logs in dir, the --log-dir of the
+ * previous run, keeping those of the latest log of each root. The .summary file of a log is read
+ * rather than the log itself, whose lines other than the summary are skipped when older runs left
+ * no .summary file. */
+int cost_logs_load(const char *dir)
+{
+    struct dirent **entries = NULL;
+    char log_path[PATH_MAX];
+    char *line = NULL;
+    size_t line_size = 0;
+    int entries_count;
+    int i;
+
+    entries_count = scandir(dir, &entries, NULL, NULL);
+    if(entries_count < 0)
+    {
+        fprintf(stderr,
+                "%s: WARNING: could not list the logs of the previous run in %s\n",
+                __func__,
+                dir);
+        return 0;
+    }
+
+    for(i = 0; i < entries_count; i++)
+    {
+        struct root_s *root = NULL;
+        uint64_t seconds = 0LL;
+        uint64_t nentries = 0LL;
+        PVFS_time log_time = 0LL;
+        size_t name_len = strlen(entries[i]->d_name);
+        ssize_t len;
+        FILE *fp;
+        int j;
+
+        if(name_len > 8 && strcmp(&entries[i]->d_name[name_len - 8], ".summary") == 0)
+        {
+            snprintf(log_path, PATH_MAX, "%s/%s", dir, entries[i]->d_name);
+        }
+        else if(name_len > 4 && strcmp(&entries[i]->d_name[name_len - 4], ".log") == 0)
+        {
+            snprintf(log_path,
+                     PATH_MAX,
+                     "%s/%.*s.summary",
+                     dir,
+                     (int) (name_len - 4),
+                     entries[i]->d_name);
+            if(access(log_path, F_OK) == 0)
+            {
+                /* Read as such. */
+                free(entries[i]);
+                continue;
+            }
+            snprintf(log_path, PATH_MAX, "%s/%s", dir, entries[i]->d_name);
+        }
+        else
+        {
+            free(entries[i]);
+            continue;
+        }
+        free(entries[i]);
+
+        fp = fopen(log_path, "r");
+        if(!fp)
+        {
+            continue;
+        }
+
+        while((len = getline(&line, &line_size, fp)) >= 0)
+        {
+            char *value = strchr(line, '\t');
+
+            if(!value || ((line[0] == 'R' || line[0] == 'K') && value == &line[1]))
+            {
+                continue;
+            }
+            *value++ = 0;
+            if(len > 0 && line[len - 1] == '\n')
+            {
+                line[len - 1] = 0;
+            }
+
+            if(strcmp(line, "directory") == 0)
+            {
+                for(j = 0; j < roots_count && strcmp(roots[j].path, value) != 0; j++)
+                {
+                }
+                root = j < roots_count ? &roots[j] : NULL;
+            }
+            else if(strcmp(line, "current_time") == 0)
+            {
+                log_time = strtoll(value, NULL, 10);
+            }
+            else if(strcmp(line, "duration_seconds") == 0)
+            {
+                seconds = strtoull(value, NULL, 10);
+            }
+            else if(strcmp(line, "removed_files") == 0 ||
+                    strcmp(line, "failed_removed_files") == 0 ||
+                    strcmp(line, "kept_files") == 0 ||
+                    strcmp(line, "directories") == 0 ||
+                    strcmp(line, "symlinks") == 0 ||
+                    strcmp(line, "unknown") == 0)
+            {
+                nentries += strtoull(value, NULL, 10);
+            }
+        }
+        fclose(fp);
+
+        if(root && log_time >= root->cost_time)
+        {
+            root->cost_time = log_time;
+            root->cost_seconds = seconds;
+            root->cost_entries = nentries;
+        }
+    }
+    free(entries);
+    free(line);
+
+    return 0;
+}
+
+/* Roots left unfinished by the previous run come first, so that none waits more than one run.
+ * Then longest processing time first: roots that took longest, or listed the most entries, in the
+ * previous run come first, then those of unknown cost in alphabetical order. */
+int root_cost_compare(const void *a, const void *b)
+{
+    const struct root_s *ra = (const struct root_s *) a;
+    const struct root_s *rb = (const struct root_s *) b;
+
+    if(ra->resumed != rb->resumed)
+    {
+        return ra->resumed ? -1 : 1;
+    }
+    if(ra->cost_seconds != rb->cost_seconds)
+    {
+        return ra->cost_seconds > rb->cost_seconds ? -1 : 1;
+    }
+    if(ra->cost_entries != rb->cost_entries)
+    {
+        return ra->cost_entries > rb->cost_entries ? -1 : 1;
+    }
+    return strcmp(ra->path, rb->path);
+}
+
+/* Orders the roots by their cost in the previous run, from --cost-logs and the --cost-table. */
+void roots_order(void)
+{
+    int i;
+
+    if(opts.cost_logs_dir)
+    {
+        cost_logs_load(opts.cost_logs_dir);
+    }
+
+    for(i = 0; i < roots_count; i++)
+    {
+        struct cost_rec_s *recp = cost_find(roots[i].ref.handle);
+
+        if(recp)
+        {
+            roots[i].cost_entries = recp->entries;
+        }
+    }
+
+    qsort(roots, roots_count, sizeof(struct root_s), root_cost_compare);
+}
+
+/* Queues every root, in order, for a slot. */
+int roots_queue_init(void)
+{
+    int i;
+
+    roots_queue = (struct root_s **) calloc(roots_count > 0 ? roots_count : 1,
+                                            sizeof(struct root_s *));
+    if(!roots_queue)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate the queue of %d roots\n",
+                __func__, roots_count);
+        return -1;
+    }
+
+    for(i = 0; i < roots_count; i++)
+    {
+        struct root_s *root = &roots[i];
+        uint64_t j;
+
+        /* qsort moved the roots, their saved directories must follow. */
+        for(j = 0; j < root->saved_count; j++)
+        {
+            root->saved[j].root = root;
+        }
+        roots_queue[i] = root;
+    }
+    roots_queue_count = roots_count;
+    roots_unfinished = roots_count;
+
+    return 0;
+}
+
+int walk_rdp_and_purge(struct walker_s *w, struct walk_item_s *itemp)
+{
+    PVFS_sysresp_readdirplus rdplus_response;
+    PVFS_sysresp_readdirplus rdplus_prefetch;
+    PVFS_object_ref *dir_refp = &itemp->ref;
+    PVFS_object_ref dirent_ref;
+    char *path = itemp->path;
+    char *dirent_path = w->dirent_path;
+    struct purge_stats_s *psp = &w->stats[itemp->root->slot];
+    struct owner_table_s *ot = w->owners ? &w->owners[itemp->root->slot] : NULL;
+    struct index_dir_s *idx = itemp->idx;
+    PVFS_ds_position token = itemp->token;
+    PVFS_sys_op_id prefetch_op;
+    char tagged[PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS];
+    uint64_t entry_count = 0LL;
+    int ret = 0;
+    int prefetch_pending = 0;
+    int yielded = 0;
+    size_t dir_len = 0;
+
+    /* Owned by this scan from now on. */
+    itemp->idx = NULL;
+
+    dir_len = strlen(path);
+    if(dir_len + 1 >= PVFS_PATH_MAX)
+    {
+        fprintf(stderr,
+                "%s: ERROR: path too long, path = %s\n",
+                __func__,
+                path);
+        index_dir_free(idx);
+        return -1;
+    }
+
+    if(index_out && token == PVFS_READDIR_START)
+    {
+        ret = index_try_skip(w, itemp);
+        if(ret != 0)
+        {
+            return ret < 0 ? -1 : 0;
+        }
+
+        idx = index_dir_new(dir_refp->handle, itemp->mtime);
+        if(!idx)
+        {
+            return -1;
+        }
+    }
+
+    memcpy(dirent_path, path, dir_len);
+    dirent_path[dir_len] = '/';
+
+    DEBUG("INFO: scanning with rdp, path = %s\n", path);
+
+    /* Subdirectories are on the same file system. */
+    dirent_ref.fs_id = dir_refp->fs_id;
+
+    while(!yielded)
+    {
+        struct purge_stats_s batch_start = *psp;
+        size_t batch_dirs = 0;
+        int i = 0;
+
+        if(prefetch_pending)
+        {
+            /* The batch was requested while the previous batch was being processed. */
+            int op_ret = 0;
+
+            prefetch_pending = 0;
+            ret = PVFS_sys_wait(prefetch_op, "readdirplus", &op_ret);
+            if(ret == 0)
+            {
+                ret = op_ret;
+            }
+            rdplus_response = rdplus_prefetch;
+        }
+        else
+        {
+            memset(&rdplus_response, 0, sizeof(PVFS_sysresp_readdirplus));
+            rate_limit_wait();
+            ret = PVFS_sys_readdirplus(*dir_refp,
+                                    token,
+                                    PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS,
+                                    &creds,
+                                    rdplus_attrmask,
+                                    &rdplus_response,
+                                    NULL);
+        }
+
+        if(ret < 0)
+        {
+            fprintf(stderr,
+                    "%s: ERROR: PVFS_sys_readdirplus failed with ret= %d\n",
+                    __func__,
+                    ret);
+            ret = -1;
+            goto cleanup;
+        }
+
+        entry_count += rdplus_response.pvfs_dirent_outcount;
+        if(itemp->cost)
+        {
+            __sync_add_and_fetch(&itemp->cost->entries, rdplus_response.pvfs_dirent_outcount);
+        }
+
+        if(rdplus_response.token != PVFS_ITERATE_END &&
+           (walk_over_budget() || checkpoint_wanted() ||
+            (roots_multi && root_suspended(itemp->root))))
+        {
+            /* The rest of this directory is queued once this batch is processed, see below. A
+             * checkpoint saves it along with the other queued directories, as does the end of the
+             * root's slice of --max-duration. */
+            yielded = 1;
+        }
+        else if(opts.prefetch && rdplus_response.token != PVFS_ITERATE_END)
+        {
+            /* Request the next batch now so that it arrives while this one is being processed. */
+            memset(&rdplus_prefetch, 0, sizeof(PVFS_sysresp_readdirplus));
+            rate_limit_wait();
+            ret = PVFS_isys_readdirplus(*dir_refp,
+                                        rdplus_response.token,
+                                        PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS,
+                                        &creds,
+                                        rdplus_attrmask,
+                                        &rdplus_prefetch,
+                                        &prefetch_op,
+                                        NULL,
+                                        NULL);
+            if(ret < 0)
+            {
+                fprintf(stderr,
+                        "%s: ERROR: PVFS_isys_readdirplus failed with ret= %d\n",
+                        __func__,
+                        ret);
+                ret = -1;
+                goto cleanup;
+            }
+            prefetch_pending = 1;
+        }
+
+        if(opts.kept_bytes_mode != KEPT_BYTES_EXACT)
+        {
+            fetch_batch_sizes(&rdplus_response,
+                              dir_refp->fs_id,
+                              itemp->basis,
+                              path,
+                              &w->size_sample);
+        }
+
+        exempt_check(&w->exempt, *dir_refp, path, token, &rdplus_response);
+        fetch_batch_tags(&rdplus_response,
+                         *dir_refp,
+                         itemp->basis,
+                         path,
+                         w->exempt,
+                         w->tag_above,
+                         w->tag_above_count,
+                         &w->tag,
+                         tagged);
+
+        if(rdplus_response.pvfs_dirent_outcount)
+        {
+            for(i = 0; i < rdplus_response.pvfs_dirent_outcount; i++)
+            {
+                struct dirent_rec_s rec;
+
+                DEBUG("INFO: rdplus_response.dirent_array[%u].d_name = %s\n",
+                      i,
+                      rdplus_response.dirent_array[i].d_name);
+                DEBUG("INFO: rdplus_response.attr_array[%u].size = %llu\n",
+                      i,
+                      LLU(rdplus_response.attr_array[i].size));
+
+                dirent_record(&rec,
+                              itemp->basis,
+                              w->exempt >= EXEMPT_MARKED || w->tag == TAG_EXEMPT || tagged[i],
+                              path,
+                              &rdplus_response.dirent_array[i],
+                              &rdplus_response.attr_array[i]);
+                if(itemp->root->records)
+                {
+                    log_record(&w->rec_chunk,
+                               itemp->root->records,
+                               &rec,
+                               dir_refp->handle,
+                               &rdplus_response.attr_array[i]);
+                }
+
+                switch(rec.cls)
+                {
+                    case DIRENT_REMOVE:
+                        if(idx)
+                        {
+                            index_dir_note_file(idx, &rdplus_response.attr_array[i]);
+                        }
+
+                        if(opts.log_removed_files)
+                        {
+                            log_line(&w->log_chunk,
+                                     itemp->root,
+                                     'R',
+                                     path,
+                                     dir_len,
+                                     rec.name,
+                                     rec.rule);
+                        }
+
+                        if(!dirent_path_fill(dirent_path, dir_len, &rec))
+                        {
+                            PVFS_util_release_sys_attr(&rdplus_response.attr_array[i]);
+                            ret = -1;
+                            goto cleanup;
+                        }
+
+                        ret = 0;
+                        if(!opts.dry_run && opts.remove_window > 0)
+                        {
+                            remove_async(w,
+                                         dir_refp,
+                                         dirent_path,
+                                         dir_len + 1,
+                                         rec.size,
+                                         rec.owner,
+                                         rec.group);
+                            break;
+                        }
+                        else if(!opts.dry_run)
+                        {
+                            rate_limit_wait();
+                            ret = PVFS_sys_remove(rdplus_response.dirent_array[i].d_name,
+                                                *dir_refp,
+                                                &creds,
+                                                NULL);
+                        }
+
+                        /* A failed removal is accounted for, it must not fail the walk when it
+                         * happens to be the last entry of the directory. */
+                        account_removal(psp,
+                                        ot,
+                                        rec.owner,
+                                        rec.group,
+                                        dirent_path,
+                                        rec.size,
+                                        ret);
+                        ret = 0;
+                        break;
+
+                    case DIRENT_KEEP:
+                        if(idx)
+                        {
+                            index_dir_note_file(idx, &rdplus_response.attr_array[i]);
+                        }
+
+                        if(opts.log_kept_files)
+                        {
+                            log_line(&w->log_chunk,
+                                     itemp->root,
+                                     'K',
+                                     path,
+                                     dir_len,
+                                     rec.name,
+                                     rec.rule);
+                        }
+
+                        account_kept(psp, ot, &rdplus_response.attr_array[i]);
+                        break;
+
+                    case DIRENT_EXEMPT:
+                        if(idx)
+                        {
+                            index_dir_note_file(idx, &rdplus_response.attr_array[i]);
+                        }
+
+                        if(opts.log_kept_files)
+                        {
+                            log_line(&w->log_chunk,
+                                     itemp->root,
+                                     'K',
+                                     path,
+                                     dir_len,
+                                     rec.name,
+                                     rec.rule);
+                        }
+
+                        account_exempt(psp, ot, rec.owner, rec.group, rec.size);
+                        break;
+
+                    case DIRENT_DIR:
+                        account_other(psp, ot, &rdplus_response.attr_array[i], rec.cls);
+                        /* Let this or another walker thread scan it later. */
+                        dirent_ref.handle = rec.handle;
+                        if(!dirent_path_fill(dirent_path, dir_len, &rec) ||
+                           (idx && index_dir_add_child(idx, rec.handle, rec.name) != 0) ||
+                           walk_push(w,
+                                     dirent_path,
+                                     &dirent_ref,
+                                     PVFS_READDIR_START,
+                                     rdplus_response.attr_array[i].mask & PVFS_ATTR_SYS_MTIME ?
+                                     rdplus_response.attr_array[i].mtime : INDEX_MTIME_UNKNOWN,
+                                     NULL) != 0)
+                        {
+                            PVFS_util_release_sys_attr(&rdplus_response.attr_array[i]);
+                            ret = -1;
+                            goto cleanup;
+                        }
+                        batch_dirs++;
+                        break;
+
+                    case DIRENT_LNK:
+                        account_other(psp, ot, &rdplus_response.attr_array[i], rec.cls);
+                        break;
+
+                    default:
+                        fprintf(stderr,
+                                "%s: ERROR: UNRECOGNIZED DIRENT TYPE at path: %s/%s\n",
+                                __func__,
+                                path,
+                                rec.name);
+                        account_other(psp, ot, &rdplus_response.attr_array[i], rec.cls);
+                }
+
+                PVFS_util_release_sys_attr(&rdplus_response.attr_array[i]);
+
+            } /* Done iterating over gathered entries and stats */
+
+            release_rdplus_response(&rdplus_response);
+
+        } /* Check for more dirents via PVFS_sys_readdirplus! */
+
+        if(idx)
+        {
+            index_dir_add_stats(idx, &batch_start, psp);
+        }
+
+        if(batch_dirs > 1 && cost_slots)
+        {
+            walk_deque_order(&w->deque, batch_dirs);
+        }
+
+        if(yielded)
+        {
+            /* Queue the rest of this directory *beneath* the subdirectories found in this batch so
+             * that they are scanned first, which lets the queue shrink again. Queuing it only now
+             * keeps another walker from resuming the scan while idx is still being updated. */
+            ret = walk_push(w, path, dir_refp, rdplus_response.token, itemp->mtime, idx);
+            if(ret != 0)
+            {
+                ret = -1;
+                goto cleanup;
+            }
+            walk_deque_sink(&w->deque, batch_dirs);
+            idx = NULL;
+        }
+
+        if(rdplus_response.token == PVFS_ITERATE_END)
+        {
+            break;
+        }
+
+        token = rdplus_response.token;
+
+    } /* END while(!yielded) */
+
+cleanup:
+    if(prefetch_pending)
+    {
+        /* Never leave the library writing into rdplus_prefetch after returning. */
+        int op_ret = 0;
+        int i = 0;
+
+        if(PVFS_sys_wait(prefetch_op, "readdirplus", &op_ret) == 0 && op_ret == 0)
+        {
+            for(i = 0; i < rdplus_prefetch.pvfs_dirent_outcount; i++)
+            {
+                PVFS_util_release_sys_attr(&rdplus_prefetch.attr_array[i]);
+            }
+            release_rdplus_response(&rdplus_prefetch);
+        }
+    }
+    if(idx)
+    {
+        if(ret == 0)
+        {
+            index_dir_finish(idx);
+        }
+        else
+        {
+            index_dir_free(idx);
+        }
+    }
+    DEBUG("INFO: entry_count = %llu\n",
+          LLU(entry_count));
+    return ret;
+}
+
+/* Bytes of memory held by a queued walk item. */
+uint64_t walk_item_bytes(struct walk_item_s *itemp)
+{
+    return sizeof(struct walk_item_s) + strlen(itemp->path) + 1 +
+           itemp->tag_above_count * sizeof(PVFS_handle);
+}
+
+/* Frees what a walk item owns. */
+void walk_item_free(struct walk_item_s *itemp)
+{
+    free(itemp->path);
+    free(itemp->tag_above);
+}
+
+/* Adds (or subtracts, when negative) bytes to the memory held by queued directories. */
+void walk_account_bytes(int64_t bytes)
+{
+    uint64_t queued = __sync_add_and_fetch(&walk_queued_bytes, bytes);
+    uint64_t peak = walk_peak_bytes;
+
+    while(queued > peak && !__sync_bool_compare_and_swap(&walk_peak_bytes, peak, queued))
+    {
+        peak = walk_peak_bytes;
+    }
+}
+
+/* Returns 1 once the directories queued by all walkers hold more memory than opts.memory_budget.
+ * Walkers then interrupt the scan of large directories after each batch so that subdirectories are
+ * scanned, and dequeued, first. The budget may be exceeded by at most one batch of subdirectories
+ * per directory being scanned, no matter how deep the directory tree is. */
+int walk_over_budget(void)
+{
+    return walk_queued_bytes > opts.memory_budget;
+}
+
+/* Queues a copy of path, *dir_refp, the readdirplus token to resume from, the directory's mtime if
+ * known and its index record if any at the back of the walker's deque. The directory belongs to the
+ * root of the one the walker is scanning, w->root, and is one level below it unless it is the rest
+ * of that directory. A directory of --exclude-file is counted and dropped instead. */
+int walk_push(struct walker_s *w,
+              char *path,
+              PVFS_object_ref *dir_refp,
+              PVFS_ds_position token,
+              PVFS_time mtime,
+              struct index_dir_s *idx)
+{
+    struct walk_item_s item;
+    int ret = 0;
+
+    if(exclude_match(path))
+    {
+        w->stats[w->root->slot].excluded_dirs++;
+        return 0;
+    }
+
+    item.ref = *dir_refp;
+    item.token = token;
+    item.mtime = mtime;
+    item.idx = idx;
+    item.root = w->root;
+    item.basis = basis_find(dir_refp->handle, w->basis);
+    item.tag_above = NULL;
+    item.tag_above_count = 0;
+    if(token != PVFS_READDIR_START)
+    {
+        /* The rest of the directory being scanned. */
+        item.exempt = w->exempt;
+        item.tag = w->tag;
+    }
+    else
+    {
+        item.exempt = opts.marker_subtree && w->exempt >= EXEMPT_MARKED ?
+                      EXEMPT_INHERITED : EXEMPT_UNKNOWN;
+    }
+    if(cost_item_init(w, &item, token) != 0)
+    {
+        return -1;
+    }
+    item.path = strdup(path);
+    if(!item.path)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate path = %s\n", __func__, path);
+        return -1;
+    }
+    if(token == PVFS_READDIR_START)
+    {
+        ret = tag_inherit(w->tag,
+                          w->tag_above,
+                          w->tag_above_count,
+                          w->handle,
+                          &item.tag,
+                          &item.tag_above,
+                          &item.tag_above_count);
+    }
+    else if(w->tag_above_count > 0)
+    {
+        item.tag_above = (PVFS_handle *) malloc(w->tag_above_count * sizeof(PVFS_handle));
+        if(item.tag_above)
+        {
+            memcpy(item.tag_above, w->tag_above, w->tag_above_count * sizeof(PVFS_handle));
+            item.tag_above_count = w->tag_above_count;
+        }
+        else
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate the directories above\n", __func__);
+            ret = -1;
+        }
+    }
+    if(ret != 0)
+    {
+        free(item.path);
+        return -1;
+    }
+
+    return walk_enqueue(w, &item);
+}
+
+/* Queues an item at the back of the walker's deque, which then owns its path and tag_above. */
+int walk_enqueue(struct walker_s *w, struct walk_item_s *itemp)
+{
+    struct walk_deque_s *dq = &w->deque;
+    struct walk_item_s item = *itemp;
+
+    walk_account_bytes(walk_item_bytes(&item));
+
+    /* Count the item as pending before any other walker can see it, otherwise a thief could finish
+     * it and drop walk_pending to zero while this walker still has work to queue. */
+    __sync_add_and_fetch(&item.root->pending, 1);
+    __sync_add_and_fetch(&walk_pending, 1);
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->count == dq->size)
+    {
+        size_t new_size = dq->size ? dq->size * 2 : 64;
+        struct walk_item_s *items = malloc(new_size * sizeof(struct walk_item_s));
+        size_t i;
+
+        if(!items)
+        {
+            pthread_mutex_unlock(&dq->lock);
+            walk_account_bytes(-(int64_t) walk_item_bytes(&item));
+            walk_item_free(&item);
+            __sync_sub_and_fetch(&item.root->pending, 1);
+            __sync_sub_and_fetch(&walk_pending, 1);
+            fprintf(stderr, "%s: ERROR: could not grow the deque of walker %d\n", __func__, w->id);
+            return -1;
+        }
+
+        for(i = 0; i < dq->count; i++)
+        {
+            items[i] = dq->items[(dq->head + i) % dq->size];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->size = new_size;
+    }
+    dq->items[(dq->head + dq->count) % dq->size] = item;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+
+    pthread_mutex_lock(&walk_lock);
+    if(walk_idle > 0)
+    {
+        pthread_cond_signal(&walk_cond);
+    }
+    pthread_mutex_unlock(&walk_lock);
+
+    return 0;
+}
+
+/* Moves the item at the back of a deque beneath the depth items queued before it, or as many of
+ * them as other walkers have not stolen yet. */
+void walk_deque_sink(struct walk_deque_s *dq, size_t depth)
+{
+    struct walk_item_s item;
+    size_t back;
+    size_t i;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->count == 0)
+    {
+        /* Stolen along with everything beneath it. */
+        pthread_mutex_unlock(&dq->lock);
+        return;
+    }
+    if(depth > dq->count - 1)
+    {
+        depth = dq->count - 1;
+    }
+    back = dq->head + dq->count - 1;
+    item = dq->items[back % dq->size];
+    for(i = 0; i < depth; i++)
+    {
+        dq->items[(back - i) % dq->size] = dq->items[(back - i - 1) % dq->size];
+    }
+    dq->items[(back - depth) % dq->size] = item;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* Orders the n items at the back of a deque, or as many of them as other walkers have not stolen
+ * yet, by decreasing cost in the previous run from front to back, so that thieves take the
+ * costliest subtrees first (longest processing time first). */
+void walk_deque_order(struct walk_deque_s *dq, size_t n)
+{
+    size_t first;
+    size_t i;
+    size_t j;
+
+    pthread_mutex_lock(&dq->lock);
+    if(n > dq->count)
+    {
+        n = dq->count;
+    }
+    first = dq->head + dq->count - n;
+    for(i = 1; i < n; i++)
+    {
+        struct walk_item_s item = dq->items[(first + i) % dq->size];
+
+        for(j = i; j > 0 && dq->items[(first + j - 1) % dq->size].prev_cost < item.prev_cost; j--)
+        {
+            dq->items[(first + j) % dq->size] = dq->items[(first + j - 1) % dq->size];
+        }
+        dq->items[(first + j) % dq->size] = item;
+    }
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* Pops from the back (steal == 0) or the front (steal == 1) of a deque. Returns 1 if an item was
+ * dequeued. */
+int walk_deque_take(struct walk_deque_s *dq, int steal, struct walk_item_s *itemp)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->count > 0)
+    {
+        if(steal)
+        {
+            *itemp = dq->items[dq->head];
+            dq->head = (dq->head + 1) % dq->size;
+        }
+        else
+        {
+            *itemp = dq->items[(dq->head + dq->count - 1) % dq->size];
+        }
+        dq->count--;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return ret;
+}
+
+/* Takes work from the walker's own deque, or else steals from the others. */
+int walk_find(struct walker_s *w, struct walk_item_s *itemp)
+{
+    int i;
+
+    if(walk_deque_take(&w->deque, 0, itemp))
+    {
+        return 1;
+    }
+
+    for(i = 1; i < walkers_count; i++)
+    {
+        struct walker_s *victim = &walkers[(w->id + i) % walkers_count];
+
+        if(walk_deque_take(&victim->deque, 1, itemp))
+        {
+            DEBUG("INFO: walker %d stole path = %s from walker %d\n", w->id, itemp->path, victim->id);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* A --checkpoint file is a struct checkpoint_header_s followed by count directories, each a struct
+ * checkpoint_item_s followed by its path, not null terminated, and the handles of its tag_above. */
+struct checkpoint_header_s
+{
+    char magic[8];
+    uint64_t fs_id;
+    uint64_t root_handle;
+    int64_t removal_basis_time;
+    struct purge_stats_s stats;
+    uint64_t count;
+};
+
+struct checkpoint_item_s
+{
+    uint64_t handle;
+    uint64_t token;
+    int64_t mtime;
+    uint64_t exempt;
+    uint64_t tag;
+    uint64_t path_len;
+    uint64_t tag_above_count;
+};
+
+PVFS_object_ref checkpoint_root;
+
+/* Writes a queued directory as a struct checkpoint_item_s followed by its path and tag_above. */
+int checkpoint_item_write(FILE *out, struct walk_item_s *itemp)
+{
+    struct checkpoint_item_s item;
+
+    item.handle = itemp->ref.handle;
+    item.token = itemp->token;
+    item.mtime = itemp->mtime;
+    item.exempt = itemp->exempt;
+    item.tag = itemp->tag;
+    item.path_len = strlen(itemp->path);
+    item.tag_above_count = itemp->tag_above_count;
+    if(fwrite(&item, sizeof(item), 1, out) != 1 ||
+       fwrite(itemp->path, item.path_len, 1, out) != 1 ||
+       (item.tag_above_count > 0 &&
+        fwrite(itemp->tag_above, item.tag_above_count * sizeof(PVFS_handle), 1, out) != 1))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads a directory written by checkpoint_item_write into *itemp, allocating its path and
+ * tag_above. */
+int checkpoint_item_read(FILE *in, PVFS_fs_id fs_id, struct walk_item_s *itemp)
+{
+    struct checkpoint_item_s item;
+
+    memset(itemp, 0, sizeof(struct walk_item_s));
+    if(fread(&item, sizeof(item), 1, in) != 1 || item.path_len >= PVFS_PATH_MAX ||
+       item.tag_above_count >= PVFS_PATH_MAX)
+    {
+        return -1;
+    }
+
+    itemp->path = (char *) malloc(item.path_len + 1);
+    if(item.tag_above_count > 0)
+    {
+        itemp->tag_above = (PVFS_handle *) malloc(item.tag_above_count * sizeof(PVFS_handle));
+    }
+    if(!itemp->path || (item.tag_above_count > 0 && !itemp->tag_above))
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate path\n", __func__);
+        walk_item_free(itemp);
+        itemp->path = NULL;
+        itemp->tag_above = NULL;
+        return -1;
+    }
+
+    if(fread(itemp->path, item.path_len, 1, in) != 1 ||
+       (item.tag_above_count > 0 &&
+        fread(itemp->tag_above, item.tag_above_count * sizeof(PVFS_handle), 1, in) != 1))
+    {
+        walk_item_free(itemp);
+        itemp->path = NULL;
+        itemp->tag_above = NULL;
+        return -1;
+    }
+    itemp->path[item.path_len] = 0;
+    itemp->tag_above_count = item.tag_above_count;
+    itemp->ref.handle = item.handle;
+    itemp->ref.fs_id = fs_id;
+    itemp->token = item.token;
+    itemp->mtime = item.mtime;
+    itemp->basis = basis_of_path(itemp->path);
+    itemp->exempt = (exempt_type) item.exempt;
+    itemp->tag = (tag_type) item.tag;
+
+    return 0;
+}
+
+void checkpoint_sigterm(int sig)
+{
+    checkpoint_signaled = 1;
+}
+
+/* Returns 1 when the walkers should park for a checkpoint. */
+int checkpoint_wanted(void)
+{
+    if(!opts.checkpoint_path)
+    {
+        return 0;
+    }
+
+    return checkpoint_signaled ||
+           (opts.checkpoint_interval > 0 &&
+            time(NULL) - checkpoint_last >= opts.checkpoint_interval);
+}
+
+/* Saves every walker's queued directories and the counters of all walkers to the checkpoint file,
+ * through a temporary file renamed over it. Only called by the last walker to park, with walk_lock
+ * held, so nothing else changes in the meantime. */
+int checkpoint_write(void)
+{
+    struct checkpoint_header_s header;
+    char tmp_path[PATH_MAX];
+    FILE *out = NULL;
+    size_t j;
+    int ret = 0;
+    int i;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.fs_id = checkpoint_root.fs_id;
+    header.root_handle = checkpoint_root.handle;
+    header.removal_basis_time = removal_basis_time;
+    header.stats = pstats;
+    for(i = 0; i < walkers_count; i++)
+    {
+        purge_stats_add(&header.stats, &walkers[i].stats[0]);
+        header.count += walkers[i].deque.count;
+    }
+
+    snprintf(tmp_path, PATH_MAX, "%s.tmp", opts.checkpoint_path);
+    out = fopen(tmp_path, "w");
+    if(!out)
+    {
+        fprintf(stderr,
+                "%s: ERROR: could not create checkpoint = %s\n",
+                __func__,
+                tmp_path);
+        return -1;
+    }
+
+    if(fwrite(&header, sizeof(header), 1, out) != 1)
+    {
+        ret = -1;
+    }
+
+    for(i = 0; i < walkers_count && ret == 0; i++)
+    {
+        struct walk_deque_s *dq = &walkers[i].deque;
+
+        pthread_mutex_lock(&dq->lock);
+        for(j = 0; j < dq->count && ret == 0; j++)
+        {
+            ret = checkpoint_item_write(out, &dq->items[(dq->head + j) % dq->size]);
+        }
+        pthread_mutex_unlock(&dq->lock);
+    }
+
+    if(fflush(out) != 0 || fsync(fileno(out)) != 0)
+    {
+        ret = -1;
+    }
+    if(fclose(out) != 0)
+    {
+        ret = -1;
+    }
+
+    if(ret == 0 && rename(tmp_path, opts.checkpoint_path) != 0)
+    {
+        ret = -1;
+    }
+
+    if(ret != 0)
+    {
+        fprintf(stderr,
+                "%s: ERROR: could not write checkpoint = %s\n",
+                __func__,
+                opts.checkpoint_path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    DEBUG("INFO: checkpointed %llu directories\n", LLU(header.count));
+    return 0;
+}
+
+/* Parks the calling walker, which holds walk_lock and has no removal in flight, until the
+ * checkpoint has been written. Walkers scanning a directory stop after the batch at hand (see
+ * walk_rdp_and_purge), so once every walker is parked, all the work left is queued. The last walker
+ * to park writes the checkpoint and, after SIGTERM, stops the walk. */
+void checkpoint_park(void)
+{
+    uint64_t gen = checkpoint_gen;
+
+    if(++walk_parked < walkers_count)
+    {
+        /* Wake the idle walkers so that they park as well. */
+        pthread_cond_broadcast(&walk_cond);
+        while(gen == checkpoint_gen && !walk_aborted && walk_pending > 0)
+        {
+            pthread_cond_wait(&walk_cond, &walk_lock);
+        }
+        return;
+    }
+
+    if(checkpoint_write() == 0)
+    {
+        checkpoint_written = 1;
+    }
+    checkpoint_last = time(NULL);
+    walk_parked = 0;
+    checkpoint_gen++;
+
+    if(checkpoint_signaled)
+    {
+        /* The walk goes on with --resume. */
+        walk_stopped = 1;
+        walk_aborted = 1;
+    }
+    pthread_cond_broadcast(&walk_cond);
+}
+
+void checkpoint_items_free(void)
+{
+    uint64_t i;
+
+    for(i = 0; i < checkpoint_items_count; i++)
+    {
+        walk_item_free(&checkpoint_items[i]);
+    }
+    free(checkpoint_items);
+    checkpoint_items = NULL;
+    checkpoint_items_count = 0;
+}
+
+/* Reads the checkpoint being resumed: its counters become those of pstats, its removal-basis-time
+ * overrides this run's and its directories are queued by walk_tree. */
+int checkpoint_load(const char *path, PVFS_fs_id fs_id, PVFS_handle root_handle)
+{
+    struct checkpoint_header_s header;
+    FILE *in = NULL;
+    uint64_t i;
+
+    in = fopen(path, "r");
+    if(!in)
+    {
+        fprintf(stderr, "%s: ERROR: could not open checkpoint = %s\n", __func__, path);
+        return -1;
+    }
+
+    if(fread(&header, sizeof(header), 1, in) != 1 ||
+       memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "%s: ERROR: not a checkpoint = %s\n", __func__, path);
+        goto error;
+    }
+
+    if(header.fs_id != (uint64_t) fs_id || header.root_handle != root_handle)
+    {
+        fprintf(stderr, "%s: ERROR: checkpoint of another directory = %s\n", __func__, path);
+        goto error;
+    }
+
+    checkpoint_items = (struct walk_item_s *) calloc(header.count ? header.count : 1,
+                                                     sizeof(struct walk_item_s));
+    if(!checkpoint_items)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate %llu directories\n", __func__, LLU(header.count));
+        goto error;
+    }
+
+    for(i = 0; i < header.count; i++)
+    {
+        if(checkpoint_item_read(in, fs_id, &checkpoint_items[i]) != 0)
+        {
+            fprintf(stderr, "%s: ERROR: truncated checkpoint = %s\n", __func__, path);
+            goto error;
+        }
+        checkpoint_items_count++;
+    }
+
+    fclose(in);
+    pstats = header.stats;
+    removal_basis_time = header.removal_basis_time;
+    return 0;
+
+error:
+    fclose(in);
+    checkpoint_items_free();
+    return -1;
+}
+
+/* A --deferred file is a struct checkpoint_header_s, of which only magic, fs_id and count are used,
+ * followed by count roots, each a struct deferred_root_s, its path, not null terminated, and its
+ * directories as in a checkpoint. */
+struct deferred_root_s
+{
+    uint64_t path_len;
+    uint64_t count;
+};
+
+/* Saves the directories left by the roots deferred at the end of --max-duration, through a
+ * temporary file renamed over path. The file is removed when no root was deferred. */
+int roots_deferred_write(const char *path)
+{
+    struct checkpoint_header_s header;
+    char tmp_path[PATH_MAX];
+    FILE *out = NULL;
+    uint64_t j;
+    int ret = 0;
+    int i;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEFERRED_MAGIC, sizeof(header.magic));
+    for(i = 0; i < roots_count; i++)
+    {
+        if(roots[i].deferred && roots[i].saved_count > 0)
+        {
+            header.fs_id = roots[i].ref.fs_id;
+            header.count++;
+        }
+    }
+
+    if(header.count == 0)
+    {
+        unlink(path);
+        return 0;
+    }
+
+    snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+    out = fopen(tmp_path, "w");
+    if(!out)
+    {
+        fprintf(stderr, "%s: ERROR: could not create %s\n", __func__, tmp_path);
+        return -1;
+    }
+
+    if(fwrite(&header, sizeof(header), 1, out) != 1)
+    {
+        ret = -1;
+    }
+
+    for(i = 0; i < roots_count && ret == 0; i++)
+    {
+        struct deferred_root_s rec;
+
+        if(!roots[i].deferred || roots[i].saved_count == 0)
+        {
+            continue;
+        }
+
+        rec.path_len = strlen(roots[i].path);
+        rec.count = roots[i].saved_count;
+        if(fwrite(&rec, sizeof(rec), 1, out) != 1 ||
+           fwrite(roots[i].path, rec.path_len, 1, out) != 1)
+        {
+            ret = -1;
+        }
+        for(j = 0; j < rec.count && ret == 0; j++)
+        {
+            ret = checkpoint_item_write(out, &roots[i].saved[j]);
+        }
+    }
+
+    if(fflush(out) != 0 || fsync(fileno(out)) != 0)
+    {
+        ret = -1;
+    }
+    if(fclose(out) != 0)
+    {
+        ret = -1;
+    }
+
+    if(ret == 0 && rename(tmp_path, path) != 0)
+    {
+        ret = -1;
+    }
+
+    if(ret != 0)
+    {
+        fprintf(stderr, "%s: ERROR: could not write the deferred roots = %s\n", __func__, path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Reads the roots deferred by the previous run, if any: the roots being purged that are among them
+ * continue from their saved directories. A file that is unreadable or of another file system is
+ * ignored with a warning, its roots are then purged from their top level directory. */
+int roots_deferred_load(const char *path, PVFS_fs_id fs_id)
+{
+    struct checkpoint_header_s header;
+    char root_path[PATH_MAX];
+    FILE *in = NULL;
+    uint64_t i;
+    uint64_t j;
+
+    in = fopen(path, "r");
+    if(!in)
+    {
+        /* Nothing was deferred. */
+        return 0;
+    }
+
+    if(fread(&header, sizeof(header), 1, in) != 1 ||
+       memcmp(header.magic, DEFERRED_MAGIC, sizeof(header.magic)) != 0 ||
+       header.fs_id != (uint64_t) fs_id)
+    {
+        fprintf(stderr, "%s: WARNING: ignoring unusable deferred roots = %s\n", __func__, path);
+        fclose(in);
+        return 0;
+    }
+
+    for(i = 0; i < header.count; i++)
+    {
+        struct deferred_root_s rec;
+        struct walk_item_s *items = NULL;
+        struct root_s *root = NULL;
+        int k;
+
+        if(fread(&rec, sizeof(rec), 1, in) != 1 || rec.path_len >= PATH_MAX ||
+           fread(root_path, rec.path_len, 1, in) != 1)
+        {
+            goto truncated;
+        }
+        root_path[rec.path_len] = 0;
+
+        for(k = 0; k < roots_count && !root; k++)
+        {
+            if(strcmp(roots[k].path, root_path) == 0)
+            {
+                root = &roots[k];
+            }
+        }
+
+        items = (struct walk_item_s *) calloc(rec.count ? rec.count : 1,
+                                              sizeof(struct walk_item_s));
+        if(!items)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate %llu directories\n",
+                    __func__, LLU(rec.count));
+            fclose(in);
+            return -1;
+        }
+
+        for(j = 0; j < rec.count; j++)
+        {
+            if(checkpoint_item_read(in, fs_id, &items[j]) != 0)
+            {
+                while(j-- > 0)
+                {
+                    walk_item_free(&items[j]);
+                }
+                free(items);
+                goto truncated;
+            }
+            items[j].root = root;
+            /* Deeper than any cost table record, see cost_item_init. */
+            items[j].depth = COST_TABLE_DEPTH + 1;
+        }
+
+        if(root)
+        {
+            root->saved = items;
+            root->saved_count = rec.count;
+            root->saved_size = rec.count;
+            root->resumed = 1;
+        }
+        else
+        {
+            /* No longer purged, excluded for instance. */
+            for(j = 0; j < rec.count; j++)
+            {
+                walk_item_free(&items[j]);
+            }
+            free(items);
+        }
+    }
+
+    fclose(in);
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: WARNING: ignoring the rest of truncated deferred roots = %s\n",
+            __func__, path);
+    fclose(in);
+    return 0;
+}
+
+/* Blocks until a directory is available to this walker. Returns 0 once every directory has been
+ * scanned or the walk has been aborted. */
+int walk_next(struct walker_s *w, struct walk_item_s *itemp)
+{
+    int ret = 0;
+
+    if(walk_aborted)
+    {
+        return 0;
+    }
+
+    if(!checkpoint_wanted() && walk_find(w, itemp))
+    {
+        return 1;
+    }
+
+    pthread_mutex_lock(&walk_lock);
+    walk_idle++;
+    while(!walk_aborted && walk_pending > 0)
+    {
+        if(checkpoint_wanted() && w->rm_count == 0)
+        {
+            checkpoint_park();
+            continue;
+        }
+
+        /* Look again while holding walk_lock, walk_push signals only after taking it. */
+        if(!checkpoint_wanted() && walk_find(w, itemp))
+        {
+            ret = 1;
+            break;
+        }
+
+        if(w->rm_count > 0)
+        {
+            /* Nothing to scan for now, finish this walker's removals before going to sleep. */
+            pthread_mutex_unlock(&walk_lock);
+            remove_window_wait(w, 1);
+            pthread_mutex_lock(&walk_lock);
+            continue;
+        }
+
+        pthread_cond_wait(&walk_cond, &walk_lock);
+    }
+    walk_idle--;
+    pthread_mutex_unlock(&walk_lock);
+
+    return ret;
+}
+
+/* Stops the walk, waking every walker. */
+void walk_abort(void)
+{
+    walk_aborted = 1;
+    pthread_mutex_lock(&walk_lock);
+    pthread_cond_broadcast(&walk_cond);
+    pthread_mutex_unlock(&walk_lock);
+}
+
+void root_finish(struct walker_s *w, struct root_s *root);
+
+/* Returns 1 once --max-duration is over. */
+int roots_deadline_passed(void)
+{
+    return opts.max_duration > 0 && elapsed_seconds(&roots_started) >= opts.max_duration;
+}
+
+/* Returns 1 once the slice of a root has ended: when --max-duration is over, or when its share of
+ * it is over while other roots wait for a slot. Its directories are then saved rather than scanned,
+ * see walker_main, and it waits for another slice behind the other roots. */
+int root_suspended(struct root_s *root)
+{
+    double now;
+
+    if(root->suspended || opts.max_duration == 0)
+    {
+        return root->suspended;
+    }
+
+    now = elapsed_seconds(&roots_started);
+    if(now >= opts.max_duration || (now >= root->slice_end && roots_queue_count > 0))
+    {
+        root->suspended = 1;
+    }
+    return root->suspended;
+}
+
+/* Saves a directory of a suspended root, which then owns its path. */
+int root_save(struct root_s *root, struct walk_item_s *itemp)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&roots_lock);
+    if(root->saved_count == root->saved_size)
+    {
+        uint64_t new_size = root->saved_size ? root->saved_size * 2 : 16;
+        struct walk_item_s *grown = realloc(root->saved, new_size * sizeof(struct walk_item_s));
+
+        if(!grown)
+        {
+            fprintf(stderr, "%s: ERROR: could not save the directories of %s\n",
+                    __func__, root->path);
+            ret = -1;
+            goto done;
+        }
+        root->saved = grown;
+        root->saved_size = new_size;
+    }
+    root->saved[root->saved_count++] = *itemp;
+
+done:
+    pthread_mutex_unlock(&roots_lock);
+    return ret;
+}
+
+void root_saved_free(struct root_s *root)
+{
+    uint64_t i;
+
+    for(i = 0; i < root->saved_count; i++)
+    {
+        walk_item_free(&root->saved[i]);
+    }
+    free(root->saved);
+    root->saved = NULL;
+    root->saved_count = 0;
+    root->saved_size = 0;
+}
+
+/* Queues the saved directories of a root on the walker's deque. */
+int root_requeue(struct walker_s *w, struct root_s *root)
+{
+    uint64_t i;
+    int ret = 0;
+
+    for(i = 0; i < root->saved_count; i++)
+    {
+        if(ret == 0)
+        {
+            ret = walk_enqueue(w, &root->saved[i]);
+        }
+        else
+        {
+            walk_item_free(&root->saved[i]);
+        }
+    }
+    free(root->saved);
+    root->saved = NULL;
+    root->saved_count = 0;
+    root->saved_size = 0;
+
+    return ret;
+}
+
+/* Starts, or with --max-duration continues, the purge of a root in the given slot of the walkers'
+ * counters by queuing its top level directory, or the directories it saved, on the calling walker's
+ * deque. */
+void root_start(struct walker_s *w, struct root_s *root, int slot)
+{
+    struct root_s *scanning = w->root;
+    struct cost_rec_s *scanning_cost = w->cost;
+    int scanning_depth = w->depth;
+    PVFS_time scanning_basis = w->basis;
+    exempt_type scanning_exempt = w->exempt;
+    tag_type scanning_tag = w->tag;
+    PVFS_handle *scanning_tag_above = w->tag_above;
+    int scanning_tag_above_count = w->tag_above_count;
+    PVFS_handle scanning_handle = w->handle;
+    int ret;
+
+    root->slot = slot;
+    root->suspended = 0;
+    if(opts.max_duration > 0)
+    {
+        double now = elapsed_seconds(&roots_started);
+
+        /* An equal share of the time left to each unfinished root, roots_slots of them at once. */
+        root->slice_end = now + (opts.max_duration - now) * roots_slots / roots_unfinished;
+    }
+
+    if(!root->logp)
+    {
+        root->current_time = get_current_time();
+        clock_gettime(CLOCK_MONOTONIC, &root->walk_start);
+        root->logp = log_open(root->path, root->current_time, &root->summaryp);
+        if(opts.deferred_path)
+        {
+            log_kv(root->logp,
+                   root->summaryp,
+                   "scan_resumed\t%s\n",
+                   root->resumed ? "true" : "false");
+        }
+        if(opts.log_records &&
+           (root->records = record_log_open(root->path, root->current_time, root->ref.fs_id)))
+        {
+            uint64_t j;
+
+            record_log_top(root->records, root->ref.handle, root->path);
+            /* Resumed from --deferred. */
+            for(j = 0; j < root->saved_count; j++)
+            {
+                if(root->saved[j].ref.handle != root->ref.handle)
+                {
+                    record_log_top(root->records, root->saved[j].ref.handle, root->saved[j].path);
+                }
+            }
+        }
+        if(opts.log_compressed && (opts.log_removed_files || opts.log_kept_files))
+        {
+            root->lines = line_log_open(root->path, root->current_time);
+        }
+        printf("purging\t%s\n", root->path);
+        fflush(stdout);
+    }
+
+    /* Hold the root until everything is queued, so that it cannot finish in the meantime. */
+    __sync_add_and_fetch(&root->pending, 1);
+    __sync_add_and_fetch(&walk_pending, 1);
+
+    w->root = root;
+    w->cost = NULL;
+    w->depth = -1;
+    w->basis = basis_of_path(root->path);
+    w->exempt = EXEMPT_UNKNOWN;
+    /* Nothing above the root is looked at. */
+    w->tag = TAG_NONE;
+    w->tag_above = NULL;
+    w->tag_above_count = 0;
+    if(root->saved_count > 0)
+    {
+        ret = root_requeue(w, root);
+    }
+    else
+    {
+        ret = walk_push(w, root->path, &root->ref, PVFS_READDIR_START, INDEX_MTIME_UNKNOWN, NULL);
+    }
+    w->root = scanning;
+    w->cost = scanning_cost;
+    w->depth = scanning_depth;
+    w->basis = scanning_basis;
+    w->exempt = scanning_exempt;
+    w->tag = scanning_tag;
+    w->tag_above = scanning_tag_above;
+    w->tag_above_count = scanning_tag_above_count;
+    w->handle = scanning_handle;
+
+    walk_done(w, root, ret != 0);
+}
+
+/* Removes the next root waiting for a slot from roots_queue, or returns NULL. */
+struct root_s *roots_queue_take(void)
+{
+    struct root_s *root = NULL;
+
+    pthread_mutex_lock(&roots_lock);
+    if(roots_queue_count > 0)
+    {
+        root = roots_queue[roots_queue_head];
+        roots_queue_head = (roots_queue_head + 1) % roots_count;
+        roots_queue_count--;
+    }
+    pthread_mutex_unlock(&roots_lock);
+
+    return root;
+}
+
+void roots_queue_add(struct root_s *root)
+{
+    pthread_mutex_lock(&roots_lock);
+    roots_queue[(roots_queue_head + roots_queue_count) % roots_count] = root;
+    roots_queue_count++;
+    pthread_mutex_unlock(&roots_lock);
+}
+
+/* Completes the log of a root, once the log writer has written its lines. */
+void root_log_finish(struct root_s *root)
+{
+    log_writer_sync();
+    record_log_close(root->records);
+    root->records = NULL;
+    line_log_close(root->lines);
+    root->lines = NULL;
+    if(opts.max_duration > 0 || opts.deferred_path)
+    {
+        log_kv(root->logp,
+               root->summaryp,
+               "scan_status\t%s\n",
+               root->failed ? "failed" : root->deferred ? "deferred" : "completed");
+    }
+    log_summary(root->logp,
+                root->summaryp,
+                &root->stats,
+                &root->owners,
+                root->current_time,
+                elapsed_seconds(&root->walk_start));
+    owner_table_free(&root->owners);
+    log_close(root->logp, root->summaryp, root->failed ? -1 : 0);
+    root->logp = NULL;
+    root->summaryp = NULL;
+}
+
+/* Starts the next root waiting for a slot, if any, in the given slot. Once --max-duration is over,
+ * the roots still waiting are deferred instead: those that had started get their log completed and
+ * the others are only saved for --deferred, starting from their top level directory. */
+void root_start_next(struct walker_s *w, int slot)
+{
+    struct root_s *root;
+
+    while((root = roots_queue_take()))
+    {
+        if(!roots_deadline_passed())
+        {
+            root_start(w, root, slot);
+            return;
+        }
+
+        root->deferred = 1;
+        if(root->logp)
+        {
+            root_log_finish(root);
+        }
+        else
+        {
+            printf("deferring\t%s\n", root->path);
+            fflush(stdout);
+            if(root->saved_count == 0)
+            {
+                struct walk_item_s item;
+
+                memset(&item, 0, sizeof(item));
+                item.ref = root->ref;
+                item.token = PVFS_READDIR_START;
+                item.mtime = INDEX_MTIME_UNKNOWN;
+                item.root = root;
+                item.path = strdup(root->path);
+                if(!item.path || root_save(root, &item) != 0)
+                {
+                    free(item.path);
+                }
+            }
+        }
+    }
+}
+
+/* Called once nothing is left queued, being scanned or being removed for a root: merges and clears
+ * the walkers' counters of its slot, completes its log and starts the next root in the slot. No
+ * walker touches the slot in the meantime. A root whose slice has ended with directories left is
+ * queued again instead, unless --max-duration is over. */
+void root_finish(struct walker_s *w, struct root_s *root)
+{
+    int i;
+
+    for(i = 0; i < walkers_count; i++)
+    {
+        purge_stats_add(&root->stats, &walkers[i].stats[root->slot]);
+        memset(&walkers[i].stats[root->slot], 0, sizeof(struct purge_stats_s));
+        if(walkers[i].owners)
+        {
+            owner_table_merge(&root->owners, &walkers[i].owners[root->slot]);
+        }
+    }
+
+    if(root->suspended && root->saved_count > 0 && !root->failed)
+    {
+        if(!roots_deadline_passed())
+        {
+            roots_queue_add(root);
+            root_start_next(w, root->slot);
+            return;
+        }
+        root->deferred = 1;
+    }
+
+    root_log_finish(root);
+
+    if(root->failed)
+    {
+        fprintf(stderr, "FAILED\t%s\n", root->path);
+        __sync_add_and_fetch(&roots_failed, 1);
+    }
+    if(!root->deferred)
+    {
+        pthread_mutex_lock(&roots_lock);
+        roots_unfinished--;
+        pthread_mutex_unlock(&roots_lock);
+    }
+
+    root_start_next(w, root->slot);
+}
+
+/* Marks a directory scanned, or a removal completed, waking every walker once the last one is
+ * done. A failed directory aborts the walk, unless several roots are being purged: then only the
+ * rest of its root is skipped. */
+void walk_done(struct walker_s *w, struct root_s *root, int failed)
+{
+    if(failed)
+    {
+        if(roots_multi)
+        {
+            root->failed = 1;
+        }
+        else
+        {
+            walk_aborted = 1;
+        }
+    }
+
+    /* Start the next root before walk_pending may drop to zero. */
+    if(__sync_sub_and_fetch(&root->pending, 1) == 0 && roots_multi)
+    {
+        root_finish(w, root);
+    }
+
+    if(__sync_sub_and_fetch(&walk_pending, 1) == 0 || walk_aborted)
+    {
+        pthread_mutex_lock(&walk_lock);
+        pthread_cond_broadcast(&walk_cond);
+        pthread_mutex_unlock(&walk_lock);
+    }
+}
+
+void *walker_main(void *arg)
+{
+    struct walker_s *w = (struct walker_s *) arg;
+    struct walk_item_s item;
+
+    while(walk_next(w, &item))
+    {
+        int ret = 0;
+
+        if(!item.root->failed && roots_multi && root_suspended(item.root) &&
+           root_save(item.root, &item) == 0)
+        {
+            /* Queued again once the root gets another slice, see root_finish. */
+            walk_account_bytes(-(int64_t) walk_item_bytes(&item));
+            walk_done(w, item.root, 0);
+            continue;
+        }
+
+        if(!item.root->failed)
+        {
+            w->root = item.root;
+            w->cost = item.cost;
+            w->depth = item.depth;
+            w->basis = item.basis;
+            w->exempt = item.exempt;
+            w->tag = item.tag;
+            w->tag_above = item.tag_above;
+            w->tag_above_count = item.tag_above_count;
+            w->handle = item.ref.handle;
+            ret = walk_rdp_and_purge(w, &item);
+        }
+        else
+        {
+            index_dir_free(item.idx);
+        }
+
+        walk_account_bytes(-(int64_t) walk_item_bytes(&item));
+        walk_item_free(&item);
+        if(roots_multi)
+        {
+            /* Its log may be completed as soon as the root is done, see root_log_finish. */
+            log_chunk_submit(&w->log_chunk);
+            log_chunk_submit(&w->rec_chunk);
+        }
+        walk_done(w, item.root, ret != 0);
+    }
+
+    remove_window_wait(w, 1);
+    log_chunk_submit(&w->log_chunk);
+    log_chunk_submit(&w->rec_chunk);
+
+    return NULL;
+}
+
+void purge_stats_add(struct purge_stats_s *dst, struct purge_stats_s *src)
+{
+    dst->rm_bytes += src->rm_bytes;
+    dst->rm_fils += src->rm_fils;
+    dst->frm_bytes += src->frm_bytes;
+    dst->frm_fils += src->frm_fils;
+    dst->kept_bytes += src->kept_bytes;
+    dst->kept_fils += src->kept_fils;
+    dst->lnks += src->lnks;
+    dst->dirs += src->dirs;
+    dst->unknown += src->unknown;
+    dst->sampled_bytes += src->sampled_bytes;
+    dst->sampled_fils += src->sampled_fils;
+    dst->excluded_dirs += src->excluded_dirs;
+    dst->exempt_bytes += src->exempt_bytes;
+    dst->exempt_fils += src->exempt_fils;
+}
+
+/* Adds the counters of every owner of src to dst and frees src. */
+void owner_table_merge(struct owner_table_s *dst, struct owner_table_s *src)
+{
+    struct purge_stats_s *psp;
+    uint64_t i;
+
+    for(i = 0; src->slots && i <= src->mask; i++)
+    {
+        if(src->slots[i].key)
+        {
+            psp = owner_find(dst, src->slots[i].key >> 32, (uint32_t) src->slots[i].key);
+            if(psp)
+            {
+                purge_stats_add(psp, &src->slots[i].stats);
+            }
+        }
+    }
+    owner_table_free(src);
+}
+
+/* Walks the directory tree with opts.threads work stealing walkers. With a single walker, the
+ * calling thread does all of the walking. Every walker's counters are added to pstats once all of
+ * them have finished. */
+int walk_tree(char *path, PVFS_object_ref *dir_refp)
+{
+    struct walk_item_s item;
+    int started = 0;
+    int ret = 0;
+    int i;
+    int j;
+
+    walkers_count = opts.threads;
+    walkers = (struct walker_s *) calloc(walkers_count, sizeof(struct walker_s));
+    if(!walkers)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate %d walkers\n", __func__, walkers_count);
+        return -1;
+    }
+
+    for(i = 0; i < walkers_count; i++)
+    {
+        walkers[i].id = i;
+        walkers[i].depth = -1;
+        pthread_mutex_init(&walkers[i].deque.lock, NULL);
+        /* One set of counters per root being purged at once. */
+        walkers[i].stats = (struct purge_stats_s *) calloc(roots_slots, sizeof(struct purge_stats_s));
+        if(!walkers[i].stats)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate the walker counters\n", __func__);
+            ret = -1;
+            goto cleanup;
+        }
+        if(opts.uid_stats || opts.gid_stats)
+        {
+            walkers[i].owners = (struct owner_table_s *) calloc(roots_slots,
+                                                                sizeof(struct owner_table_s));
+            if(!walkers[i].owners)
+            {
+                fprintf(stderr, "%s: ERROR: could not allocate the owner counters\n", __func__);
+                ret = -1;
+                goto cleanup;
+            }
+        }
+        /* One path buffer per walker, reused for every entry of every directory it scans. */
+        walkers[i].dirent_path = (char *) malloc(PVFS_PATH_MAX);
+        if(!walkers[i].dirent_path)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate dirent_path\n", __func__);
+            ret = -1;
+            goto cleanup;
+        }
+        if(opts.remove_window > 0)
+        {
+            walkers[i].rm_window = calloc(opts.remove_window, sizeof(struct remove_op_s *));
+            walkers[i].rm_op_ids = calloc(opts.remove_window, sizeof(PVFS_sys_op_id));
+            walkers[i].rm_user_ptrs = calloc(opts.remove_window, sizeof(void *));
+            walkers[i].rm_error_codes = calloc(opts.remove_window, sizeof(int));
+            if(!walkers[i].rm_window || !walkers[i].rm_op_ids || !walkers[i].rm_user_ptrs ||
+               !walkers[i].rm_error_codes)
+            {
+                fprintf(stderr, "%s: ERROR: could not allocate the removal window\n", __func__);
+                ret = -1;
+                goto cleanup;
+            }
+        }
+    }
+
+    if(roots_multi)
+    {
+        /* The first walker starts the first roots, the others will steal from it. Every other root
+         * is started by the walker finishing one. */
+        for(i = 0; i < roots_slots; i++)
+        {
+            root_start_next(&walkers[0], i);
+        }
+        goto walk;
+    }
+
+    walkers[0].root = &roots[0];
+    walkers[0].basis = basis_of_path(path);
+    walkers[0].tag = TAG_NONE;
+    checkpoint_root = *dir_refp;
+    checkpoint_last = time(NULL);
+
+    if(checkpoint_items)
+    {
+        /* Resuming, the first walker starts with the directories of the checkpoint. */
+        uint64_t j;
+
+        for(j = 0; j < checkpoint_items_count; j++)
+        {
+            struct walk_item_s *itemp = &checkpoint_items[j];
+
+            walkers[0].basis = itemp->basis;
+            walkers[0].exempt = itemp->exempt;
+            walkers[0].tag = itemp->tag;
+            walkers[0].tag_above = itemp->tag_above;
+            walkers[0].tag_above_count = itemp->tag_above_count;
+            if(itemp->token == PVFS_READDIR_START && itemp->tag == TAG_UNKNOWN)
+            {
+                /* As if pushed by its parent, the last directory of its tag_above. */
+                if(itemp->tag_above_count == 0)
+                {
+                    walkers[0].tag = TAG_NONE;
+                }
+                else
+                {
+                    walkers[0].tag_above_count--;
+                    walkers[0].handle = itemp->tag_above[walkers[0].tag_above_count];
+                }
+            }
+            if(walk_push(&walkers[0], itemp->path, &itemp->ref, itemp->token, itemp->mtime, NULL) != 0)
+            {
+                ret = -1;
+                goto cleanup;
+            }
+        }
+        walkers[0].tag = TAG_NONE;
+        walkers[0].tag_above = NULL;
+        walkers[0].tag_above_count = 0;
+        checkpoint_items_free();
+    }
+    /* The first walker starts with the top level directory, the others will steal from it. */
+    else if(walk_push(&walkers[0], path, dir_refp, PVFS_READDIR_START, INDEX_MTIME_UNKNOWN, NULL) != 0)
+    {
+        ret = -1;
+        goto cleanup;
+    }
+
+walk:
+    if(walkers_count == 1)
+    {
+        walker_main(&walkers[0]);
+        purge_stats_add(&pstats, &walkers[0].stats[0]);
+        if(walkers[0].owners)
+        {
+            owner_table_merge(&powners, &walkers[0].owners[0]);
+        }
+        ret = walk_aborted ? -1 : 0;
+        goto cleanup;
+    }
+
+    for(started = 0; started < walkers_count; started++)
+    {
+        ret = pthread_create(&walkers[started].thread, NULL, walker_main, &walkers[started]);
+        if(ret != 0)
+        {
+            fprintf(stderr,
+                    "%s: ERROR: pthread_create failed for walker %d with ret= %d\n",
+                    __func__,
+                    started,
+                    ret);
+            walk_abort();
+            ret = -1;
+            break;
+        }
+    }
+
+    for(i = 0; i < started; i++)
+    {
+        pthread_join(walkers[i].thread, NULL);
+        purge_stats_add(&pstats, &walkers[i].stats[0]);
+        if(walkers[i].owners)
+        {
+            owner_table_merge(&powners, &walkers[i].owners[0]);
+        }
+    }
+
+    if(walk_aborted)
+    {
+        ret = -1;
+    }
+
+cleanup:
+    for(i = 0; i < walkers_count; i++)
+    {
+        /* Only non-empty after an aborted walk. */
+        while(walk_deque_take(&walkers[i].deque, 0, &item))
+        {
+            walk_account_bytes(-(int64_t) walk_item_bytes(&item));
+            walk_item_free(&item);
+            index_dir_free(item.idx);
+        }
+        free(walkers[i].deque.items);
+        free(walkers[i].stats);
+        for(j = 0; walkers[i].owners && j < roots_slots; j++)
+        {
+            owner_table_free(&walkers[i].owners[j]);
+        }
+        free(walkers[i].owners);
+        free(walkers[i].dirent_path);
+        free(walkers[i].rm_window);
+        free(walkers[i].rm_op_ids);
+        free(walkers[i].rm_user_ptrs);
+        free(walkers[i].rm_error_codes);
+        pthread_mutex_destroy(&walkers[i].deque.lock);
+    }
+    free(walkers);
+    walkers = NULL;
+
+    return ret;
+}
+
+/* The event loop walker (--event-loop N) scans many directories at once from a single thread. Each
+ * directory is a small state machine: it waits on the ready stack for its next readdirplus batch to
+ * be issued, the batch is in flight, the sizes it lacks are fetched (unless --kept-bytes is exact),
+ * then the tags of --exempt-xattr, and the batch is then classified which may queue removals and
+ * newly discovered directories. Up to N nonblocking readdirplus, getattr, geteattr and remove
+ * operations are in flight at any time; PVFS_sys_testsome reports which of them completed.
+ *
+ * Directories and operations wait in per metadata server queues (see struct ev_server_s), which are
+ * all one queue unless --server-inflight is passed. */
+struct ev_dir_s
+{
+    PVFS_object_ref ref;
+    PVFS_ds_position token;             /* Position of the next batch to request. */
+    PVFS_ds_position batch_token;       /* Position rdplus_response was requested from. */
+    PVFS_sysresp_readdirplus rdplus_response;   /* The batch being fetched for or classified. */
+    PVFS_sysresp_readdirplus rdplus_next;       /* The next batch, requested meanwhile. */
+    int busy;                           /* rdplus_response is not classified yet. */
+    int next_ready;                     /* rdplus_next is listed and waits for rdplus_response. */
+    int prefetched;                     /* The next batch was requested before classifying. */
+    char *path;
+    int removes_pending;                /* Queued or in flight removals of entries of this dir. */
+    int fetches_pending;                /* Queued or in flight fetches of the current batch. */
+    int listed;                         /* PVFS_ITERATE_END was reached. */
+    int server;                         /* Index of the metadata server owning the directory. */
+    PVFS_time basis;                    /* Removal basis time of its files, see basis_find. */
+    exempt_type exempt;                 /* See exempt_check. */
+    tag_type tag;                       /* See tag_wanted. */
+    PVFS_handle *tag_above;             /* See tag_inherit. */
+    int tag_above_count;
+    int tag_settling;                   /* The batch fetches its chain, see tag_claim. */
+    char *tagged;                       /* Files of the batch exempt by --exempt-xattr, or NULL. */
+    struct ev_dir_s *next;              /* Link of the ready stack. */
+};
+
+typedef enum
+{
+    EV_OP_READDIRPLUS,
+    EV_OP_GETATTR,
+    EV_OP_REMOVE,
+    EV_OP_GETEATTR,
+    EV_OP_LOOKUP,
+    EV_OP_TYPES                         /* Number of operation types. */
+} ev_op_type;
+
+/* An operation queued or in flight, also used as the user pointer of the PVFS_isys_* call. */
+struct ev_op_s
+{
+    ev_op_type type;
+    PVFS_sys_op_id op_id;
+    struct ev_dir_s *dir;
+    PVFS_size size;                     /* Removals only, as are owner and group. */
+    PVFS_uid owner;
+    PVFS_gid group;
+    int index;                          /* The entry of dir's batch, see also tag_handle. */
+    PVFS_sysresp_getattr getattr_response;
+    PVFS_sysresp_geteattr geteattr_response;    /* Geteattrs only, as are the fields below. */
+    PVFS_ds_keyval eattr_key;
+    PVFS_ds_keyval eattr_val;
+    PVFS_error eattr_err;
+    char eattr_value[TAG_VALUE_MAX];
+    PVFS_sysresp_lookup lookup_response;        /* Lookups of the marker only. */
+    int server;                         /* Index of the metadata server the operation is sent to. */
+    struct timespec issued;             /* With --adaptive only. */
+    struct ev_op_s *next;               /* Link of the operation queue. */
+    char name[];                        /* Removals only, the entry to remove from dir. */
+};
+
+/* OrangeFS spreads handles over the metadata servers by handle range. With --server-inflight, every
+ * directory and operation is queued for the metadata server owning its handle, as found by
+ * PVFS_mgmt_map_handle, and at most opts.server_inflight operations are in flight per server. The
+ * servers take turns, one operation each, when operations are issued so that the scan keeps every
+ * metadata server busy rather than just the one owning the part of the tree being scanned. */
+struct ev_server_s
+{
+    PVFS_BMI_addr_t addr;
+    struct ev_dir_s *ready;             /* Directories waiting for their next readdirplus. */
+    struct ev_op_s *op_head;            /* Getattrs and removals waiting to be issued. */
+    struct ev_op_s *op_tail;
+    int inflight;
+};
+
+struct ev_loop_s
+{
+    struct ev_server_s *servers;
+    int servers_count;
+    int server_next;                    /* Server taking the first turn the next time. */
+    uint64_t ready_count;               /* Directories of every server's ready stack. */
+    uint64_t op_queued;                 /* Operations of every server's queue. */
+    struct ev_op_s **inflight;          /* Operations issued and not yet completed. */
+    int inflight_count;
+    int inflight_max;
+    int rm_inflight;                    /* Removals among the operations in flight. */
+    int failed;
+    uint64_t size_sample;               /* See dirent_needs_size. */
+    char *dirent_path;                  /* PVFS_PATH_MAX bytes. */
+    int64_t rate_wait_ns;               /* Set when --rate held back issuing, see ev_rate_take. */
+    int throttled;
+    struct timespec throttled_since;
+    int window;                         /* Operations allowed in flight, see ev_adapt. */
+    int slow_start;
+    int epoch_count;                    /* Operations completed in the current epoch. */
+    double epoch_latency[EV_OP_TYPES];  /* Seconds, summed over the epoch's operations. */
+    int epoch_ops[EV_OP_TYPES];
+    double baseline[EV_OP_TYPES];       /* Lowest mean latency of an epoch so far, 0 if none. */
+    double ratio;                       /* Latency relative to the baseline in the last epoch. */
+    struct timespec started;
+    double sampled;                     /* Seconds since started of the last concurrency_sample. */
+    struct log_chunk_s *log_chunk;      /* See log_line. */
+    struct log_chunk_s *rec_chunk;      /* See log_record. */
+};
+
+void ev_dir_push(struct ev_loop_s *ev, struct ev_dir_s *dir)
+{
+    struct ev_server_s *srv = &ev->servers[dir->server];
+
+    /* A stack keeps the scan depth first, which keeps the number of queued directories low. */
+    dir->next = srv->ready;
+    srv->ready = dir;
+    ev->ready_count++;
+}
+
+/* Returns the index of the metadata server owning handle, 0 without --server-inflight. */
+int ev_server_of(struct ev_loop_s *ev, PVFS_fs_id fs_id, PVFS_handle handle)
+{
+    PVFS_BMI_addr_t addr;
+    int i;
+
+    if(ev->servers_count == 1 || PVFS_mgmt_map_handle(fs_id, handle, &addr) < 0)
+    {
+        return 0;
+    }
+
+    for(i = 0; i < ev->servers_count; i++)
+    {
+        if(ev->servers[i].addr == addr)
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+/* Sets up one queue per metadata server of the file system with --server-inflight, or a single
+ * queue otherwise. */
+int ev_servers_init(struct ev_loop_s *ev, PVFS_fs_id fs_id)
+{
+    PVFS_BMI_addr_t *addrs = NULL;
+    int count = 1;
+    int ret = 0;
+    int i;
+
+    if(opts.server_inflight > 0)
+    {
+        ret = PVFS_mgmt_count_servers(fs_id, PVFS_MGMT_META_SERVER, &count);
+        if(ret < 0 || count < 1)
+        {
+            PVFS_perror("PVFS_mgmt_count_servers", ret);
+            return -1;
+        }
+
+        addrs = (PVFS_BMI_addr_t *) calloc(count, sizeof(PVFS_BMI_addr_t));
+        if(!addrs)
+        {
+            fprintf(stderr, "%s: ERROR: could not allocate %d server addresses\n", __func__, count);
+            return -1;
+        }
+
+        ret = PVFS_mgmt_get_server_array(fs_id, PVFS_MGMT_META_SERVER, addrs, &count);
+        if(ret < 0 || count < 1)
+        {
+            PVFS_perror("PVFS_mgmt_get_server_array", ret);
+            free(addrs);
+            return -1;
+        }
+    }
+
+    ev->servers = (struct ev_server_s *) calloc(count, sizeof(struct ev_server_s));
+    if(!ev->servers)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate %d servers\n", __func__, count);
+        free(addrs);
+        return -1;
+    }
+    ev->servers_count = count;
+
+    for(i = 0; addrs && i < count; i++)
+    {
+        ev->servers[i].addr = addrs[i];
+    }
+    free(addrs);
+
+    return 0;
+}
+
+/* Queues the directory at path, a subdirectory of parent or the top level directory when parent is
+ * NULL. */
+struct ev_dir_s *ev_dir_new(struct ev_loop_s *ev,
+                            char *path,
+                            PVFS_object_ref ref,
+                            PVFS_time parent_basis,
+                            exempt_type parent_exempt,
+                            struct ev_dir_s *parent)
+{
+    struct ev_dir_s *dir = (struct ev_dir_s *) calloc(1, sizeof(struct ev_dir_s));
+    size_t path_len = strlen(path);
+
+    if(dir)
+    {
+        dir->path = (char *) malloc(path_len + 1);
+    }
+    if(!dir || !dir->path)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate directory path = %s\n", __func__, path);
+        free(dir);
+        return NULL;
+    }
+    if(!parent)
+    {
+        /* Nothing above the top level directory is looked at. */
+        dir->tag = TAG_UNKNOWN;
+    }
+    else if(tag_inherit(parent->tag,
+                        parent->tag_above,
+                        parent->tag_above_count,
+                        parent->ref.handle,
+                        &dir->tag,
+                        &dir->tag_above,
+                        &dir->tag_above_count) != 0)
+    {
+        free(dir->path);
+        free(dir);
+        return NULL;
+    }
+
+    memcpy(dir->path, path, path_len);
+    dir->path[path_len] = 0;
+    dir->ref = ref;
+    dir->token = PVFS_READDIR_START;
+    dir->server = ev_server_of(ev, ref.fs_id, ref.handle);
+    dir->basis = basis_find(ref.handle, parent_basis);
+    dir->exempt = opts.marker_subtree && parent_exempt >= EXEMPT_MARKED ?
+                  EXEMPT_INHERITED : EXEMPT_UNKNOWN;
+    walk_account_bytes(sizeof(struct ev_dir_s) + path_len + 1 +
+                       dir->tag_above_count * sizeof(PVFS_handle));
+    ev_dir_push(ev, dir);
+
+    return dir;
+}
+
+/* Frees a directory once it has been listed, its last batch classified and all of its removals
+ * have completed. */
+void ev_dir_put(struct ev_dir_s *dir)
+{
+    if(dir->listed && !dir->busy && dir->removes_pending == 0)
+    {
+        if(dir->next_ready)
+        {
+            /* Only after a failure. */
+            int i;
+
+            for(i = 0; i < dir->rdplus_next.pvfs_dirent_outcount; i++)
+            {
+                PVFS_util_release_sys_attr(&dir->rdplus_next.attr_array[i]);
+            }
+            if(dir->rdplus_next.pvfs_dirent_outcount)
+            {
+                release_rdplus_response(&dir->rdplus_next);
+            }
+        }
+        walk_account_bytes(-(int64_t) (sizeof(struct ev_dir_s) + strlen(dir->path) + 1 +
+                                       dir->tag_above_count * sizeof(PVFS_handle)));
+        if(dir->tagged)
+        {
+            walk_account_bytes(-PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS);
+        }
+        free(dir->tagged);
+        free(dir->tag_above);
+        free(dir->path);
+        free(dir);
+    }
+}
+
+int ev_issue(struct ev_loop_s *ev, struct ev_op_s *op)
+{
+    int ret;
+
+    if(op->type == EV_OP_READDIRPLUS)
+    {
+        memset(&op->dir->rdplus_next, 0, sizeof(PVFS_sysresp_readdirplus));
+        ret = PVFS_isys_readdirplus(op->dir->ref,
+                                    op->dir->token,
+                                    PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS,
+                                    &creds,
+                                    rdplus_attrmask,
+                                    &op->dir->rdplus_next,
+                                    &op->op_id,
+                                    NULL,
+                                    op);
+    }
+    else if(op->type == EV_OP_GETATTR)
+    {
+        PVFS_object_ref ref;
+
+        ref.fs_id = op->dir->ref.fs_id;
+        ref.handle = op->dir->rdplus_response.dirent_array[op->index].handle;
+        memset(&op->getattr_response, 0, sizeof(PVFS_sysresp_getattr));
+        ret = PVFS_isys_getattr(ref,
+                                PVFS_ATTR_SYS_SIZE,
+                                &creds,
+                                &op->getattr_response,
+                                &op->op_id,
+                                NULL,
+                                op);
+    }
+    else if(op->type == EV_OP_GETEATTR)
+    {
+        PVFS_object_ref ref = op->dir->ref;
+
+        ref.handle = tag_handle(&op->dir->rdplus_response,
+                                op->dir->ref.handle,
+                                op->dir->tag_above,
+                                op->dir->tag_above_count,
+                                op->index);
+        op->eattr_key.buffer = opts.exempt_xattr;
+        op->eattr_key.buffer_sz = strlen(opts.exempt_xattr) + 1;
+        op->eattr_val.buffer = op->eattr_value;
+        op->eattr_val.buffer_sz = TAG_VALUE_MAX;
+        op->eattr_val.read_sz = 0;
+        op->eattr_err = 0;
+        op->geteattr_response.val_array = &op->eattr_val;
+        op->geteattr_response.err_array = &op->eattr_err;
+        ret = PVFS_isys_geteattr_list(ref,
+                                      &creds,
+                                      1,
+                                      &op->eattr_key,
+                                      &op->geteattr_response,
+                                      &op->op_id,
+                                      NULL,
+                                      op);
+    }
+    else if(op->type == EV_OP_LOOKUP)
+    {
+        memset(&op->lookup_response, 0, sizeof(PVFS_sysresp_lookup));
+        ret = PVFS_isys_ref_lookup(op->dir->ref.fs_id,
+                                   opts.marker,
+                                   op->dir->ref,
+                                   &creds,
+                                   &op->lookup_response,
+                                   PVFS2_LOOKUP_LINK_NO_FOLLOW,
+                                   &op->op_id,
+                                   NULL,
+                                   op);
+    }
+    else
+    {
+        ret = PVFS_isys_remove(op->name, op->dir->ref, &creds, &op->op_id, NULL, op);
+    }
+
+    if(ret < 0)
+    {
+        return ret;
+    }
+
+    ev->inflight[ev->inflight_count++] = op;
+    ev->servers[op->server].inflight++;
+    if(opts.adaptive)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &op->issued);
+    }
+    if(op->type == EV_OP_REMOVE)
+    {
+        ev->rm_inflight++;
+    }
+    return 0;
+}
+
+/* Appends an operation to its server's queue of getattrs and removals waiting to be issued. */
+void ev_queue(struct ev_loop_s *ev, struct ev_op_s *op)
+{
+    struct ev_server_s *srv = &ev->servers[op->server];
+
+    op->next = NULL;
+    if(srv->op_tail)
+    {
+        srv->op_tail->next = op;
+    }
+    else
+    {
+        srv->op_head = op;
+    }
+    srv->op_tail = op;
+    ev->op_queued++;
+}
+
+int ev_batch_start(struct ev_loop_s *ev, struct ev_dir_s *dir);
+
+/* Classifies a completed readdirplus batch of dir, then starts on the next batch if it has already
+ * been listed. */
+int ev_readdirplus_done(struct ev_loop_s *ev, struct ev_dir_s *dir)
+{
+    PVFS_sysresp_readdirplus *rdplus_responsep = &dir->rdplus_response;
+    PVFS_object_ref dirent_ref;
+    size_t dir_len = strlen(dir->path);
+    int requeued = 0;
+    int ret = 0;
+    int i;
+
+    if(dir->tag_settling)
+    {
+        /* Its chain has been fetched, see ev_fetch_chain. */
+        if(dir->tag == TAG_UNKNOWN)
+        {
+            dir->tag = tag_settle(dir->tag_above, dir->tag_above_count, dir->ref.handle, 0);
+        }
+        dir->tag_settling = 0;
+    }
+
+    /* Only subdirectories need their full path, see dirent_path_fill. */
+    memcpy(ev->dirent_path, dir->path, dir_len);
+    ev->dirent_path[dir_len] = '/';
+
+    dirent_ref.fs_id = dir->ref.fs_id;
+
+    if(rdplus_responsep->token == PVFS_ITERATE_END)
+    {
+        dir->listed = 1;
+    }
+    else if(dir->prefetched)
+    {
+        /* The next batch was requested by ev_batch_start. */
+        requeued = 1;
+    }
+    else if(!dir->listed && walk_over_budget())
+    {
+        /* Directories are pushed on a stack, so this directory is only resumed after the
+         * subdirectories found in this batch have been scanned when the memory budget has been
+         * exceeded (see walk_over_budget). Otherwise it is resumed right away. */
+        ev_dir_push(ev, dir);
+        requeued = 1;
+    }
+
+    for(i = 0; i < rdplus_responsep->pvfs_dirent_outcount && ret == 0; i++)
+    {
+        struct dirent_rec_s rec;
+        struct ev_op_s *op;
+        size_t name_len;
+
+        dirent_record(&rec,
+                      dir->basis,
+                      dir->exempt >= EXEMPT_MARKED || dir->tag == TAG_EXEMPT ||
+                      (dir->tagged && dir->tagged[i]),
+                      dir->path,
+                      &rdplus_responsep->dirent_array[i],
+                      &rdplus_responsep->attr_array[i]);
+        if(roots[0].records)
+        {
+            log_record(&ev->rec_chunk,
+                       roots[0].records,
+                       &rec,
+                       dir->ref.handle,
+                       &rdplus_responsep->attr_array[i]);
+        }
+
+        switch(rec.cls)
+        {
+            case DIRENT_REMOVE:
+                if(opts.log_removed_files)
+                {
+                    log_line(&ev->log_chunk,
+                             &roots[0],
+                             'R',
+                             dir->path,
+                             dir_len,
+                             rec.name,
+                             rec.rule);
+                }
+
+                if(opts.dry_run)
+                {
+                    account_removal(&pstats, &powners, rec.owner, rec.group, NULL, rec.size, 0);
+                    break;
+                }
+
+                /* The removal is only issued later, it needs its own copy of the name. */
+                name_len = strlen(rec.name);
+                op = (struct ev_op_s *) malloc(sizeof(struct ev_op_s) + name_len + 1);
+                if(!op)
+                {
+                    fprintf(stderr, "%s: ERROR: could not queue removal\n", __func__);
+                    ret = -1;
+                    break;
+                }
+                op->type = EV_OP_REMOVE;
+                op->dir = dir;
+                op->size = rec.size;
+                op->owner = rec.owner;
+                op->group = rec.group;
+                op->server = ev_server_of(ev, dir->ref.fs_id, rec.handle);
+                memcpy(op->name, rec.name, name_len + 1);
+                ev_queue(ev, op);
+                dir->removes_pending++;
+                break;
+
+            case DIRENT_KEEP:
+                if(opts.log_kept_files)
+                {
+                    log_line(&ev->log_chunk,
+                             &roots[0],
+                             'K',
+                             dir->path,
+                             dir_len,
+                             rec.name,
+                             rec.rule);
+                }
+
+                account_kept(&pstats, &powners, &rdplus_responsep->attr_array[i]);
+                break;
+
+            case DIRENT_EXEMPT:
+                if(opts.log_kept_files)
+                {
+                    log_line(&ev->log_chunk,
+                             &roots[0],
+                             'K',
+                             dir->path,
+                             dir_len,
+                             rec.name,
+                             rec.rule);
+                }
+
+                account_exempt(&pstats, &powners, rec.owner, rec.group, rec.size);
+                break;
+
+            case DIRENT_DIR:
+                account_other(&pstats, &powners, &rdplus_responsep->attr_array[i], rec.cls);
+                dirent_ref.handle = rec.handle;
+                if(!dirent_path_fill(ev->dirent_path, dir_len, &rec))
+                {
+                    ret = -1;
+                }
+                else if(exclude_match(ev->dirent_path))
+                {
+                    pstats.excluded_dirs++;
+                }
+                else if(!ev_dir_new(ev,
+                                    ev->dirent_path,
+                                    dirent_ref,
+                                    dir->basis,
+                                    dir->exempt,
+                                    dir))
+                {
+                    ret = -1;
+                }
+                break;
+
+            case DIRENT_LNK:
+                account_other(&pstats, &powners, &rdplus_responsep->attr_array[i], rec.cls);
+                break;
+
+            default:
+                fprintf(stderr,
+                        "%s: ERROR: UNRECOGNIZED DIRENT TYPE at path: %s/%s\n",
+                        __func__,
+                        dir->path,
+                        rec.name);
+                account_other(&pstats, &powners, &rdplus_responsep->attr_array[i], rec.cls);
+        }
+    }
+
+    for(i = 0; i < rdplus_responsep->pvfs_dirent_outcount; i++)
+    {
+        PVFS_util_release_sys_attr(&rdplus_responsep->attr_array[i]);
+    }
+
+    if(rdplus_responsep->pvfs_dirent_outcount)
+    {
+        release_rdplus_response(rdplus_responsep);
+    }
+
+    if(!dir->listed && !requeued)
+    {
+        ev_dir_push(ev, dir);
+    }
+
+    dir->busy = 0;
+    dir->prefetched = 0;
+    if(dir->next_ready && ret == 0)
+    {
+        dir->next_ready = 0;
+        ret = ev_batch_start(ev, dir);
+    }
+
+    return ret;
+}
+
+/* Records the tag fetched for handle (see tag_publish) and goes on with the batch of each directory
+ * that waited for it once it was its last fetch. */
+int ev_tag_publish(struct ev_loop_s *ev, PVFS_handle handle, int exempts)
+{
+    struct tag_wait_s *wait = tag_publish(handle, exempts);
+    int ret = 0;
+
+    while(wait)
+    {
+        struct tag_wait_s *next = wait->next;
+        struct ev_dir_s *dir = wait->dir;
+
+        if(--dir->fetches_pending == 0)
+        {
+            if(ev_readdirplus_done(ev, dir) != 0)
+            {
+                ret = -1;
+            }
+            ev_dir_put(dir);
+        }
+        free(wait);
+        wait = next;
+    }
+
+    return ret;
+}
+
+/* Queues a geteattr for each directory of the chain of dir (see tag_claim) fetched by no one yet,
+ * and has dir wait for those other directories are fetching, fetches_pending counting both. The tag
+ * of dir is settled when its batch is classified. */
+int ev_fetch_chain(struct ev_loop_s *ev, struct ev_dir_s *dir)
+{
+    char *claimed = (char *) malloc(dir->tag_above_count + 1);
+    int ret = 0;
+    int i;
+
+    if(!claimed)
+    {
+        fprintf(stderr,
+                "%s: WARNING: could not allocate the chain, exempting path = %s\n",
+                __func__,
+                dir->path);
+        dir->tag = TAG_EXEMPT;
+        return 0;
+    }
+
+    dir->tag = tag_claim(dir->tag_above, dir->tag_above_count, dir->ref.handle, dir->path, claimed);
+    if(dir->tag == TAG_EXEMPT)
+    {
+        free(claimed);
+        return 0;
+    }
+    dir->tag_settling = 1;
+
+    for(i = 0; i <= dir->tag_above_count; i++)
+    {
+        int index = -1 - (dir->tag_above_count - i);
+        PVFS_handle handle = tag_handle(&dir->rdplus_response,
+                                        dir->ref.handle,
+                                        dir->tag_above,
+                                        dir->tag_above_count,
+                                        index);
+        struct ev_op_s *op;
+        int waits;
+
+        if(!claimed[i])
+        {
+            waits = tag_wait_add(handle, dir);
+            if(waits < 0)
+            {
+                tag_warn(dir->path, &dir->rdplus_response, index);
+                dir->tag = TAG_EXEMPT;
+            }
+            else
+            {
+                dir->fetches_pending += waits;
+            }
+            continue;
+        }
+
+        op = (struct ev_op_s *) malloc(sizeof(struct ev_op_s));
+        if(!op)
+        {
+            tag_warn(dir->path, &dir->rdplus_response, index);
+            if(ev_tag_publish(ev, handle, 1) != 0)
+            {
+                ret = -1;
+            }
+            continue;
+        }
+        op->type = EV_OP_GETEATTR;
+        op->dir = dir;
+        op->index = index;
+        op->server = ev_server_of(ev, dir->ref.fs_id, handle);
+        ev_queue(ev, op);
+        dir->fetches_pending++;
+    }
+    free(claimed);
+
+    return ret;
+}
+
+/* Queues a geteattr for each file of the batch of dir listed by tag_wanted, along with the chain of
+ * dir while its tag is unknown (see ev_fetch_chain), once the marker has been checked for (see
+ * ev_fetch_marker), or classifies the batch right away when there is none. */
+int ev_fetch_tags(struct ev_loop_s *ev, struct ev_dir_s *dir)
+{
+    PVFS_sysresp_readdirplus *rdplus_responsep = &dir->rdplus_response;
+    int indexes[PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS];
+    int wanted;
+    int i;
+
+    if(dir->tagged)
+    {
+        memset(dir->tagged, 0, PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS);
+    }
+    wanted = tag_wanted(rdplus_responsep, dir->basis, dir->path, dir->exempt, dir->tag, indexes);
+    if(wanted > 0 && !dir->tagged)
+    {
+        dir->tagged = (char *) calloc(PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS, 1);
+        if(!dir->tagged)
+        {
+            fprintf(stderr,
+                    "%s: ERROR: could not allocate tags of path = %s\n",
+                    __func__,
+                    dir->path);
+            return -1;
+        }
+        walk_account_bytes(PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS);
+    }
+
+    if(wanted > 0 && dir->tag == TAG_UNKNOWN && ev_fetch_chain(ev, dir) != 0)
+    {
+        return -1;
+    }
+
+    /* Nothing is fetched under a tagged directory. */
+    for(i = 0; i < wanted && dir->tag != TAG_EXEMPT; i++)
+    {
+        struct ev_op_s *op = (struct ev_op_s *) malloc(sizeof(struct ev_op_s));
+
+        if(!op)
+        {
+            tag_warn(dir->path, rdplus_responsep, indexes[i]);
+            dir->tagged[indexes[i]] = 1;
+            continue;
+        }
+        op->type = EV_OP_GETEATTR;
+        op->dir = dir;
+        op->index = indexes[i];
+        op->server = ev_server_of(ev,
+                                  dir->ref.fs_id,
+                                  rdplus_responsep->dirent_array[indexes[i]].handle);
+        ev_queue(ev, op);
+        dir->fetches_pending++;
+    }
+
+    if(dir->fetches_pending == 0)
+    {
+        return ev_readdirplus_done(ev, dir);
+    }
+
+    return 0;
+}
+
+/* Records the tag fetched by a geteattr, the lookup having failed with error if negative, and
+ * classifies the batch of dir once it was the last fetch of the batch. */
+int ev_geteattr_done(struct ev_loop_s *ev, struct ev_op_s *op, int error)
+{
+    struct ev_dir_s *dir = op->dir;
+    int exempts;
+    int ret = 0;
+
+    if(error >= 0)
+    {
+        error = op->eattr_err;
+    }
+    exempts = tag_exempts(error, &op->eattr_val);
+    if(error < 0 && exempts)
+    {
+        tag_warn(dir->path, &dir->rdplus_response, op->index);
+    }
+
+    if(op->index < 0)
+    {
+        ret = ev_tag_publish(ev,
+                             tag_handle(&dir->rdplus_response,
+                                        dir->ref.handle,
+                                        dir->tag_above,
+                                        dir->tag_above_count,
+                                        op->index),
+                             exempts);
+    }
+    else
+    {
+        dir->tagged[op->index] = exempts;
+    }
+
+    if(--dir->fetches_pending == 0 && ev_readdirplus_done(ev, dir) != 0)
+    {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Releases the batch of dir, which will never be classified, with its last fetch. Only after a
+ * failure. */
+void ev_fetch_abandon(struct ev_dir_s *dir)
+{
+    if(--dir->fetches_pending == 0)
+    {
+        int i;
+
+        for(i = 0; i < dir->rdplus_response.pvfs_dirent_outcount; i++)
+        {
+            PVFS_util_release_sys_attr(&dir->rdplus_response.attr_array[i]);
+        }
+        release_rdplus_response(&dir->rdplus_response);
+        dir->listed = 1;
+        dir->busy = 0;
+    }
+    ev_dir_put(dir);
+}
+
+/* Queues a lookup of the marker in dir when its batch leaves exempt_scan unsettled. The lookup goes
+ * along with the getattrs of the batch, fetches_pending counting both, since only the tags depend
+ * on its outcome. */
+void ev_fetch_marker(struct ev_loop_s *ev, struct ev_dir_s *dir)
+{
+    struct ev_op_s *op;
+
+    if(!exempt_scan(&dir->exempt, dir->batch_token, &dir->rdplus_response))
+    {
+        return;
+    }
+
+    op = (struct ev_op_s *) malloc(sizeof(struct ev_op_s));
+    if(!op)
+    {
+        fprintf(stderr,
+                "%s: WARNING: could not look for the marker, keeping the files of path = %s\n",
+                __func__,
+                dir->path);
+        dir->exempt = EXEMPT_MARKED;
+        return;
+    }
+    op->type = EV_OP_LOOKUP;
+    op->dir = dir;
+    op->index = -1;
+    op->server = dir->server;
+    ev_queue(ev, op);
+    dir->fetches_pending++;
+}
+
+/* Settles the exemption of dir from its lookup of the marker, which failed with error if negative,
+ * and goes on with the batch of dir once it was its last fetch. */
+int ev_lookup_done(struct ev_loop_s *ev, struct ev_op_s *op, int error)
+{
+    struct ev_dir_s *dir = op->dir;
+
+    exempt_lookup_done(&dir->exempt, dir->path, "PVFS_isys_ref_lookup", error);
+
+    if(--dir->fetches_pending == 0)
+    {
+        return ev_fetch_tags(ev, dir);
+    }
+
+    return 0;
+}
+
+/* Queues a getattr for each size the batch of dir lacks (see dirent_needs_size), or classifies the
+ * batch right away when it lacks none. */
+int ev_fetch_sizes(struct ev_loop_s *ev, struct ev_dir_s *dir)
+{
+    PVFS_sysresp_readdirplus *rdplus_responsep = &dir->rdplus_response;
+    int i;
+
+    for(i = 0; i < rdplus_responsep->pvfs_dirent_outcount; i++)
+    {
+        struct ev_op_s *op;
+
+        if(!dirent_needs_size(&rdplus_responsep->attr_array[i],
+                              dir->basis,
+                              dir->path,
+                              rdplus_responsep->dirent_array[i].d_name,
+                              &ev->size_sample))
+        {
+            continue;
+        }
+
+        op = (struct ev_op_s *) malloc(sizeof(struct ev_op_s));
+        if(!op)
+        {
+            /* Leave the size at 0, as for a failed getattr. */
+            fprintf(stderr,
+                    "%s: WARNING: could not fetch the size of path = %s/%s\n",
+                    __func__,
+                    dir->path,
+                    rdplus_responsep->dirent_array[i].d_name);
+            continue;
+        }
+        op->type = EV_OP_GETATTR;
+        op->dir = dir;
+        op->index = i;
+        op->server = ev_server_of(ev, dir->ref.fs_id, rdplus_responsep->dirent_array[i].handle);
+        ev_queue(ev, op);
+        dir->fetches_pending++;
+    }
+
+    if(dir->fetches_pending == 0)
+    {
+        return ev_fetch_tags(ev, dir);
+    }
+
+    return 0;
+}
+
+/* Starts on the batch of dir just listed into rdplus_next, or leaves it for ev_readdirplus_done
+ * while the previous batch is not classified yet. When the batch has to wait for fetches, the
+ * directory is pushed for its next batch right away so that its readdirplus is in flight along with
+ * them. */
+int ev_batch_start(struct ev_loop_s *ev, struct ev_dir_s *dir)
+{
+    int ret;
+
+    if(dir->busy)
+    {
+        dir->next_ready = 1;
+        return 0;
+    }
+
+    dir->rdplus_response = dir->rdplus_next;
+    dir->batch_token = dir->token;
+    dir->busy = 1;
+    if(dir->rdplus_response.token != PVFS_ITERATE_END)
+    {
+        dir->token = dir->rdplus_response.token;
+    }
+
+    ev_fetch_marker(ev, dir);
+    if(opts.kept_bytes_mode != KEPT_BYTES_EXACT)
+    {
+        ret = ev_fetch_sizes(ev, dir);
+    }
+    else if(dir->fetches_pending == 0)
+    {
+        ret = ev_fetch_tags(ev, dir);
+    }
+    else
+    {
+        ret = 0;
+    }
+
+    if(ret == 0 && dir->busy && !dir->listed &&
+       dir->rdplus_response.token != PVFS_ITERATE_END)
+    {
+        ev_dir_push(ev, dir);
+        dir->prefetched = 1;
+    }
+
+    return ret;
+}
+
+/* Records the size fetched by a getattr, or the error it failed with, and goes on with the batch of
+ * dir once it was the last getattr of the batch. */
+int ev_getattr_done(struct ev_loop_s *ev, struct ev_op_s *op, int error)
+{
+    struct ev_dir_s *dir = op->dir;
+    PVFS_sys_attr *attrp = &dir->rdplus_response.attr_array[op->index];
+
+    if(error < 0)
+    {
+        fprintf(stderr,
+                "%s: WARNING: could not fetch the size of path = %s/%s\n",
+                __func__,
+                dir->path,
+                dir->rdplus_response.dirent_array[op->index].d_name);
+    }
+    else
+    {
+        attrp->size = op->getattr_response.attr.size;
+        attrp->mask |= PVFS_ATTR_SYS_SIZE;
+        PVFS_util_release_sys_attr(&op->getattr_response.attr);
+    }
+
+    if(--dir->fetches_pending == 0)
+    {
+        return ev_fetch_tags(ev, dir);
+    }
+
+    return 0;
+}
+
+/* Logs the event loop's concurrency, at most once per second unless force is set. */
+void ev_log_concurrency(struct ev_loop_s *ev, int force)
+{
+    double now = elapsed_seconds(&ev->started);
+
+    if(force || now - ev->sampled >= 1.0)
+    {
+        fprintf(logp, "concurrency_sample\t%.3f\t%d\t%.3f\n", now, ev->window, ev->ratio);
+        ev->sampled = now;
+    }
+}
+
+/* Adds the latency of a completed operation to the current epoch and, once the epoch has seen as
+ * many operations as are allowed in flight, adjusts ev->window: additive increase (multiplicative
+ * during the initial slow start) while latency stays near the baseline, multiplicative decrease
+ * once it climbs. The baseline of each kind of operation is the lowest mean latency of an epoch
+ * rather than of a single operation, which a lucky cache hit would skew. */
+void ev_adapt(struct ev_loop_s *ev, struct ev_op_s *op)
+{
+    double ratio_sum = 0.0;
+    int ops = 0;
+    int t;
+
+    ev->epoch_latency[op->type] += elapsed_seconds(&op->issued);
+    ev->epoch_ops[op->type]++;
+
+    if(++ev->epoch_count < ev->window)
+    {
+        return;
+    }
+
+    for(t = 0; t < EV_OP_TYPES; t++)
+    {
+        double mean;
+
+        if(ev->epoch_ops[t] == 0)
+        {
+            continue;
+        }
+
+        mean = ev->epoch_latency[t] / ev->epoch_ops[t];
+        if(ev->baseline[t] == 0.0 || mean < ev->baseline[t])
+        {
+            ev->baseline[t] = mean < ADAPTIVE_BASELINE_FLOOR ? ADAPTIVE_BASELINE_FLOOR : mean;
+        }
+        ratio_sum += mean / ev->baseline[t] * ev->epoch_ops[t];
+        ops += ev->epoch_ops[t];
+
+        ev->epoch_latency[t] = 0.0;
+        ev->epoch_ops[t] = 0;
+    }
+    ev->epoch_count = 0;
+    ev->ratio = ratio_sum / ops;
+
+    if(ev->ratio > ADAPTIVE_DECREASE_RATIO)
+    {
+        ev->window = ev->window > 1 ? ev->window / 2 : 1;
+        ev->slow_start = 0;
+    }
+    else if(ev->ratio < ADAPTIVE_INCREASE_RATIO)
+    {
+        ev->window = ev->slow_start ? ev->window * 2 : ev->window + 1;
+        if(ev->window > ev->inflight_max)
+        {
+            ev->window = ev->inflight_max;
+        }
+    }
+
+    ev_log_concurrency(ev, 0);
+}
+
+/* rate_limit_take for the event loop, which must not sleep while operations are in flight. Returns
+ * 0 if an operation may be issued. Otherwise ev->rate_wait_ns tells when to try again, and the time
+ * until an operation is issued again is accounted for as throttled. */
+int ev_rate_take(struct ev_loop_s *ev)
+{
+    int64_t wait_ns = rate_limit_take();
 
-    if(!path || !dir_refp)
+    if(wait_ns > 0)
     {
-        fprintf(stderr,
-                "%s: ERROR: invalid arguments passed to the walk_rdp_and_purge function: "
-                "path = %s\n",
-                __func__,
-                path);
+        if(!ev->throttled)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ev->throttled_since);
+            ev->throttled = 1;
+        }
+        ev->rate_wait_ns = wait_ns;
         return -1;
     }
 
-    /* Allocate space on the heap for storing dirents of the parent directory */
-    dir_len = strlen(path);
-    dirent_path = (char *) calloc(1, PVFS_PATH_MAX);
-    strncpy(dirent_path, path, PVFS_PATH_MAX - 1);
+    if(ev->throttled)
+    {
+        __sync_add_and_fetch(&rate_throttled_ns,
+                             (uint64_t) (elapsed_seconds(&ev->throttled_since) * 1000000000.0));
+        ev->throttled = 0;
+    }
+    return 0;
+}
 
-    DEBUG("INFO: scanning with rdp, path = %s\n", path);
+/* Issues the next queued operation of srv: a getattr or removal if any, since the queue must not
+ * grow while the listing races ahead, or else the next batch of a directory, but only while the
+ * queues are short. Returns 1 if an operation was dequeued, whether or not it could be issued. */
+int ev_issue_next(struct ev_loop_s *ev, struct ev_server_s *srv)
+{
+    struct ev_op_s *op = srv->op_head;
+    struct ev_dir_s *dir = srv->ready;
+    int issue_op = op && (op->type != EV_OP_REMOVE || opts.remove_window == 0 ||
+                          ev->rm_inflight < opts.remove_window);
+    int ret;
 
-    /* Set up the fs_id to be used later when converting from PVFS_sys_attr to struct stat. */
-    dirent_ref.fs_id = dir_refp->fs_id;
+    if(!issue_op && (!dir || ev->op_queued >= ev->window))
+    {
+        return 0;
+    }
 
-    while(1)
+    if(ev_rate_take(ev) != 0)
     {
-        int i = 0;
+        return 0;
+    }
 
-        memset(&rdplus_response, 0, sizeof(PVFS_sysresp_readdirplus));
-        ret = PVFS_sys_readdirplus(*dir_refp,
-                                token,
-                                PVFS_REQ_LIMIT_DIRENT_COUNT_READDIRPLUS,
-                                &creds,
-                                PVFS_ATTR_SYS_ALL_NOHINT,
-                                &rdplus_response,
-                                NULL);
+    if(issue_op)
+    {
+        srv->op_head = op->next;
+        if(!srv->op_head)
+        {
+            srv->op_tail = NULL;
+        }
+        ev->op_queued--;
 
-        if(ret < 0)
+        ret = ev_issue(ev, op);
+        if(ret < 0 && op->type == EV_OP_GETATTR)
         {
-            fprintf(stderr,
-                    "%s: ERROR: PVFS_sys_readdirplus failed with ret= %d\n",
-                    __func__,
-                    ret);
-            ret = -1;
-            goto cleanup;
+            if(ev_getattr_done(ev, op, ret) != 0)
+            {
+                ev->failed = 1;
+            }
+            free(op);
+        }
+        else if(ret < 0 && op->type == EV_OP_GETEATTR)
+        {
+            if(ev_geteattr_done(ev, op, ret) != 0)
+            {
+                ev->failed = 1;
+            }
+            free(op);
+        }
+        else if(ret < 0 && op->type == EV_OP_LOOKUP)
+        {
+            if(ev_lookup_done(ev, op, ret) != 0)
+            {
+                ev->failed = 1;
+            }
+            free(op);
         }
+        else if(ret < 0)
+        {
+            /* Account for it exactly as a failed blocking removal. */
+            char failed_path[PVFS_PATH_MAX];
 
-        entry_count += rdplus_response.pvfs_dirent_outcount;
+            snprintf(failed_path, PVFS_PATH_MAX, "%s/%s", op->dir->path, op->name);
+            account_removal(&pstats,
+                            &powners,
+                            op->owner,
+                            op->group,
+                            failed_path,
+                            op->size,
+                            ret);
+            op->dir->removes_pending--;
+            ev_dir_put(op->dir);
+            free(op);
+        }
+        return 1;
+    }
 
-        if(rdplus_response.pvfs_dirent_outcount)
+    op = (struct ev_op_s *) malloc(sizeof(struct ev_op_s));
+    if(!op)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate operation\n", __func__);
+        ev->failed = 1;
+        return 0;
+    }
+
+    srv->ready = dir->next;
+    ev->ready_count--;
+    op->type = EV_OP_READDIRPLUS;
+    op->dir = dir;
+    op->server = dir->server;
+    ret = ev_issue(ev, op);
+    if(ret < 0)
+    {
+        fprintf(stderr,
+                "%s: ERROR: PVFS_isys_readdirplus failed with ret= %d\n",
+                __func__,
+                ret);
+        free(op);
+        dir->listed = 1;
+        ev_dir_put(dir);
+        ev->failed = 1;
+    }
+    return 1;
+}
+
+/* Issues queued operations until ev->window of them are in flight. The servers take turns,
+ * each issuing at most one operation per turn and none once opts.server_inflight of its operations
+ * are in flight. */
+void ev_issue_queued(struct ev_loop_s *ev)
+{
+    int issued = 1;
+
+    while(issued && !ev->failed && ev->inflight_count < ev->window)
+    {
+        int i;
+
+        issued = 0;
+        for(i = 0; i < ev->servers_count && !ev->failed &&
+                   ev->inflight_count < ev->window; i++)
         {
-            for(i = 0; i < rdplus_response.pvfs_dirent_outcount; i++)
+            struct ev_server_s *srv = &ev->servers[(ev->server_next + i) % ev->servers_count];
+
+            if(opts.server_inflight > 0 && srv->inflight >= opts.server_inflight)
             {
-                struct stat buf;
+                continue;
+            }
+            issued += ev_issue_next(ev, srv);
+        }
+        ev->server_next = (ev->server_next + 1) % ev->servers_count;
+    }
+}
 
-                DEBUG("INFO: rdplus_response.dirent_array[%u].d_name = %s\n",
-                      i,
-                      rdplus_response.dirent_array[i].d_name);
-                DEBUG("INFO: rdplus_response.attr_array[%u].size = %llu\n",
-                      i,
-                      LLU(rdplus_response.attr_array[i].size));
+/* Walks the directory tree with the event loop walker, see struct ev_dir_s. */
+int walk_event_loop(char *path, PVFS_object_ref *dir_refp)
+{
+    struct ev_loop_s ev;
+    PVFS_sys_op_id *op_ids = NULL;
+    void **user_ptrs = NULL;
+    int *error_codes = NULL;
+    int ret = 0;
+    int s;
 
-                /* Must fill in the handle from the dirent prior to converting attributes from
-                 * PVFS_sys_attr to stat. */
-                dirent_ref.handle = rdplus_response.dirent_array[i].handle;
-                ret = sys_attr_to_stat(&buf, &rdplus_response.attr_array[i], dirent_ref);
-                if(ret < 0)
-                {
-                    fprintf(stderr,
-                            "%s: ERROR: sys_attr_to_stat failed with ret= %d\n",
-                            __func__,
-                            ret);
-                    ret = -1;
-                    goto cleanup;
-                }
+    memset(&ev, 0, sizeof(struct ev_loop_s));
+    ev.inflight_max = opts.event_loop;
+    ev.window = opts.adaptive ? 1 : ev.inflight_max;
+    ev.slow_start = 1;
+    clock_gettime(CLOCK_MONOTONIC, &ev.started);
+    ev.inflight = (struct ev_op_s **) calloc(ev.inflight_max, sizeof(struct ev_op_s *));
+    op_ids = (PVFS_sys_op_id *) calloc(ev.inflight_max, sizeof(PVFS_sys_op_id));
+    user_ptrs = (void **) calloc(ev.inflight_max, sizeof(void *));
+    error_codes = (int *) calloc(ev.inflight_max, sizeof(int));
+    ev.dirent_path = (char *) malloc(PVFS_PATH_MAX);
+    if(!ev.inflight || !op_ids || !user_ptrs || !error_codes || !ev.dirent_path)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate %d operations\n", __func__, ev.inflight_max);
+        ret = -1;
+        goto cleanup;
+    }
 
-                /* **ALWAYS** zero the bytes after the parent directory. */
-                memset(&dirent_path[dir_len], 0, PVFS_PATH_MAX - dir_len);
-                DEBUG("INFO: dirent_path = %s\n",
-                      dirent_path);
-                dirent_path[dir_len] = '/';
+    if(ev_servers_init(&ev, dir_refp->fs_id) != 0)
+    {
+        ret = -1;
+        goto cleanup;
+    }
 
-                /* Copy starting after the '/' character. */
-                strncpy(&dirent_path[dir_len + 1],
-                        rdplus_response.dirent_array[i].d_name,
-                        PATH_MAX - 1 - dir_len - 1);
+    if(exclude_match(path))
+    {
+        pstats.excluded_dirs++;
+    }
+    else if(!ev_dir_new(&ev,
+                            path,
+                            *dir_refp,
+                            basis_of_path(path),
+                            EXEMPT_UNKNOWN,
+                            NULL))
+    {
+        ret = -1;
+        goto cleanup;
+    }
 
-                DEBUG("INFO: dirent_path = %s\n", dirent_path);
+    while(ev.inflight_count > 0 || (!ev.failed && (ev.ready_count > 0 || ev.op_queued > 0)))
+    {
+        int timeout_ms;
+        int count = 0;
+        int i;
 
-                /* file/link/dir? */
-                if(S_ISREG(buf.st_mode))
-                {
-                    DEBUG("\t\tFILE\n");
+        ev.rate_wait_ns = 0;
+        ev_issue_queued(&ev);
 
-                    if(buf.st_atime < (time_t) removal_basis_time &&
-                       buf.st_mtime < (time_t) removal_basis_time)
-                    {
-                        if(opts.log_removed_files)
-                        {
-                            fprintf(logp, "R\t%s\n", dirent_path);
-                        }
+        if(ev.inflight_count == 0)
+        {
+            if(ev.rate_wait_ns > 0)
+            {
+                /* Nothing to wait for but the rate limiter. */
+                struct timespec ts;
 
-                        if(!opts.dry_run)
-                        {
-                            ret = PVFS_sys_remove(rdplus_response.dirent_array[i].d_name,
-                                                *dir_refp,
-                                                &creds,
-                                                NULL);
-                            if(ret < 0)
-                            {
-                                pstats.frm_fils++;
-                                pstats.frm_bytes += buf.st_size;
-                                PVFS_perror("PVFS_sys_remove", ret);
-                                fprintf(stderr,
-                                        "%s: WARNING: failed to remove path = %s\n",
-                                        __func__,
-                                        dirent_path);
-                                PVFS_util_release_sys_attr(&rdplus_response.attr_array[i]);
-                                continue;
-                            }
-                        }
+                ts.tv_sec = ev.rate_wait_ns / 1000000000;
+                ts.tv_nsec = ev.rate_wait_ns % 1000000000;
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
 
-                        pstats.rm_fils++;
-                        pstats.rm_bytes += buf.st_size;
+        count = ev.inflight_count;
+        for(i = 0; i < count; i++)
+        {
+            op_ids[i] = ev.inflight[i]->op_id;
+        }
 
-                    }
-                    else
-                    {
-                        if(opts.log_kept_files)
-                        {
-                            fprintf(logp, "K\t%s\n", dirent_path);
-                        }
+        /* Come back in time to issue more operations once the rate limiter allows it. */
+        timeout_ms = 100;
+        if(ev.rate_wait_ns > 0 && ev.rate_wait_ns / 1000000 < timeout_ms)
+        {
+            timeout_ms = ev.rate_wait_ns / 1000000 + 1;
+        }
 
-                        pstats.kept_fils++;
-                        pstats.kept_bytes += buf.st_size;
-                    }
+        ret = PVFS_sys_testsome(op_ids, &count, user_ptrs, error_codes, timeout_ms);
+        if(ret < 0)
+        {
+            /* The operations in flight can no longer be waited for, see the cleanup below. */
+            PVFS_perror("PVFS_sys_testsome", ret);
+            ev.failed = 1;
+            break;
+        }
 
-#if DEBUG_ON == 1
-                    char *readable_time = NULL;
-                    DEBUG("INFO: atime was %llu or %s",
-                          LLU(buf.st_atime),
-                          (readable_time = human_readable_time((PVFS_time) buf.st_atime)));
-                    free(readable_time);
-#endif
+        for(i = 0; i < count; i++)
+        {
+            struct ev_op_s *op = (struct ev_op_s *) user_ptrs[i];
+            struct ev_dir_s *dir = op->dir;
+            int j;
+
+            PVFS_sys_release(op_ids[i]);
+            ev.servers[op->server].inflight--;
+            if(opts.adaptive)
+            {
+                ev_adapt(&ev, op);
+            }
 
+            /* Forget the completed operation. */
+            for(j = 0; j < ev.inflight_count; j++)
+            {
+                if(ev.inflight[j] == op)
+                {
+                    ev.inflight[j] = ev.inflight[--ev.inflight_count];
+                    break;
                 }
-                else if(S_ISDIR(buf.st_mode))
+            }
+
+            if(op->type == EV_OP_READDIRPLUS)
+            {
+                if(error_codes[i] < 0)
                 {
-                    DEBUG("\t\tDIR\n");
-                    pstats.dirs++;
-                    /* Recurse! */
-                    ret = walk_rdp_and_purge(dirent_path, &dirent_ref);
-                    if(ret != 0)
-                    {
-                        PVFS_util_release_sys_attr(&rdplus_response.attr_array[i]);
-                        return -1;
-                    }
+                    fprintf(stderr,
+                            "%s: ERROR: PVFS_isys_readdirplus failed with ret= %d\n",
+                            __func__,
+                            error_codes[i]);
+                    dir->listed = 1;
+                    ev.failed = 1;
                 }
-                else if(S_ISLNK(buf.st_mode))
+                else if(ev_batch_start(&ev, dir) != 0)
                 {
-                    DEBUG("\t\tLNK\n");
-                    pstats.lnks++;
+                    ev.failed = 1;
                 }
-                else
+            }
+            else if(op->type == EV_OP_GETATTR)
+            {
+                if(ev_getattr_done(&ev, op, error_codes[i]) != 0)
                 {
-                    fprintf(stderr,
-                            "%s: ERROR: UNRECOGNIZED DIRENT TYPE at path: %s\n",
-                            __func__,
-                            dirent_path);
-                    pstats.unknown++;
+                    ev.failed = 1;
+                }
+            }
+            else if(op->type == EV_OP_GETEATTR)
+            {
+                if(ev_geteattr_done(&ev, op, error_codes[i]) != 0)
+                {
+                    ev.failed = 1;
+                }
+            }
+            else if(op->type == EV_OP_LOOKUP)
+            {
+                if(ev_lookup_done(&ev, op, error_codes[i]) != 0)
+                {
+                    ev.failed = 1;
                 }
+            }
+            else
+            {
+                char removed_path[PVFS_PATH_MAX];
 
-                PVFS_util_release_sys_attr(&rdplus_response.attr_array[i]);
+                snprintf(removed_path, PVFS_PATH_MAX, "%s/%s", dir->path, op->name);
+                account_removal(&pstats,
+                                &powners,
+                                op->owner,
+                                op->group,
+                                removed_path,
+                                op->size,
+                                error_codes[i]);
+                dir->removes_pending--;
+                ev.rm_inflight--;
+            }
 
-            } /* Done iterating over gathered entries and stats */
+            ev_dir_put(dir);
+            free(op);
+        }
+    }
 
-            /* TODO Why must I do this pointer arithmetic below?!
-             * Is there a problem with PINT_MALLOC?
-             * Why can't I just free! */
-#if USING_PINT_MALLOC == 1
-            /* TODO This was required prior to OrangeFS 2.9.5or6? */
-            free((char *) (rdplus_response.dirent_array) - 32);
-            free((char *) (rdplus_response.stat_err_array) - 32);
-            free((char *) (rdplus_response.attr_array) - 32);
-#else
-            /* This seems to work in version OrangeFS 2.9.6 */
-            free(rdplus_response.dirent_array);
-            free(rdplus_response.stat_err_array);
-            free(rdplus_response.attr_array);
-#endif
+    if(ev.failed)
+    {
+        ret = -1;
+    }
 
-        } /* Check for more dirents via PVFS_sys_readdirplus! */
+cleanup:
+    log_chunk_submit(&ev.log_chunk);
+    log_chunk_submit(&ev.rec_chunk);
 
-        if(rdplus_response.token == PVFS_ITERATE_END)
+    if(opts.adaptive)
+    {
+        ev_log_concurrency(&ev, 1);
+    }
+
+    if(ev.throttled)
+    {
+        __sync_add_and_fetch(&rate_throttled_ns,
+                             (uint64_t) (elapsed_seconds(&ev.throttled_since) * 1000000000.0));
+    }
+
+    /* Only non-empty after a failure. The ready directories go first, a directory whose next batch
+     * was requested early may still be waiting for queued fetches. Operations are only left in
+     * flight when PVFS_sys_testsome failed: the library may still write to their buffers, so those
+     * and every directory and operation are left alone. */
+    for(s = 0; s < ev.servers_count && ev.inflight_count == 0; s++)
+    {
+        struct ev_server_s *srv = &ev.servers[s];
+
+        while(srv->ready)
         {
-            break;
+            struct ev_dir_s *dir = srv->ready;
+
+            srv->ready = dir->next;
+            dir->listed = 1;
+            ev_dir_put(dir);
         }
+    }
+    for(s = 0; s < ev.servers_count && ev.inflight_count == 0; s++)
+    {
+        struct ev_server_s *srv = &ev.servers[s];
 
-        token = rdplus_response.token;
+        while(srv->op_head)
+        {
+            struct ev_op_s *op = srv->op_head;
+
+            srv->op_head = op->next;
+            if(op->type == EV_OP_REMOVE)
+            {
+                op->dir->removes_pending--;
+                ev_dir_put(op->dir);
+            }
+            else
+            {
+                if(op->type == EV_OP_GETEATTR && op->index < 0)
+                {
+                    /* Nor will those of the directories waiting for its tag. */
+                    struct tag_wait_s *wait = tag_publish(tag_handle(&op->dir->rdplus_response,
+                                                                     op->dir->ref.handle,
+                                                                     op->dir->tag_above,
+                                                                     op->dir->tag_above_count,
+                                                                     op->index),
+                                                          1);
 
-    } /* END while(1) */
+                    while(wait)
+                    {
+                        struct tag_wait_s *next = wait->next;
+
+                        ev_fetch_abandon(wait->dir);
+                        free(wait);
+                        wait = next;
+                    }
+                }
+                ev_fetch_abandon(op->dir);
+            }
+            free(op);
+        }
+    }
+    free(ev.servers);
+    free(ev.inflight);
+    free(ev.dirent_path);
+    free(op_ids);
+    free(user_ptrs);
+    free(error_codes);
 
-cleanup:
-    free(dirent_path);
-    DEBUG("INFO: entry_count = %llu\n",
-          LLU(entry_count));
     return ret;
 }
 
-
 /* This program accepts options defined above and following them **one** directory argugument, the
- * absolute path of the directory tree to be walked for purging of expired files. */
+ * absolute path of the directory tree to be walked for purging of expired files, or several of them
+ * (see roots_collect). */
 int main(int argc, char **argv)
 {
     PVFS_time current_time = 0LL;
-    PVFS_time finish_time = 0LL;
     PVFS_time creds_timeout = 0LL;
-    char *current_time_str = NULL;
-    char *removal_basis_time_str = NULL;
-    char *finish_time_str = NULL;
     char *dir = NULL;
     char *dry_run_str = NULL;
-    char log_path[PATH_MAX] = { 0 };
-    char resolved_path[PVFS_PATH_MAX] = { 0 };
-    struct stat arg_stat;
+    char index_tmp_path[PATH_MAX] = { 0 };
+    struct timespec walk_start;
+    double walk_secs = 0.0;
     PVFS_object_ref dir_ref;
-    PVFS_sysresp_lookup lk_response;
     int ret;
     int c;
     PVFS_fs_id fs_id;
@@ -709,25 +8762,189 @@ int main(int argc, char **argv)
 
     orangefs_purge_option_init(&opts);
 
-    while((c = getopt_long(argc, argv, "?dhl:r:", long_opts, NULL)) != -1)
+    while((c = getopt_long(argc, argv, "?dhl:r:t:", long_opts, NULL)) != -1)
     {
         switch (c)
         {
             case 'd':
                 opts.dry_run = 1;
                 break;
-            case 'l':
-                opts.log_dir = strdup(optarg);
+            case 'l':
+                opts.log_dir = strdup(optarg);
+                break;
+            case LOG_REMOVED_FILES:
+                opts.log_removed_files = 1;
+                break;
+            case LOG_KEPT_FILES:
+                opts.log_kept_files = 1;
+                break;
+            case PREFETCH:
+                opts.prefetch = 1;
+                break;
+            case REMOVE_WINDOW:
+                opts.remove_window = atoi(optarg);
+                if(opts.remove_window < 0)
+                {
+                    fprintf(stderr, "ERROR: --remove-window must not be negative\n");
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case MEMORY_BUDGET:
+                if(parse_size(optarg, &opts.memory_budget) != 0)
+                {
+                    fprintf(stderr, "ERROR: invalid --memory-budget: %s\n", optarg);
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case KEPT_BYTES:
+                if(strcmp(optarg, "exact") == 0)
+                {
+                    opts.kept_bytes_mode = KEPT_BYTES_EXACT;
+                }
+                else if(strcmp(optarg, "estimate") == 0)
+                {
+                    opts.kept_bytes_mode = KEPT_BYTES_ESTIMATE;
+                }
+                else if(strcmp(optarg, "omit") == 0)
+                {
+                    opts.kept_bytes_mode = KEPT_BYTES_OMIT;
+                }
+                else
+                {
+                    fprintf(stderr, "ERROR: invalid --kept-bytes: %s\n", optarg);
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case ADAPTIVE:
+                opts.adaptive = 1;
+                break;
+            case INDEX:
+                opts.index_path = strdup(optarg);
+                break;
+            case FULL:
+                opts.full = 1;
+                break;
+            case CHECKPOINT:
+                opts.checkpoint_path = strdup(optarg);
+                break;
+            case CHECKPOINT_INTERVAL:
+                opts.checkpoint_interval = atoi(optarg);
+                if(opts.checkpoint_interval < 0)
+                {
+                    fprintf(stderr, "ERROR: --checkpoint-interval must not be negative\n");
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case RESUME:
+                opts.resume = 1;
+                break;
+            case RATE:
+                opts.rate = strtod(optarg, NULL);
+                if(opts.rate < 0.0)
+                {
+                    fprintf(stderr, "ERROR: --rate must not be negative\n");
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case RATE_SCHEDULE:
+                if(parse_rate_schedule(optarg) != 0)
+                {
+                    fprintf(stderr, "ERROR: invalid --rate-schedule: %s\n", optarg);
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case SERVER_INFLIGHT:
+                opts.server_inflight = atoi(optarg);
+                if(opts.server_inflight < 1)
+                {
+                    fprintf(stderr, "ERROR: --server-inflight must be at least 1\n");
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case SIZE_SAMPLE:
+                opts.size_sample = atoi(optarg);
+                if(opts.size_sample < 1)
+                {
+                    fprintf(stderr, "ERROR: --size-sample must be at least 1\n");
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case EXCLUDE_FILE:
+                opts.exclude_file = strdup(optarg);
+                break;
+            case COST_TABLE:
+                opts.cost_table_path = strdup(optarg);
+                break;
+            case COST_LOGS:
+                opts.cost_logs_dir = strdup(optarg);
+                break;
+            case MAX_DURATION:
+                opts.max_duration = atoi(optarg);
+                if(opts.max_duration < 0)
+                {
+                    fprintf(stderr, "ERROR: --max-duration must not be negative\n");
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case DEFERRED:
+                opts.deferred_path = strdup(optarg);
+                break;
+            case LOG_RECORDS:
+                opts.log_records = 1;
+                break;
+            case LOG_COMPRESSED:
+                opts.log_compressed = 1;
+                break;
+            case UID_STATS:
+                opts.uid_stats = 1;
+                break;
+            case POLICY:
+                opts.policy_path = strdup(optarg);
+                break;
+            case BASIS_MAP:
+                opts.basis_map_path = strdup(optarg);
+                break;
+            case MARKER:
+                opts.marker = strdup(optarg);
+                break;
+            case MARKER_SUBTREE:
+                opts.marker_subtree = 1;
+                break;
+            case EXEMPT_XATTR:
+                opts.exempt_xattr = strdup(optarg);
                 break;
-            case LOG_REMOVED_FILES:
-                opts.log_removed_files = 1;
+            case GID_STATS:
+                opts.gid_stats = 1;
                 break;
-            case LOG_KEPT_FILES:
-                opts.log_kept_files = 1;
+            case LOG_BUFFER:
+                if(parse_size(optarg, &opts.log_buffer) != 0)
+                {
+                    fprintf(stderr, "ERROR: invalid --log-buffer: %s\n", optarg);
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case USERS_DIR:
+                opts.users_dir = 1;
+                break;
+            case EVENT_LOOP:
+                opts.event_loop = atoi(optarg);
+                if(opts.event_loop < 1)
+                {
+                    fprintf(stderr, "ERROR: --event-loop must be at least 1\n");
+                    usage(EXIT_FAILURE);
+                }
                 break;
             case 'r':
                 opts.removal_basis_time = strtoull(optarg, NULL, 0);
                 break;
+            case 't':
+                opts.threads = atoi(optarg);
+                if(opts.threads < 1)
+                {
+                    fprintf(stderr, "ERROR: --threads must be at least 1\n");
+                    usage(EXIT_FAILURE);
+                }
+                break;
             case '?':
             case 'h':
                 usage(EXIT_SUCCESS);
@@ -743,6 +8960,131 @@ int main(int argc, char **argv)
         usage(EXIT_FAILURE);
     }
 
+    roots_multi = opts.users_dir || argc - optind > 1;
+
+    if(opts.users_dir && argc - optind > 1)
+    {
+        fprintf(stderr, "ERROR: --users-dir takes a single directory\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(roots_multi && (opts.event_loop || opts.index_path || opts.checkpoint_path))
+    {
+        fprintf(stderr,
+                "ERROR: several directories cannot be purged with --event-loop, --index or "
+                "--checkpoint\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if((opts.max_duration > 0 || opts.deferred_path) && !roots_multi)
+    {
+        fprintf(stderr,
+                "ERROR: --max-duration and --deferred require --users-dir or several"
+                " directories\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.cost_logs_dir && !roots_multi)
+    {
+        fprintf(stderr, "ERROR: --cost-logs requires --users-dir or several directories\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.cost_table_path && (opts.event_loop || opts.checkpoint_path))
+    {
+        fprintf(stderr,
+                "ERROR: --cost-table cannot be combined with --event-loop or --checkpoint\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.event_loop && opts.threads > 1)
+    {
+        fprintf(stderr, "ERROR: --event-loop cannot be combined with --threads\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.adaptive && !opts.event_loop)
+    {
+        fprintf(stderr, "ERROR: --adaptive requires --event-loop\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.server_inflight && !opts.event_loop)
+    {
+        fprintf(stderr, "ERROR: --server-inflight requires --event-loop\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.index_path && opts.event_loop)
+    {
+        fprintf(stderr, "ERROR: --index cannot be combined with --event-loop\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.full && !opts.index_path)
+    {
+        fprintf(stderr, "ERROR: --full requires --index\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.checkpoint_path && (opts.event_loop || opts.index_path))
+    {
+        fprintf(stderr, "ERROR: --checkpoint cannot be combined with --event-loop or --index\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.resume && !opts.checkpoint_path)
+    {
+        fprintf(stderr, "ERROR: --resume requires --checkpoint\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.basis_map_path && opts.policy_path)
+    {
+        fprintf(stderr, "ERROR: --basis-map cannot be combined with --policy\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.marker && (opts.marker[0] == 0 || strchr(opts.marker, '/')))
+    {
+        fprintf(stderr, "ERROR: --marker takes the name of an entry, not a path\n");
+        usage(EXIT_FAILURE);
+    }
+
+    /* An unchanged directory skipped thanks to the index is not listed, so the marker it may hold
+     * would not reach its subdirectories. */
+    if(opts.marker_subtree && (!opts.marker || opts.index_path))
+    {
+        fprintf(stderr, "ERROR: --marker-subtree requires --marker and cannot be combined with "
+                "--index\n");
+        usage(EXIT_FAILURE);
+    }
+
+    /* Likewise for the tag of a directory. */
+    if(opts.exempt_xattr && (opts.exempt_xattr[0] == 0 || opts.index_path))
+    {
+        fprintf(stderr, "ERROR: --exempt-xattr takes a name and cannot be combined with --index\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.policy_path && (opts.removal_basis_time != 0 || opts.index_path))
+    {
+        fprintf(stderr,
+                "ERROR: --policy cannot be combined with --removal-basis-time or --index\n");
+        usage(EXIT_FAILURE);
+    }
+
+    if(opts.kept_bytes_mode != KEPT_BYTES_EXACT)
+    {
+        /* Everything classify_dirent needs, the sizes are fetched later when needed. */
+        rdplus_attrmask = PVFS_ATTR_SYS_TYPE | PVFS_ATTR_SYS_ATIME | PVFS_ATTR_SYS_MTIME;
+        if(opts.uid_stats || opts.gid_stats || opts.log_records || opts.policy_path)
+        {
+            /* Cheap, unlike the size. */
+            rdplus_attrmask |= PVFS_ATTR_SYS_UID | PVFS_ATTR_SYS_GID;
+        }
+    }
+
     /* Dry Run? */
     dry_run_str = getenv(DRY_RUN_ENV_VAR);
     if(dry_run_str)
@@ -794,145 +9136,304 @@ int main(int argc, char **argv)
     DEBUG("INFO: Credential timeout is %f days in the future.\n",
           ((float)(creds.timeout - current_time) / DAY_SECS));
 
-    if((ret = lstat(dir, &arg_stat)))
+    /* NOTE Files with atime and mtime less than removal_basis_time will be removed. */
+
+    /* Since a timestamp of 0 predates OrangeFS, for this program, it is safe to assume the
+     * removal_basis_time was not configured by the user or the user is indicating they wan't to
+     * use the default removal policy of 31 days prior to this program's execution start time as
+     * calculated below. */
+    if(opts.removal_basis_time == 0)
+    {
+        removal_basis_time = current_time - THIRTYONE_DAYS_SECS;
+    }
+    else
+    {
+        removal_basis_time = opts.removal_basis_time;
+    }
+
+    if(opts.basis_map_path && basis_map_load(opts.basis_map_path, current_time) != 0)
     {
-        perror("ERROR: Could not stat path supplied as the first argument, reason= ");
         ret = -1;
         goto cleanup_cred;
     }
 
-    if((arg_stat.st_mode & S_IFMT) != S_IFDIR)
+    if(opts.exclude_file && exclude_load(opts.exclude_file) != 0)
     {
-        fprintf(stderr,
-                "ERROR: supplied argument is a valid path but not a directory! path = %s\n",
-                dir);
         ret = -1;
         goto cleanup_cred;
     }
 
-    ret = PVFS_util_resolve(dir,
-                            &fs_id,
-                            resolved_path,
-                            PVFS_PATH_MAX);
+    if(opts.policy_path)
+    {
+        if(policy_load(opts.policy_path, current_time) != 0)
+        {
+            ret = -1;
+            goto cleanup_cred;
+        }
+        /* Unless exact, sizes are only fetched once a file is known to be removed. */
+        if((policy_fields & (1 << POLICY_SIZE)) && opts.kept_bytes_mode != KEPT_BYTES_EXACT)
+        {
+            fprintf(stderr, "ERROR: a --policy testing the size requires --kept-bytes exact\n");
+            ret = -1;
+            goto cleanup_cred;
+        }
+    }
 
-    if (ret < 0)
+    if(roots_multi)
+    {
+        /* --max-duration counts from here. */
+        clock_gettime(CLOCK_MONOTONIC, &roots_started);
+
+        /* Every root gets its own log, see root_start and root_finish. */
+        if(roots_collect(&argv[optind], argc - optind) != 0 ||
+           (opts.cost_table_path && roots_count > 0 &&
+            cost_load(opts.cost_table_path, roots[0].ref.fs_id) != 0) ||
+           (opts.deferred_path && roots_count > 0 &&
+            roots_deferred_load(opts.deferred_path, roots[0].ref.fs_id) != 0))
+        {
+            ret = -1;
+            goto cleanup_cred;
+        }
+        roots_order();
+        if(roots_queue_init() != 0 || log_writer_start() != 0)
+        {
+            ret = -1;
+            goto cleanup_cred;
+        }
+
+        ret = walk_tree(NULL, NULL);
+        log_writer_stop();
+        if(ret == 0 && opts.cost_table_path)
+        {
+            cost_write(opts.cost_table_path);
+        }
+        if(ret == 0 && opts.deferred_path && roots_deferred_write(opts.deferred_path) != 0)
+        {
+            ret = -1;
+        }
+        if(roots_failed > 0)
+        {
+            ret = -1;
+        }
+        goto cleanup_cred;
+    }
+
+    if(root_resolve(dir, &dir_ref) != 0)
     {
-        fprintf(stderr,
-                "%s: ERROR: PVFS_util_resolve failed, could not find"
-                " file system for %s\n",
-                __func__,
-                dir);
         ret = -1;
         goto cleanup_cred;
     }
+    fs_id = dir_ref.fs_id;
 
-    /* Resolved path does not include the OrangeFS mount prefix e.g. /mnt/orangefs */
-    DEBUG("INFO: PVFS path resolved. fs_id = %d, resolved_path = %s\n",
-          fs_id,
-          resolved_path);
+    if(opts.index_path)
+    {
+        struct index_header_s header;
 
-    if(strlen(resolved_path) == 0)
+        if(index_load(opts.index_path, fs_id, dir_ref.handle) != 0)
+        {
+            ret = -1;
+            goto cleanup_cred;
+        }
+
+        /* The new index replaces the previous one once the walk has succeeded. */
+        snprintf(index_tmp_path, PATH_MAX, "%s.tmp", opts.index_path);
+        index_out = fopen(index_tmp_path, "w");
+        if(!index_out)
+        {
+            perror("ERROR: Could not create the index, reason= ");
+            ret = -1;
+            goto cleanup_cred;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.fs_id = fs_id;
+        header.root_handle = dir_ref.handle;
+        if(fwrite(&header, sizeof(header), 1, index_out) != 1)
+        {
+            index_failed = 1;
+        }
+    }
+
+    if(opts.cost_table_path && cost_load(opts.cost_table_path, fs_id) != 0)
     {
-        DEBUG("INFO: Detected a resolved path of length == 0. "
-              "Continuing assuming the OrangeFS '/' path was the intended target.\n");
-        resolved_path[0] = '/';
-        resolved_path[1] = 0;
+        ret = -1;
+        goto cleanup_cred;
     }
 
-    /* What directory are we scanning? */
-    ret = PVFS_sys_lookup(fs_id,
-                          resolved_path,
-                          &creds,
-                          &lk_response,
-                          PVFS2_LOOKUP_LINK_NO_FOLLOW,
-                          NULL);
-    if(ret < 0)
+    if(opts.resume && checkpoint_load(opts.checkpoint_path, fs_id, dir_ref.handle) != 0)
     {
-        PVFS_perror("ERROR: PVFS_sys_lookup", ret);
         ret = -1;
         goto cleanup_cred;
     }
 
-    dir_ref.handle = lk_response.ref.handle;
-    dir_ref.fs_id = fs_id;
+    if(opts.checkpoint_path)
+    {
+        struct sigaction sa;
 
-    DEBUG("INFO: dir_ref.handle = %llu, dir_ref.fs_id = %d\n",
-          LLU(dir_ref.handle),
-          dir_ref.fs_id);
+        /* Checkpoint and stop rather than die, see checkpoint_park. */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = checkpoint_sigterm;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGTERM, &sa, NULL);
+    }
 
-    /* Convert time to human readable string format. */
-    current_time_str = human_readable_time(current_time);
+    logp = log_open(dir, current_time, &summaryp);
+    roots = (struct root_s *) calloc(1, sizeof(struct root_s));
+    if(!roots)
+    {
+        fprintf(stderr, "%s: ERROR: could not allocate the root\n", __func__);
+        ret = -1;
+        goto cleanup_cred;
+    }
+    roots_count = 1;
+    roots[0].path = dir;
+    roots[0].ref = dir_ref;
+    roots[0].logp = logp;
+    roots[0].summaryp = summaryp;
+    if(opts.log_records &&
+       (roots[0].records = record_log_open(dir, current_time, fs_id)))
+    {
+        uint64_t j;
 
-    /* NOTE Files with atime and mtime less than removal_basis_time will be removed. */
+        record_log_top(roots[0].records, dir_ref.handle, dir);
+        /* Resumed from --checkpoint. */
+        for(j = 0; j < checkpoint_items_count; j++)
+        {
+            record_log_top(roots[0].records,
+                           checkpoint_items[j].ref.handle,
+                           checkpoint_items[j].path);
+        }
+    }
+    if(opts.log_compressed && (opts.log_removed_files || opts.log_kept_files))
+    {
+        roots[0].lines = line_log_open(dir, current_time);
+    }
 
-    /* Since a timestamp of 0 predates OrangeFS, for this program, it is safe to assume the
-     * removal_basis_time was not configured by the user or the user is indicating they wan't to
-     * use the default removal policy of 31 days prior to this program's execution start time as
-     * calculated below. */
-    if(opts.removal_basis_time == 0)
+    if(log_writer_start() != 0)
     {
-        removal_basis_time = current_time - THIRTYONE_DAYS_SECS;
+        ret = -1;
+        goto cleanup_cred;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &walk_start);
+
+    if(opts.event_loop)
+    {
+        ret = walk_event_loop(dir, &dir_ref);
     }
     else
     {
-        removal_basis_time = opts.removal_basis_time;
+        ret = walk_tree(dir, &dir_ref);
     }
+    log_writer_stop();
 
-    removal_basis_time_str = human_readable_time(removal_basis_time);
+    walk_secs = elapsed_seconds(&walk_start);
 
-    /* determine basename of supplied path and embed it in the log file name. */
-    snprintf(log_path,
-             PATH_MAX,
-             "%s/%llu-%s.log",
-             opts.log_dir ? opts.log_dir : DEFAULT_LOG_DIR,
-             LLU(current_time),
-             basename(dir));
-    DEBUG("INFO: log_path\t%s\n", log_path);
-    logp = fopen(log_path, "w");
-    if(!logp)
+    if(ret == 0 && opts.cost_table_path)
     {
-        fprintf(stderr,
-                "ERROR: Couldn't open orangefs-purge log. Now logging to stderr!\n");
-        logp = stderr;
+        cost_write(opts.cost_table_path);
     }
 
-    fprintf(logp, "directory\t%s\n", dir);
-    fprintf(logp, "dry_run\t%s\n", opts.dry_run == 0 ? "false" : "true");
-    fprintf(logp, "current_time\t%llu\n", LLU(current_time));
-    fprintf(logp, "current_time_str\t%s", current_time_str);
-    fprintf(logp, "removal_basis_time\t%llu\n", LLU(removal_basis_time));
-    fprintf(logp, "removal_basis_time_str\t%s", removal_basis_time_str);
-    free(current_time_str);
-    free(removal_basis_time_str);
+    if(opts.checkpoint_path)
+    {
+        if(ret == 0)
+        {
+            /* Nothing left to resume. */
+            unlink(opts.checkpoint_path);
+        }
+        else if(walk_stopped)
+        {
+            fprintf(stderr,
+                    "%s: INFO: walk stopped by SIGTERM, continue it with --resume\n",
+                    __func__);
+        }
+        log_kv(logp,
+               summaryp,
+               "checkpoint_saved\t%s\n",
+               ret != 0 && checkpoint_written ? "true" : "false");
+    }
 
-    ret = walk_rdp_and_purge(dir, &dir_ref);
+    if(index_out)
+    {
+        if(fclose(index_out) != 0)
+        {
+            index_failed = 1;
+        }
+        index_out = NULL;
 
-    finish_time = get_current_time();
-    finish_time_str = human_readable_time(finish_time);
-    fprintf(logp, "finish_time\t%llu\n", LLU(finish_time));
-    fprintf(logp, "finish_time_str\t%s", finish_time_str);
-    free(finish_time_str);
+        if(ret != 0 || index_failed || rename(index_tmp_path, opts.index_path) != 0)
+        {
+            fprintf(stderr,
+                    "%s: WARNING: the index was not updated, index = %s\n",
+                    __func__,
+                    opts.index_path);
+            unlink(index_tmp_path);
+        }
+    }
 
-    fprintf(logp, "duration_seconds\t%llu\n", LLU(finish_time - current_time));
-    log_pstats(logp, &pstats);
-    log_pstats_more(logp, &pstats);
+    log_summary(logp, summaryp, &pstats, &powners, current_time, walk_secs);
 
 cleanup_cred:
     /* NOTE It would be nice to have a cleanup function for apps generating their own creds e.g.
      * PINT_cleanup_credential(&creds); */
 
     free(opts.log_dir);
+    free(opts.rate_windows);
+    free(opts.index_path);
+    free(opts.checkpoint_path);
+    free(opts.exclude_file);
+    exclude_node_free(&exclusions);
+    free(opts.cost_table_path);
+    free(opts.cost_logs_dir);
+    free(opts.deferred_path);
+    free(opts.policy_path);
+    policy_free();
+    free(opts.basis_map_path);
+    free(opts.marker);
+    free(opts.exempt_xattr);
+    basis_map_free();
+    tag_slots_free();
+    checkpoint_items_free();
+    cost_free();
+    free(index_slots);
+    if(index_map)
+    {
+        munmap(index_map, index_map_size);
+    }
+    if(index_out)
+    {
+        fclose(index_out);
+        unlink(index_tmp_path);
+    }
 
-    if(ret == 0)
+    for(c = 0; c < roots_count; c++)
     {
-        fprintf(logp, "purge_success\ttrue\n");
-        fclose(logp);
-        return 0;
+        /* Completed once the log writer has stopped, or left by an aborted walk. */
+        record_log_close(roots[c].records);
+        line_log_close(roots[c].lines);
     }
-    else
+
+    if(roots_multi)
     {
-        fprintf(logp, "purge_success\tfalse\n");
-        fclose(logp);
-        return 1;
+        for(c = 0; c < roots_count; c++)
+        {
+            /* Only roots left unfinished by an aborted walk still have their log open. */
+            if(roots[c].logp)
+            {
+                log_close(roots[c].logp, roots[c].summaryp, -1);
+            }
+            root_saved_free(&roots[c]);
+            free(roots[c].path);
+        }
     }
+    free(roots_queue);
+    free(roots);
+
+    if(logp)
+    {
+        log_close(logp, summaryp, ret);
+    }
+
+    return ret == 0 ? 0 : 1;
 }